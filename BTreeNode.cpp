@@ -4,6 +4,7 @@
  * @see "Seattle University, CPSC5300, Spring 2020"
  */
 
+#include <algorithm>
 #include <cstring>
 #include "BTreeNode.h"
 
@@ -17,13 +18,21 @@ BTreeNode::BTreeNode(HeapFile &file, BlockID block_id, const KeyProfile &key_pro
                                                                                                      file(file),
                                                                                                      id(block_id),
                                                                                                      key_profile(
-                                                                                                             key_profile) {
+                                                                                                             key_profile),
+                                                                                                     dirty(false) {
+    SlottedPage *file_block;
     if (create) {
-        this->block = file.get_new();
-        this->id = this->block->get_block_id();
+        std::lock_guard<FileLatch> guard(file.get_latch());
+        file_block = file.get_new();
     } else {
-        this->block = file.get(block_id);
+        FileLatch::Shared guard(file.get_latch());
+        file_block = file.get(block_id);
     }
+    this->id = file_block->get_block_id();
+    memcpy(this->page, file_block->get_data(), DbBlock::BLOCK_SZ);
+    delete file_block;
+    Dbt dbt(this->page, DbBlock::BLOCK_SZ);
+    this->block = new SlottedPage(dbt, this->id);
 }
 
 BTreeNode::~BTreeNode() {
@@ -32,7 +41,14 @@ BTreeNode::~BTreeNode() {
 }
 
 void BTreeNode::save() {
+    std::lock_guard<FileLatch> guard(this->file.get_latch());
     this->file.put(this->block);
+    this->dirty = false;
+}
+
+void BTreeNode::flush() {
+    if (this->dirty)
+        BTreeNode::save();
 }
 
 // Get the record and turn it into a block ID.
@@ -43,47 +59,179 @@ BlockID BTreeNode::get_block_id(RecordID record_id) const {
     return block_id;
 }
 
-// Get the record and turn it into a Handle.
-Handle BTreeNode::get_handle(RecordID record_id) const {
+// Get the record and turn it into a Handle. Any bytes after the handle are returned in payload (if given).
+Handle BTreeNode::get_handle(RecordID record_id, BTreeKey *payload) const {
     Dbt *dbt = this->block->get(record_id);
     BlockID handle_block_id = *(BlockID *) dbt->get_data();
     RecordID handle_record_id = *(RecordID *) ((char *) dbt->get_data() + sizeof(BlockID));
+    if (payload != nullptr) {
+        u_int32_t handle_size = sizeof(BlockID) + sizeof(RecordID);
+        payload->assign((char *) dbt->get_data() + handle_size, dbt->get_size() - handle_size);
+    }
     delete dbt;
     return Handle(handle_block_id, handle_record_id);
 }
 
-// Get the record and turn it into a KeyValue.
-KeyValue *BTreeNode::get_key(RecordID record_id) const {
+// Get the record and turn it into an (encoded) key.
+BTreeKey BTreeNode::get_key(RecordID record_id) const {
     Dbt *dbt = this->block->get(record_id);
-    char *bytes = (char *) dbt->get_data();
+    BTreeKey key((char *) dbt->get_data(), dbt->get_size());
+    delete dbt;
+    return key;
+}
+
+// Encode a KeyValue into its memcomparable byte string.
+BTreeKey BTreeNode::encode_key(const KeyValue *key_value, const KeyProfile &key_profile) {
+    BTreeKey key;
+    uint col_num = 0;
+    for (auto const &data_type: key_profile)
+        encode_value(key, (*key_value)[col_num++], data_type);
+    return key;
+}
+
+// Append the memcomparable encoding of one key column onto key.
+void BTreeNode::encode_value(BTreeKey &key, const Value &value, ColumnAttribute::DataType data_type) {
+    if (data_type == ColumnAttribute::DataType::INT) {
+        uint32_t n = (uint32_t) value.n ^ 0x80000000U;  // flip the sign bit so negatives sort first
+        key.push_back((char) (n >> 24));
+        key.push_back((char) (n >> 16));
+        key.push_back((char) (n >> 8));
+        key.push_back((char) n);
+
+    } else if (data_type == ColumnAttribute::DataType::TEXT) {
+        if (value.s.length() > UINT16_MAX)
+            throw DbRelationError("text field too long to marshal");
+        for (auto const c: value.s) {
+            key.push_back(c);
+            if (c == '\0')
+                key.push_back('\xff');
+        }
+        key.push_back('\0');
+        key.push_back('\0');
+
+    } else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
+        key.push_back((char) (value.n != 0));
+
+    } else {
+        throw DbRelationError("only know how to marshal INT, TEXT, or BOOLEAN for BTree index");
+    }
+}
+
+// Pull the named columns out of a row and encode them one after the other.
+BTreeKey BTreeNode::encode_columns(const ValueDict *row, const ColumnNames &column_names, const KeyProfile &profile) {
+    BTreeKey encoded;
+    uint col_num = 0;
+    for (auto const &column_name: column_names) {
+        ValueDict::const_iterator column = row->find(column_name);
+        if (column == row->end())
+            throw DbRelationError("index key column '" + column_name + "' missing");
+        encode_value(encoded, column->second, profile[col_num++]);
+    }
+    return encoded;
+}
+
+// Look up the data type of each of the named columns in the relation's schema.
+KeyProfile BTreeNode::column_profile(DbRelation &relation, const ColumnNames &column_names) {
+    std::map<const Identifier, ColumnAttribute::DataType> types_by_colname;
+    const ColumnAttributes column_attributes = relation.get_column_attributes();
+    uint col_num = 0;
+    for (auto const &column_name: relation.get_column_names()) {
+        ColumnAttribute ca = column_attributes[col_num++];
+        types_by_colname[column_name] = ca.get_data_type();
+    }
+    KeyProfile profile;
+    for (auto const &column_name: column_names)
+        profile.push_back(types_by_colname[column_name]);
+    return profile;
+}
+
+// Turn a memcomparable byte string back into a KeyValue (freed by caller).
+KeyValue *BTreeNode::decode_key(const BTreeKey &key, const KeyProfile &key_profile) {
+    const unsigned char *bytes = (const unsigned char *) key.data();
     KeyValue *key_value = new KeyValue();
     Value value;
     uint offset = 0;
-    for (auto const &data_type: this->key_profile) {
+    for (auto const &data_type: key_profile) {
         value.data_type = data_type;
         if (data_type == ColumnAttribute::DataType::INT) {
-            value.n = *(int32_t *) (bytes + offset);
-            offset += sizeof(int32_t);
+            if (offset + 4 > key.size())
+                throw DbRelationError("truncated INT in index key");
+            uint32_t n = ((uint32_t) bytes[offset] << 24) | ((uint32_t) bytes[offset + 1] << 16) |
+                         ((uint32_t) bytes[offset + 2] << 8) | (uint32_t) bytes[offset + 3];
+            value.n = (int32_t) (n ^ 0x80000000U);
+            offset += 4;
         } else if (data_type == ColumnAttribute::DataType::TEXT) {
-            uint16_t size = *(uint16_t *) (bytes + offset);
-            offset += sizeof(uint16_t);
-            char buffer[DbBlock::BLOCK_SZ];
-            memcpy(buffer, bytes + offset, size);
-            buffer[size] = '\0';
-            value.s = std::string(buffer);  // assume ascii for now
-            offset += size;
+            value.s.clear();
+            while (true) {
+                if (offset + 2 > key.size())
+                    throw DbRelationError("unterminated TEXT in index key");
+                if (bytes[offset] == 0 && bytes[offset + 1] == 0)
+                    break;
+                value.s.push_back((char) bytes[offset]);
+                offset += bytes[offset] == 0 ? 2 : 1;  // skip the escape after an embedded 0x00
+            }
+            offset += 2;
         } else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
-            value.n = *(uint8_t *) (bytes + offset);
-            offset += sizeof(uint8_t);
+            if (offset + 1 > key.size())
+                throw DbRelationError("truncated BOOLEAN in index key");
+            value.n = bytes[offset++];
         } else {
             throw DbRelationError("Only know how to unmarshal INT, TEXT, or BOOLEAN");
         }
         key_value->push_back(value);
     }
-    delete dbt;
     return key_value;
 }
 
+// Add a marshaled record to the block, freeing the marshaled bytes whether or not it fits.
+void BTreeNode::add_record(Dbt *dbt) {
+    try {
+        this->block->add(dbt);
+    } catch (DbBlockNoRoomError &e) {
+        delete[] (char *) dbt->get_data();
+        delete dbt;
+        throw;
+    }
+    delete[] (char *) dbt->get_data();
+    delete dbt;
+}
+
+// Insert a record at record_id (renumbering the ones after it) straight from the caller's bytes.
+void BTreeNode::insert_record(RecordID record_id, const void *data, u_int32_t size) {
+    Dbt dbt((void *) data, size);
+    this->block->insert(record_id, &dbt);
+}
+
+// Replace the record at record_id (which may grow) straight from the caller's bytes.
+void BTreeNode::put_record(RecordID record_id, const void *data, u_int32_t size) {
+    Dbt dbt((void *) data, size);
+    this->block->put(record_id, dbt);
+}
+
+// Longest common prefix of two encoded keys.
+BTreeKey BTreeNode::common_prefix(const BTreeKey &a, const BTreeKey &b) {
+    u_long n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n])
+        n++;
+    return a.substr(0, n);
+}
+
+// Shortest prefix of right that still sorts after left (given left < right), for use as a separator.
+BTreeKey BTreeNode::separator(const BTreeKey &left, const BTreeKey &right) {
+    return right.substr(0, common_prefix(left, right).size() + 1);
+}
+
+// How many of a splitting node's size entries it keeps, given that the new one went in at position at.
+// A node on the right edge of the tree that got a new last entry is presumably taking ascending keys, so
+// it keeps right_fill of them and leaves the new node nearly empty for the keys still to come (the caller
+// passes 0.5 for nodes not on the right edge). Any other split is even.
+u_long BTreeNode::split_point(u_long size, u_long at, double right_fill) {
+    if (at + 1 != size)
+        return size / 2;
+    u_long keep = (u_long) (size * right_fill);
+    return std::max((u_long) 1, std::min(size - 1, keep));
+}
+
 // Convert block_id into bytes.
 Dbt *BTreeNode::marshal_block_id(BlockID block_id) {
     char *bytes = new char[sizeof(BlockID)];
@@ -92,58 +240,22 @@ Dbt *BTreeNode::marshal_block_id(BlockID block_id) {
     return dbt;
 }
 
-// Convert handle into bytes.
-Dbt *BTreeNode::marshal_handle(Handle handle) {
-    char *bytes = new char[sizeof(BlockID) + sizeof(RecordID)];
-    Dbt *dbt = new Dbt(bytes, sizeof(BlockID) + sizeof(RecordID));
+// Convert handle (followed by the payload, if any) into bytes.
+Dbt *BTreeNode::marshal_handle(Handle handle, const BTreeKey &payload) {
+    u_int32_t handle_size = sizeof(BlockID) + sizeof(RecordID);
+    char *bytes = new char[handle_size + payload.size()];
+    Dbt *dbt = new Dbt(bytes, handle_size + (u_int32_t) payload.size());
     *(BlockID *) bytes = handle.first;
     *(RecordID *) (bytes + sizeof(BlockID)) = handle.second;
+    memcpy(bytes + handle_size, payload.data(), payload.size());
     return dbt;
 }
 
-// Convert KeyValue into bytes.
-Dbt *BTreeNode::marshal_key(const KeyValue *key) {
-    char *bytes = new char[DbBlock::BLOCK_SZ]; // more than we need
-    uint offset = 0;
-    uint col_num = 0;
-    for (auto const &data_type: this->key_profile) {
-        Value value = (*key)[col_num];
-
-        if (data_type == ColumnAttribute::DataType::INT) {
-            if (offset + 4 > DbBlock::BLOCK_SZ - 4)
-                throw DbRelationError("index key too big to marshal");
-
-            *(int32_t *) (bytes + offset) = value.n;
-            offset += sizeof(int32_t);
-
-        } else if (data_type == ColumnAttribute::DataType::TEXT) {
-            u_long size = (uint16_t) value.s.length();
-            if (size > UINT16_MAX)
-                throw DbRelationError("text field too long to marshal");
-            if (offset + 2 + size > DbBlock::BLOCK_SZ)
-                throw DbRelationError("index key too big to marshal");
-
-            *(uint16_t *) (bytes + offset) = (uint16_t) size;
-            offset += sizeof(uint16_t);
-            memcpy(bytes + offset, value.s.c_str(), size); // assume ascii for now
-            offset += size;
-
-        } else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
-            if (offset + 1 > DbBlock::BLOCK_SZ - 1)
-                throw DbRelationError("index key too big to marshal");
-
-            *(uint8_t *) (bytes + offset) = (uint8_t) value.n;
-            offset += sizeof(uint8_t);
-
-        } else {
-            throw DbRelationError("only know how to marshal INT, TEXT, or BOOLEAN for BTree index");
-        }
-    }
-    char *right_size_bytes = new char[offset];
-    memcpy(right_size_bytes, bytes, offset);
-    delete[] bytes;
-    Dbt *data = new Dbt(right_size_bytes, offset);
-    return data;
+// Convert an encoded key into bytes. The key is already in its on-disk form.
+Dbt *BTreeNode::marshal_key(const BTreeKey &key) {
+    char *bytes = new char[key.size()];
+    memcpy(bytes, key.data(), key.size());
+    return new Dbt(bytes, (u_int32_t) key.size());
 }
 
 
@@ -156,196 +268,239 @@ BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const Ke
                                                                                                                    key_profile,
                                                                                                                    false),
                                                                                                          root_id(new_root),
-                                                                                                         height(1) {
+                                                                                                         height(1),
+                                                                                                         splits(0) {
     save();
 }
 
 BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile &key_profile) : BTreeNode(file, stat_id,
                                                                                                  key_profile, false),
                                                                                        root_id(get_block_id(ROOT)),
-                                                                                       height(get_block_id(HEIGHT)) {
+                                                                                       height(get_block_id(HEIGHT)),
+                                                                                       splits(0) {
+    if (this->block->size() >= SPLITS)  // indices made before splits were counted don't have it
+        this->splits = get_block_id(SPLITS);
 }
 
 void BTreeStat::save() {
-    Dbt *dbt = marshal_block_id(this->root_id);
-    bool is_new = (this->block->size() == 0);
-    if (is_new)
-        this->block->add(dbt);
-    else
-        this->block->put(ROOT, *dbt);
-    delete[] (char *) dbt->get_data();
-    delete dbt;
-
-    dbt = marshal_block_id(this->height);  // not really a block ID but it fits
-    if (is_new)
-        this->block->add(dbt);
-    else
-        this->block->put(HEIGHT, *dbt);
-    delete[] (char *) dbt->get_data();
-    delete dbt;
+    BlockID fields[] = {this->root_id, this->height, (BlockID) this->splits};  // not all really block IDs but they fit
+    for (RecordID record_id = ROOT; record_id <= SPLITS; record_id++) {
+        Dbt *dbt = marshal_block_id(fields[record_id - ROOT]);
+        if (this->block->size() < record_id)
+            this->block->add(dbt);
+        else
+            this->block->put(record_id, *dbt);
+        delete[] (char *) dbt->get_data();
+        delete dbt;
+    }
 
     BTreeNode::save();
 }
 
 
+/*****************
+ * BTreeBytesKey *
+ *****************/
+
+// Pull the key columns out of a row and encode them.
+BTreeKey BTreeBytesKey::tkey(const ValueDict *row, const ColumnNames &key_columns, const KeyProfile &key_profile) {
+    return BTreeNode::encode_columns(row, key_columns, key_profile);
+}
+
+// Index of the first key not less than key.
+u_long BTreeBytesKey::lower_bound(const std::vector<Key> &keys, const Key &key) {
+    return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+}
+
+// Index of the first key greater than key.
+u_long BTreeBytesKey::upper_bound(const std::vector<Key> &keys, const Key &key) {
+    return std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+}
+
+// Print the leading column of a key, or its bytes if it is a truncated separator.
+void BTreeBytesKey::print(std::ostream &out, const Key &key, const KeyProfile &key_profile) {
+    try {
+        KeyValue *key_value = BTreeNode::decode_key(key, key_profile);
+        out << (*key_value)[0];
+        delete key_value;
+    } catch (DbRelationError &e) {
+        out << '~';
+        for (auto const c: key)
+            out << (isprint(c) ? c : '.');
+    }
+}
+
+
+/***************
+ * BTreeIntKey *
+ ***************/
+
+// Pull the one key column out of a row.
+int32_t BTreeIntKey::tkey(const ValueDict *row, const ColumnNames &key_columns, const KeyProfile &key_profile) {
+    ValueDict::const_iterator column = row->find(key_columns[0]);
+    if (column == row->end())
+        throw DbRelationError("index key column '" + key_columns[0] + "' missing");
+    return column->second.n;
+}
+
+// Index of the first key not less than key. The comparison only picks which half to keep (a conditional
+// move), so the loop runs log2(n) times with no mispredicted branches.
+u_long BTreeIntKey::lower_bound(const std::vector<Key> &keys, Key key) {
+    if (keys.empty())
+        return 0;
+    const Key *base = keys.data();
+    u_long n = keys.size();
+    while (n > 1) {
+        u_long half = n / 2;
+        base = base[half - 1] < key ? base + half : base;
+        n -= half;
+    }
+    return (base - keys.data()) + (*base < key);
+}
+
+// Index of the first key greater than key (branch-free, like lower_bound).
+u_long BTreeIntKey::upper_bound(const std::vector<Key> &keys, Key key) {
+    if (keys.empty())
+        return 0;
+    const Key *base = keys.data();
+    u_long n = keys.size();
+    while (n > 1) {
+        u_long half = n / 2;
+        base = base[half - 1] <= key ? base + half : base;
+        n -= half;
+    }
+    return (base - keys.data()) + (*base <= key);
+}
+
+// All of a node's keys, marshaled one after the other into the one record (for Traits with a PACKED_SIZE).
+template<class Traits>
+static BTreeKey pack_keys(const std::vector<typename Traits::Key> &keys, const BTreeKey &prefix) {
+    BTreeKey packed;
+    for (auto const &key: keys)
+        packed += Traits::marshal(key, prefix);
+    return packed;
+}
+
+// Split a record made by pack_keys back into keys.
+template<class Traits>
+static void unpack_keys(const BTreeKey &packed, const BTreeKey &prefix, std::vector<typename Traits::Key> &keys) {
+    for (u_long at = 0; at + Traits::PACKED_SIZE <= packed.size(); at += Traits::PACKED_SIZE)
+        keys.push_back(Traits::unmarshal(packed.substr(at, Traits::PACKED_SIZE), prefix));
+}
+
+
 /*****************
  * BTreeInterior *
  *****************/
 
-BTreeInterior::BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create) : BTreeNode(
-        file, block_id, key_profile, create), first(0), pointers(), boundaries() {
+template<class Traits>
+BTreeInteriorT<Traits>::BTreeInteriorT(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create)
+        : BTreeNode(file, block_id, key_profile, create), first(0), pointers(), boundaries() {
     if (!create) {
+        // record 1: first pointer, record 2: prefix shared by all boundaries, then (boundary, pointer) pairs,
+        // or, if Traits packs them, record 3: all the boundaries, then the pointers
         RecordIDs *record_id_list = this->block->ids();
-        RecordID i = 1;
-        for (auto j = record_id_list->size(); j > 0; j--) {
-            if (i == 1) {
-                // first pointer
+        BTreeKey prefix;
+        for (auto const &i: *record_id_list) {
+            if (i == FIRST)
                 this->first = get_block_id(i);
-            } else if (i % 2 != 0) {
-                // pointer
+            else if (i == PREFIX)
+                prefix = get_key(i);
+            else if (Traits::PACKED_SIZE != 0 && i == PACKED)
+                unpack_keys<Traits>(get_key(i), prefix, this->boundaries);
+            else if (Traits::PACKED_SIZE != 0)
+                this->pointers.push_back(get_block_id(i));
+            else if (i % 2 != 0)
+                this->boundaries.push_back(Traits::unmarshal(get_key(i), prefix));
+            else
                 this->pointers.push_back(get_block_id(i));
-            } else {
-                // key
-                KeyValue *key_value = get_key(i);
-                this->boundaries.push_back(key_value);
-            }
-            i++;
         }
         delete record_id_list;
     }
 }
 
-BTreeInterior::~BTreeInterior() {
-    for (auto key_value: this->boundaries)
-        delete key_value;
-    this->boundaries.clear();
-}
-
 // Get next block down in tree where key must be.
-BTreeNode *BTreeInterior::find(const KeyValue *key, uint depth) const {
-    BlockID down = this->pointers.back();  // last pointer is correct if we don't find an earlier boundary
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        KeyValue *boundary = this->boundaries[i];
-        if (*boundary > *key) {
-            if (i > 0)
-                down = this->pointers[i - 1];
-            else
-                down = this->first;
-            break;
-        }
-    }
-    if (depth == 2)
-        return new BTreeLeaf(this->file, down, this->key_profile, false);
-    else
-        return new BTreeInterior(this->file, down, this->key_profile, false);
+template<class Traits>
+BlockID BTreeInteriorT<Traits>::find(const Key &key) const {
+    // the first boundary greater than key marks the subtree to the right of where key must be
+    u_long above = Traits::upper_bound(this->boundaries, key);
+    if (above == 0)
+        return this->first;
+    return this->pointers[above - 1];
 }
 
-// Save the pointers and boundaries in the correct order
-void BTreeInterior::save() {
-    Dbt *dbt;
+// Save the pointers and boundaries in the correct order, factoring out the boundaries' common prefix.
+// Throws DbBlockNoRoomError (without writing the block) if they don't fit.
+template<class Traits>
+void BTreeInteriorT<Traits>::save() {
+    BTreeKey prefix;
+    if (!this->boundaries.empty())
+        prefix = Traits::prefix(this->boundaries.front(), this->boundaries.back());
     this->block->clear();
-    dbt = marshal_block_id(this->first);
-    this->block->add(dbt);
-    delete[] (char *) dbt->get_data();
-    delete dbt;
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        // key
-        dbt = marshal_key(this->boundaries[i]);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-
-        // boundary
-        dbt = marshal_block_id(this->pointers[i]);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+    add_record(marshal_block_id(this->first));
+    add_record(marshal_key(prefix));
+    if (Traits::PACKED_SIZE != 0) {
+        add_record(marshal_key(pack_keys<Traits>(this->boundaries, prefix)));
+        for (auto const &pointer: this->pointers)
+            add_record(marshal_block_id(pointer));
+    } else {
+        for (uint i = 0; i < this->boundaries.size(); i++) {
+            add_record(marshal_key(Traits::marshal(this->boundaries[i], prefix)));
+            add_record(marshal_block_id(this->pointers[i]));
+        }
     }
     BTreeNode::save();
 }
 
 // Insert boundary, block_id pair into block.
-Insertion BTreeInterior::insert(const KeyValue *boundary, BlockID block_id) {
-    // cout << "inserting (" << block_id << ", " << (*boundary)[0] << ") into interior node " << id; // DEBUG
-    // cout << " (pointers:" << boundaries.size() << ", unused:" << block->unused_bytes() << ") " << endl; // DEBUG
-
-    Dbt *dbt;
-
-    bool inserted = false;
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        KeyValue *check = this->boundaries[i];
-        if (*boundary == *check) {
-            this->boundaries.insert(this->boundaries.begin() + i, new KeyValue(*boundary));
-            this->pointers.insert(this->pointers.begin() + i, block_id);
-            inserted = true;
-            break;
-        }
-    }
-    if (!inserted) {
-        // must go at the end
-        this->boundaries.push_back(new KeyValue(*boundary));
-        this->pointers.push_back(block_id);
-    }
-    dbt = marshal_block_id(block_id);
+template<class Traits>
+typename BTreeInteriorT<Traits>::Insertion BTreeInteriorT<Traits>::insert(const Key &boundary, BlockID block_id, double right_fill) {
+    // keep boundaries sorted: the new block goes just after the child that split
+    u_long at = Traits::upper_bound(this->boundaries, boundary);
+    this->boundaries.insert(this->boundaries.begin() + at, boundary);
+    this->pointers.insert(this->pointers.begin() + at, block_id);
     try {
-        // following is just a check for size (the save method will redo this in the right order)
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-        dbt = marshal_key(boundary);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-
-        // that worked, so no need to split
         save();
-        return BTreeNode::insertion_none();
+        return insertion_none();
 
     } catch (DbBlockNoRoomError &e) {
-        cout << "splitting " << *this << endl; // DEBUG
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-
         // too big, so split
 
         // create the sister
-        BTreeInterior *nnode = new BTreeInterior(this->file, 0, this->key_profile, true);
+        BTreeInteriorT *nnode = new BTreeInteriorT(this->file, 0, this->key_profile, true);
 
-        // only the pointer of the middle entry goes into the sister (as it's first pointer)
+        // only the pointer of the split entry goes into the sister (as it's first pointer)
         // the corresponding boundary is moved up to be inserted into the parent node
-        u_long split = this->boundaries.size() / 2;
+        u_long split = split_point(this->boundaries.size(), at, right_fill);
         nnode->first = this->pointers[split];
-        KeyValue *nboundary = this->boundaries[split];
-        Insertion ret(nnode->id, *nboundary);
-        delete nboundary;
-
-        // move half of the entries to the sister
-        for (u_long i = split + 1; i < this->boundaries.size(); i++) {
-            nnode->boundaries.push_back(this->boundaries[i]);
-            nnode->pointers.push_back(this->pointers[i]);
-        }
+        Insertion ret(nnode->id, this->boundaries[split]);
+
+        // move the entries past the split point to the sister
+        nnode->boundaries.assign(this->boundaries.begin() + split + 1, this->boundaries.end());
+        nnode->pointers.assign(this->pointers.begin() + split + 1, this->pointers.end());
         this->boundaries.erase(this->boundaries.begin() + split, this->boundaries.end());
         this->pointers.erase(this->pointers.begin() + split, this->pointers.end());
-        // cout << "after split " << *this << endl; // DEBUG
-        // cout << "new sibling " << *nnode << endl; // DEBUG
 
         // save everything
         nnode->save();
         this->save();
+        delete nnode;
         return ret;
     }
 }
 
-
-ostream &operator<<(ostream &out, const BTreeInterior &node) {
-    out << "(interior block " << node.id << "): " << node.first;
-    if (node.boundaries.size() != node.pointers.size()) {
-        out << " MISMATCH boundaries: " << node.boundaries.size() << ", pointers: " << node.pointers.size();
+template<class Traits>
+void BTreeInteriorT<Traits>::print(ostream &out) const {
+    out << "(interior block " << this->id << "): " << this->first;
+    if (this->boundaries.size() != this->pointers.size()) {
+        out << " MISMATCH boundaries: " << this->boundaries.size() << ", pointers: " << this->pointers.size();
     } else {
-        for (unsigned int i = 0; i < node.boundaries.size(); i++)
-            out << '|' << (*node.boundaries[i])[0] << '|' << node.pointers[i];
+        for (unsigned int i = 0; i < this->boundaries.size(); i++) {
+            out << '|';
+            Traits::print(out, this->boundaries[i], this->key_profile);
+            out << '|' << this->pointers[i];
+        }
     }
-    return out;
 }
 
 
@@ -353,124 +508,170 @@ ostream &operator<<(ostream &out, const BTreeInterior &node) {
  * BTreeLeaf *
  *************/
 
-BTreeLeaf::BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create) : BTreeNode(file,
-                                                                                                               block_id,
-                                                                                                               key_profile,
-                                                                                                               create),
-                                                                                                     next_leaf(0),
-                                                                                                     key_map() {
+template<class Traits>
+BTreeLeafT<Traits>::BTreeLeafT(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create)
+        : BTreeNode(file, block_id, key_profile, create), next_leaf(0), prefix(), keys(), handles(), payloads() {
     if (!create) {
+        // record 1: next leaf, record 2: prefix shared by all keys, then (handle + payload, key) pairs,
+        // or, if Traits packs them, record 3: all the keys, then the handles (each with its payload)
         RecordIDs *record_id_list = this->block->ids();
-        RecordID i = 1;
-        for (auto j = record_id_list->size(); j > 0; j--) {
-            if (i == record_id_list->size()) {
-                // next leaf block
+        for (auto const &i: *record_id_list) {
+            if (i == NEXT_LEAF)
                 this->next_leaf = get_block_id(i);
-            } else if (i % 2 == 0) {
-                // record i-1: handle, record i: key
-                KeyValue *key_value = get_key(i);
-                this->key_map[*key_value] = get_handle(i - 1);
-                delete key_value;
+            else if (i == PREFIX)
+                this->prefix = get_key(i);
+            else if (Traits::PACKED_SIZE != 0 && i == PACKED)
+                unpack_keys<Traits>(get_key(i), this->prefix, this->keys);
+            else if (Traits::PACKED_SIZE == 0 && i % 2 == 0)
+                this->keys.push_back(Traits::unmarshal(get_key(i), this->prefix));
+            else {
+                BTreeKey payload;
+                this->handles.push_back(get_handle(i, &payload));
+                this->payloads.push_back(payload);
             }
-            i++;
         }
         delete record_id_list;
     }
 }
 
-BTreeLeaf::~BTreeLeaf() {
-}
-
 // Find the handle for a given key
-Handle BTreeLeaf::find_eq(const KeyValue *key) const {
-    return this->key_map.at(*key);
+template<class Traits>
+Handle BTreeLeafT<Traits>::find_eq(const Key &key, BTreeKey *payload) const {
+    u_long at = Traits::lower_bound(this->keys, key);
+    if (at == this->keys.size() || this->keys[at] != key)
+        throw std::out_of_range("key not found in leaf");
+    if (payload != nullptr)
+        *payload = this->payloads[at];
+    return this->handles[at];
 }
 
-// Save the key_map and next_leaf data in the correct order
-void BTreeLeaf::save() {
-    Dbt *dbt;
+// Save the next_leaf and (key, handle) data in the correct order, factoring out the keys' common prefix.
+// Throws DbBlockNoRoomError (without writing the block) if they don't fit.
+template<class Traits>
+void BTreeLeafT<Traits>::save() {
+    this->prefix.clear();
+    if (!this->keys.empty())
+        this->prefix = Traits::prefix(this->keys.front(), this->keys.back());
     this->block->clear();
-    for (auto const &item: this->key_map) {
-        // handle
-        dbt = marshal_handle(item.second);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+    add_record(marshal_block_id(this->next_leaf));
+    add_record(marshal_key(this->prefix));
+    if (Traits::PACKED_SIZE != 0) {
+        add_record(marshal_key(pack_keys<Traits>(this->keys, this->prefix)));
+        for (uint i = 0; i < this->keys.size(); i++)
+            add_record(marshal_handle(this->handles[i], this->payloads[i]));
+    } else {
+        for (uint i = 0; i < this->keys.size(); i++) {
+            add_record(marshal_handle(this->handles[i], this->payloads[i]));
+            add_record(marshal_key(Traits::marshal(this->keys[i], this->prefix)));
+        }
+    }
+    BTreeNode::save();
+}
 
-        // key
-        dbt = marshal_key(&item.first);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+// One pass along the leaf for a run of sorted keys, rather than a search for each.
+template<class Traits>
+void BTreeLeafT<Traits>::find_many(const std::vector<Key> &keys, u_long begin, u_long end, Handles *handles) const {
+    u_long at = 0;
+    for (u_long i = begin; i < end; i++) {
+        while (at < this->keys.size() && this->keys[at] < keys[i])
+            at++;
+        if (at == this->keys.size())
+            return;
+        if (this->keys[at] == keys[i])
+            handles->push_back(this->handles[at]);
     }
-    // next leaf pointer is final record
-    dbt = marshal_block_id(this->next_leaf);
-    this->block->add(dbt);
-    delete[] (char *) dbt->get_data();
-    delete dbt;
+}
 
-    BTreeNode::save();
+// Take out the entry for key, if it is here and belongs to handle, and rewrite the block without it.
+// Leaves are never merged: one left empty stays in the tree for later inserts.
+template<class Traits>
+bool BTreeLeafT<Traits>::remove(const Key &key, Handle handle) {
+    u_long at = Traits::lower_bound(this->keys, key);
+    if (at == this->keys.size() || this->keys[at] != key || this->handles[at] != handle)
+        return false;
+    this->keys.erase(this->keys.begin() + at);
+    this->handles.erase(this->handles.begin() + at);
+    this->payloads.erase(this->payloads.begin() + at);
+    save();
+    return true;
+}
+
+// Whether insert would put the entry straight into the block, with no need to rewrite or split it.
+template<class Traits>
+bool BTreeLeafT<Traits>::has_room(const Key &key, const BTreeKey &payload) const {
+    if (this->keys.empty() || !Traits::shares(key, this->prefix))
+        return false;
+    u_int32_t header = 2 * sizeof(u_int16_t);  // each record's size and location in the slotted page
+    u_int32_t entry = header + sizeof(BlockID) + sizeof(RecordID) + (u_int32_t) payload.size();
+    // a packed key only grows the keys record, but SlottedPage::put wants a header's worth of room to spare for that
+    u_int32_t stored = header + (u_int32_t) Traits::marshal(key, this->prefix).size();
+    return entry + stored <= get_unused_bytes();
 }
 
 // Insert key, handle pair into block.
-Insertion BTreeLeaf::insert(const KeyValue *key, Handle handle) {
-    // cout << "inserting " << (*key)[0] << " into leaf " << id << endl; // DEBUG
+template<class Traits>
+typename BTreeLeafT<Traits>::Insertion BTreeLeafT<Traits>::insert(const Key &key, Handle handle, const BTreeKey &payload, double right_fill) {
     // check unique
-    if (this->key_map.find(*key) != this->key_map.end())
+    u_long at = Traits::lower_bound(this->keys, key);
+    if (at < this->keys.size() && this->keys[at] == key)
         throw DbRelationError("Duplicate keys are not allowed in unique index");
 
-    Dbt *dbt;
-    dbt = marshal_handle(handle);
+    // a key that fits under the block's prefix can go straight into the block as it stands
+    bool in_place = !this->keys.empty() && Traits::shares(key, this->prefix);
+    this->keys.insert(this->keys.begin() + at, key);
+    this->handles.insert(this->handles.begin() + at, handle);
+    this->payloads.insert(this->payloads.begin() + at, payload);
     try {
-        // following is just a check for size (the save method will redo this in the right order)
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-        dbt = marshal_key(key);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-
-        // that worked, so no need to split
-        this->key_map[*key] = handle;
-        save();
-        return BTreeNode::insertion_none();
+        if (in_place) {
+            char handle_bytes[sizeof(BlockID) + sizeof(RecordID)];
+            *(BlockID *) handle_bytes = handle.first;
+            *(RecordID *) (handle_bytes + sizeof(BlockID)) = handle.second;
+            BTreeKey entry = BTreeKey(handle_bytes, sizeof(handle_bytes)) + payload;
+            if (Traits::PACKED_SIZE != 0) {
+                BTreeKey packed = pack_keys<Traits>(this->keys, this->prefix);
+                insert_record(PACKED + 1 + (RecordID) at, entry.data(), (u_int32_t) entry.size());
+                put_record(PACKED, packed.data(), (u_int32_t) packed.size());
+            } else {
+                BTreeKey stored = Traits::marshal(key, this->prefix);
+                insert_record(PREFIX + 1 + 2 * (RecordID) at, entry.data(), (u_int32_t) entry.size());
+                insert_record(PREFIX + 2 + 2 * (RecordID) at, stored.data(), (u_int32_t) stored.size());
+            }
+            mark_dirty();
+        } else {
+            save();
+        }
+        return BTreeInteriorT<Traits>::insertion_none();
 
     } catch (DbBlockNoRoomError &e) {
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-
         // too big, so split
 
         // create the sister and put her to the right
-        BTreeLeaf *nleaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
+        BTreeLeafT *nleaf = new BTreeLeafT(this->file, 0, this->key_profile, true);
         nleaf->next_leaf = this->next_leaf;
         this->next_leaf = nleaf->id;
 
-        // move half of the entries to the sister
-        auto key_list = this->key_map;       // make a copy of my key_map
-        key_list[*key] = handle;             // add key/handle to it
-        u_long split = key_list.size() / 2;  // figure out how many to keep (the rest move to nleaf)
-        this->key_map.clear();               // empty my list
-        u_long i = 0;
-        KeyValue boundary;
-        for (auto const &item: key_list) {
-            if (i < split) {
-                this->key_map[item.first] = item.second;
-            } else if (i == split) {
-                boundary = item.first;
-                nleaf->key_map[boundary] = item.second;
-            } else {
-                nleaf->key_map[item.first] = item.second;
-            }
-            i++;
-        }
-        cout << "splitting leaf " << id << ", new sibling " << nleaf->id; // DEBUG
-        cout << " starting at value " << boundary[0] << endl; // DEBUG
+        // move the entries past the split point to the sister
+        u_long split = split_point(this->keys.size(), at, right_fill);  // how many to keep (the rest move to nleaf)
+        nleaf->keys.assign(this->keys.begin() + split, this->keys.end());
+        nleaf->handles.assign(this->handles.begin() + split, this->handles.end());
+        nleaf->payloads.assign(this->payloads.begin() + split, this->payloads.end());
+        this->keys.erase(this->keys.begin() + split, this->keys.end());
+        this->handles.erase(this->handles.begin() + split, this->handles.end());
+        this->payloads.erase(this->payloads.begin() + split, this->payloads.end());
+
+        // the parent only needs enough of the sister's first key to tell it apart from my last one
+        Key boundary = Traits::separator(this->keys.back(), nleaf->keys.front());
 
         nleaf->save();
         this->save();
-        return Insertion(nleaf->id, boundary);
+        BlockID nleaf_id = nleaf->id;
+        delete nleaf;
+        return Insertion(nleaf_id, boundary);
     }
 }
 
+// the two kinds of BTree we build
+template class BTreeInteriorT<BTreeBytesKey>;
+template class BTreeLeafT<BTreeBytesKey>;
+template class BTreeInteriorT<BTreeIntKey>;
+template class BTreeLeafT<BTreeIntKey>;
@@ -6,14 +6,18 @@
  */
 #pragma once
 
+#include <memory>
 #include "storage_engine.h"
 #include "heap_storage.h"
 
 typedef std::vector<ColumnAttribute::DataType> KeyProfile;
 typedef std::vector<Value> KeyValue;
-typedef std::vector<KeyValue *> KeyValues;
+typedef std::string BTreeKey;  // order-preserving byte encoding of a KeyValue (see BTreeNode::encode_key)
+typedef std::vector<BTreeKey> BTreeKeys;
 typedef std::vector<BlockID> BlockPointers;
-typedef std::pair<BlockID, KeyValue> Insertion;
+
+class BTreeNode;
+typedef std::shared_ptr<BTreeNode> BTreeNodePtr;
 
 class BTreeNode {
 public:
@@ -21,37 +25,73 @@ public:
 
     virtual ~BTreeNode();
 
-    static bool insertion_is_none(Insertion insertion) { return insertion.first == 0; }
+    /**
+     * Encode a key so that comparing encodings bytewise (memcmp) orders them the same as comparing
+     * the key values column by column:
+     *   INT      4 bytes big-endian with the sign bit flipped
+     *   BOOLEAN  1 byte
+     *   TEXT     the bytes of the string with 0x00 escaped as 0x00 0xFF, terminated by 0x00 0x00
+     */
+    static BTreeKey encode_key(const KeyValue *key_value, const KeyProfile &key_profile);
+
+    static void encode_value(BTreeKey &key, const Value &value, ColumnAttribute::DataType data_type);
+
+    // encode the named columns of a row, in order (an index's key, as every kind of index encodes it)
+    static BTreeKey encode_columns(const ValueDict *row, const ColumnNames &column_names, const KeyProfile &profile);
+
+    // the data types of the named columns of a relation, in order
+    static KeyProfile column_profile(DbRelation &relation, const ColumnNames &column_names);
 
-    static Insertion insertion_none() { return Insertion(0, KeyValue()); }
+    static KeyValue *decode_key(const BTreeKey &key, const KeyProfile &key_profile);
+
+    static BTreeKey common_prefix(const BTreeKey &a, const BTreeKey &b);
+
+    static BTreeKey separator(const BTreeKey &left, const BTreeKey &right);
+
+    static u_long split_point(u_long size, u_long at, double right_fill);
 
     virtual void save();
 
+    void flush();  // write the block back if it was changed in place since the last save
+
     BlockID get_id() const { return this->id; }
 
+    u_int16_t get_unused_bytes() const { return this->block->unused_bytes(); }
+
 protected:
+    char page[DbBlock::BLOCK_SZ];  // private copy of the block, so the node outlives the file's read buffer
     SlottedPage *block;
     HeapFile &file;
     BlockID id;
     const KeyProfile &key_profile;
+    bool dirty;  // block has records that are not yet in the file
+
+    void mark_dirty() { this->dirty = true; }
 
     static Dbt *marshal_block_id(BlockID block_id);
 
-    static Dbt *marshal_handle(Handle handle);
+    static Dbt *marshal_handle(Handle handle, const BTreeKey &payload = BTreeKey());
+
+    static Dbt *marshal_key(const BTreeKey &key);
+
+    void add_record(Dbt *dbt);
 
-    virtual Dbt *marshal_key(const KeyValue *key);
+    void insert_record(RecordID record_id, const void *data, u_int32_t size);
+
+    void put_record(RecordID record_id, const void *data, u_int32_t size);
 
     virtual BlockID get_block_id(RecordID record_id) const;
 
-    virtual Handle get_handle(RecordID record_id) const;
+    virtual Handle get_handle(RecordID record_id, BTreeKey *payload = nullptr) const;
 
-    virtual KeyValue *get_key(RecordID record_id) const;
+    virtual BTreeKey get_key(RecordID record_id) const;
 };
 
 class BTreeStat : public BTreeNode {
 public:
     static const RecordID ROOT = 1;  // where we store the root id in the stat block
     static const RecordID HEIGHT = ROOT + 1;  // where we store the height in the stat block
+    static const RecordID SPLITS = HEIGHT + 1;  // where we store the number of node splits so far
 
     BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile &key_profile);
 
@@ -69,47 +109,183 @@ public:
 
     void set_height(uint height) { this->height = height; }
 
+    u_long get_splits() const { return this->splits; }
+
+    void add_splits(u_long splits) { this->splits += splits; }
+
 protected:
     BlockID root_id;
     uint height;
+    u_long splits;
+
+};
+
+/**
+ * @class BTreeBytesKey - key traits for the general B-tree: any KeyProfile, with keys held in their
+ * memcomparable encoding and prefix-compressed within each node.
+ */
+struct BTreeBytesKey {
+    typedef BTreeKey Key;
+
+    static const u_long PACKED_SIZE = 0;  // each key is a record of its own
+
+    static Key tkey(const ValueDict *row, const ColumnNames &key_columns, const KeyProfile &key_profile);
+
+    // the part of the keys from lo to hi that is stored once per node
+    static BTreeKey prefix(const Key &lo, const Key &hi) { return BTreeNode::common_prefix(lo, hi); }
+
+    // what is stored for each key in a node, given the node's prefix
+    static BTreeKey marshal(const Key &key, const BTreeKey &prefix) { return key.substr(prefix.size()); }
 
+    static Key unmarshal(const BTreeKey &stored, const BTreeKey &prefix) { return prefix + stored; }
+
+    static bool shares(const Key &key, const BTreeKey &prefix) { return key.compare(0, prefix.size(), prefix) == 0; }
+
+    static Key separator(const Key &left, const Key &right) { return BTreeNode::separator(left, right); }
+
+    static u_long lower_bound(const std::vector<Key> &keys, const Key &key);
+
+    static u_long upper_bound(const std::vector<Key> &keys, const Key &key);
+
+    static void print(std::ostream &out, const Key &key, const KeyProfile &key_profile);
 };
 
-class BTreeInterior : public BTreeNode {
+/**
+ * @class BTreeIntKey - key traits for a B-tree on a single INT column: keys are plain int32_t's, compared as
+ * integers rather than as encoded bytes and searched without data-dependent branches. On the page a node's keys
+ * are one record, an array of int32_t's, so each takes 4 bytes and no slot of its own: at least as many fit in a
+ * block as in the general tree with its prefix-compressed keys.
+ */
+struct BTreeIntKey {
+    typedef int32_t Key;
+
+    static const u_long PACKED_SIZE = sizeof(Key);  // a node's keys are packed into one record, this much each
+
+    static Key tkey(const ValueDict *row, const ColumnNames &key_columns, const KeyProfile &key_profile);
+
+    static BTreeKey prefix(Key lo, Key hi) { return BTreeKey(); }
+
+    static BTreeKey marshal(Key key, const BTreeKey &prefix) { return BTreeKey((char *) &key, sizeof(Key)); }
+
+    static Key unmarshal(const BTreeKey &stored, const BTreeKey &prefix) { return *(Key *) stored.data(); }
+
+    static bool shares(Key key, const BTreeKey &prefix) { return true; }
+
+    static Key separator(Key left, Key right) { return right; }
+
+    static u_long lower_bound(const std::vector<Key> &keys, Key key);
+
+    static u_long upper_bound(const std::vector<Key> &keys, Key key);
+
+    static void print(std::ostream &out, Key key, const KeyProfile &key_profile) { out << key; }
+};
+
+template<class Traits>
+class BTreeInteriorT : public BTreeNode {
 public:
-    BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create);
+    typedef typename Traits::Key Key;
+    typedef std::pair<BlockID, Key> Insertion;
+
+    static const RecordID FIRST = 1;  // where we store the first pointer
+    static const RecordID PREFIX = FIRST + 1;  // where we store the prefix common to all the boundaries
+    static const RecordID PACKED = PREFIX + 1;  // where we store all the boundaries, if Traits packs them
 
-    virtual ~BTreeInterior();
+    static bool insertion_is_none(const Insertion &insertion) { return insertion.first == 0; }
 
-    BTreeNode *find(const KeyValue *key, uint depth) const;
+    static Insertion insertion_none() { return Insertion(0, Key()); }
 
-    Insertion insert(const KeyValue *boundary, BlockID block_id);
+    BTreeInteriorT(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create);
+
+    virtual ~BTreeInteriorT() {}
+
+    BlockID find(const Key &key) const;
+
+    // right_fill is how full to leave me if I split while on the right edge of the tree (see split_point)
+    Insertion insert(const Key &boundary, BlockID block_id, double right_fill = 0.5);
 
     virtual void save();
 
+    BlockID get_first() const { return this->first; }
+
+    BlockID get_last() const { return this->pointers.empty() ? this->first : this->pointers.back(); }
+
+    const BlockPointers &get_pointers() const { return this->pointers; }  // the children after first
+
     void set_first(BlockID first) { this->first = first; }
 
-    friend std::ostream &operator<<(std::ostream &out, const BTreeInterior &node);
+    // bulk load: put a child after all the others, with the boundary between it and the one before (see save)
+    void append(const Key &boundary, BlockID block_id) {
+        this->boundaries.push_back(boundary);
+        this->pointers.push_back(block_id);
+    }
+
+    void print(std::ostream &out) const;
 
 protected:
     BlockID first;
     BlockPointers pointers;
-    KeyValues boundaries;
+    std::vector<Key> boundaries;
 };
 
-class BTreeLeaf : public BTreeNode {
+template<class Traits>
+std::ostream &operator<<(std::ostream &out, const BTreeInteriorT<Traits> &node) {
+    node.print(out);
+    return out;
+}
+
+template<class Traits>
+class BTreeLeafT : public BTreeNode {
 public:
-    BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create);
+    typedef typename Traits::Key Key;
+    typedef typename BTreeInteriorT<Traits>::Insertion Insertion;
+
+    static const RecordID NEXT_LEAF = 1;  // where we store the next leaf pointer
+    static const RecordID PREFIX = NEXT_LEAF + 1;  // where we store the prefix common to all the keys
+    static const RecordID PACKED = PREFIX + 1;  // where we store all the keys, if Traits packs them
+
+    BTreeLeafT(HeapFile &file, BlockID block_id, const KeyProfile &key_profile, bool create);
+
+    virtual ~BTreeLeafT() {}
+
+    Handle find_eq(const Key &key, BTreeKey *payload = nullptr) const;  // throws if not found
 
-    virtual ~BTreeLeaf();
+    // adds the handles of those of keys[begin..end) (sorted) that are in this leaf
+    void find_many(const std::vector<Key> &keys, u_long begin, u_long end, Handles *handles) const;
 
-    Handle find_eq(const KeyValue *key) const;  // throws if not found
-    Insertion insert(const KeyValue *key, Handle handle);
+    // Adds the entry to the block in place when it can (leaving the node dirty; see flush), else rewrites or splits.
+    // The payload (encoded included columns, if any) is stored with the handle.
+    Insertion insert(const Key &key, Handle handle, const BTreeKey &payload, double right_fill = 0.5);
+
+    bool has_room(const Key &key, const BTreeKey &payload) const;  // can insert add it in place (no split)?
+
+    bool remove(const Key &key, Handle handle);  // false if that entry isn't here
 
     virtual void save();
 
+    BlockID get_next_leaf() const { return this->next_leaf; }
+
+    void set_next_leaf(BlockID next_leaf) { this->next_leaf = next_leaf; }
+
+    // bulk load: put an entry after all the others, in memory only until save
+    void append(const Key &key, Handle handle, const BTreeKey &payload) {
+        this->keys.push_back(key);
+        this->handles.push_back(handle);
+        this->payloads.push_back(payload);
+    }
+
+    const std::vector<Key> &get_keys() const { return this->keys; }
+
+    const Handles &get_handles() const { return this->handles; }  // handles[i] goes with get_keys()[i]
+
 protected:
     BlockID next_leaf;
-    std::map<KeyValue, Handle> key_map;
+    BTreeKey prefix;  // prefix factored out of the keys on the block
+    std::vector<Key> keys;  // sorted
+    Handles handles;  // handles[i] goes with keys[i]
+    BTreeKeys payloads;  // and so does payloads[i]
 };
 
+typedef BTreeInteriorT<BTreeBytesKey> BTreeInterior;
+typedef BTreeLeafT<BTreeBytesKey> BTreeLeaf;
+typedef BTreeInteriorT<BTreeIntKey> BTreeIntInterior;
+typedef BTreeLeafT<BTreeIntKey> BTreeIntLeaf;
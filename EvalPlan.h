@@ -7,37 +7,220 @@
 #pragma once
 
 #include "storage_engine.h"
+#include "schema_tables.h"
 
 
 typedef std::pair<DbRelation *, Handles *> EvalPipeline;
+typedef std::vector<DbIndex *> DbIndexes;
+typedef std::map<Identifier, DbIndexes> TableIndices;  // the indices there are on each table, by table name
+typedef std::vector<std::pair<Identifier, Identifier>> JoinColumns;  // columns a join matches: (left, right)
+typedef std::vector<std::pair<Identifier, bool>> SortColumns;  // columns to sort by, each with whether descending
+
+/**
+ * @class EvalIterator - a plan being run in the iterator (Volcano) model: open it, call next until it runs out of
+ * rows, then close it. Each operator pulls rows from the one below it only as it needs them, so what is in
+ * memory at any time is the operators' own state (for a table scan, the rows of one block), not the result.
+ */
+class EvalIterator {
+public:
+    virtual ~EvalIterator() {}
+
+    virtual void open() = 0;
+
+    virtual ValueDict *next() = 0;  // the next row (freed by caller), or nullptr once there are no more
+
+    virtual void close() = 0;
+};
+
+/**
+ * @class EvalBatchIterator - like EvalIterator, but the operators hand each other a ColumnBatch of rows at a time,
+ * so that a filter or a projection is a tight loop over column vectors rather than a virtual call and a ValueDict
+ * per row.
+ */
+class EvalBatchIterator {
+public:
+    virtual ~EvalBatchIterator() {}
+
+    virtual void open() = 0;
+
+    virtual bool next(ColumnBatch &batch) = 0;  // refill batch (some rows selected), or false once there are no more
+
+    virtual void close() = 0;
+};
+
+/**
+ * @class Aggregation - an aggregate function of a column, as an Aggregate plan computes it over each group of rows,
+ * e.g., SUM(amount). There being only INT values to give, AVG is rounded toward zero.
+ */
+class Aggregation {
+public:
+    enum Function {
+        COUNT, SUM, MIN, MAX, AVG
+    };
+
+    Aggregation(Function function, Identifier column_name, Identifier name) : function(function),
+                                                                              column_name(column_name),
+                                                                              name(name) {}
+
+    Function function;
+    Identifier column_name;  // of the input ("" for COUNT(*))
+    Identifier name;  // of the result column
+
+    std::string text() const;  // e.g., "SUM(amount)"
+};
+
+typedef std::vector<Aggregation> Aggregations;
+
+/**
+ * @class ValueRange - the values a column may have to pass comparisons with constants (<, <=, >, >=, BETWEEN):
+ * those from min to max, each bound inclusive or not, where there is a bound. An exclusive bound on an INT is kept
+ * as the inclusive one next to it, which a B-tree range scan can use as it is.
+ */
+class ValueRange {
+public:
+    ValueRange() : min(), max(), has_min(false), has_max(false), min_inclusive(true), max_inclusive(true) {}
+
+    Value min;
+    Value max;
+    bool has_min;
+    bool has_max;
+    bool min_inclusive;
+    bool max_inclusive;
+
+    void above(Value value, bool inclusive);  // narrow the range to values > (or >=) value
+
+    void below(Value value, bool inclusive);  // narrow the range to values < (or <=) value
+
+    bool contains(const Value &value) const;
+
+    bool inclusive() const { return this->min_inclusive && this->max_inclusive; }  // whatever bounds there are
+
+    std::string text(const Identifier &column_name) const;  // e.g., "10 <= id <= 19"
+};
+
+typedef std::map<Identifier, ValueRange> ValueRanges;  // by column
 
 class EvalPlan {
 public:
+    // whether iterator runs the plans it can (scans with selects and a projection) a batch at a time
+    static bool vectorized;
+
+    // bytes of rows an operator may hold in memory before it spills to temporary files
+    static u_long memory_budget;
+
+    static const u_long NO_LIMIT = (u_long) -1;
+
     enum PlanType {
-        ProjectAll, Project, Select, TableScan
+        ProjectAll, Project, Select, TableScan, IndexLookup, Join, Aggregate, Sort, IndexScan, Limit
+    };
+
+    // how a Join runs: see optimize
+    enum JoinMethod {
+        HashJoin, IndexNestedLoopJoin, SortMergeJoin
     };
 
     EvalPlan(PlanType type, EvalPlan *relation);  // use for ProjectAll, e.g., EvalPlan(EvalPlan::ProjectAll, table);
     EvalPlan(ColumnNames *projection, EvalPlan *relation); // use for Project
     EvalPlan(ValueDict *conjunction, EvalPlan *relation);  // use for Select
+    EvalPlan(ValueDict *conjunction, ValueRanges *ranges, EvalPlan *relation);  // use for Select with comparisons
     EvalPlan(DbRelation &table);  // use for TableScan
+    EvalPlan(DbIndex &index, ValueDict *key, DbRelation &table);  // use for IndexLookup
+    EvalPlan(EvalPlan *left, EvalPlan *right, JoinColumns *join_columns,
+             JoinMethod join_method = HashJoin);  // use for Join (inner equi-join)
+    EvalPlan(ColumnNames *group_by, Aggregations *aggregations, EvalPlan *relation);  // use for Aggregate
+    EvalPlan(SortColumns *sort_columns, EvalPlan *relation);  // use for Sort
+    // use for IndexScan: the rows in the index's key order, all of them or those whose key is in bounds
+    EvalPlan(DbIndex &index, DbRelation &table, ValueRanges *bounds = nullptr);
+    EvalPlan(u_long limit, u_long offset, EvalPlan *relation);  // use for Limit (limit rows after skipping offset)
     EvalPlan(const EvalPlan *other);  // use for copying
     virtual ~EvalPlan();
 
-    // Attempt to get the best equivalent evaluation plan
-    EvalPlan *optimize();
+    // Attempt to get the best equivalent evaluation plan, using whichever of the tables' indices help; with
+    // statistics, an index is used only where it is estimated to cost less than a scan
+    EvalPlan *optimize(Indices &indices, Statistics *statistics = nullptr);
+
+    EvalPlan *optimize(const TableIndices &table_indices, const TableStatisticsMap *table_statistics = nullptr);
+
+    // The columns of the rows the plan gives. A join's columns are named table.column (see qualifier).
+    void get_columns(ColumnNames &column_names, ColumnAttributes &column_attributes) const;
+
+    // Describe the plan, a line per node (indented under its parent), with estimated rows and cost if it has them
+    void explain(std::vector<std::string> &lines, uint depth = 0) const;
 
     // Evaluate the plan: evaluate gets values, pipeline gets handles
     ValueDicts *evaluate();
 
     EvalPipeline pipeline();
 
+    // The plan as a tree of iterators, to get its rows one at a time (freed by caller)
+    EvalIterator *iterator();
+
 protected:
 
     PlanType type;
-    EvalPlan *relation;  // for everything except TableScan
-    ColumnNames *projection;  // for Project
-    ValueDict *select_conjunction;  // for Select
-    DbRelation &table;  // for TableScan
+    EvalPlan *relation;  // for everything except TableScan (for a Join, the left input)
+    EvalPlan *right;  // for Join
+    JoinColumns *join_columns;  // for Join
+    JoinMethod join_method;  // for Join
+    ColumnNames *projection;  // for Project (and the group by columns for Aggregate)
+    Aggregations *aggregations;  // for Aggregate
+    SortColumns *sort_columns;  // for Sort
+    u_long limit;  // for Limit, and for a Sort under one (top-N: only its first rows are wanted); else NO_LIMIT
+    u_long offset;  // for Limit
+    ValueDict *select_conjunction;  // for Select (and the key for IndexLookup)
+    ValueRanges *select_ranges;  // for a Select with comparisons besides = (and the key's bounds for an IndexScan)
+    DbRelation &table;  // for TableScan, IndexLookup and IndexScan
+    // for IndexLookup and IndexScan; for a Select on a TableScan, an index whose filter can rule out the scan; for
+    // an IndexNestedLoopJoin, the index on the right input's table that its rows are looked up in
+    DbIndex *index;
+    double estimated_rows;  // set by optimize where the tables have statistics, else -1
+    double estimated_cost;  // in blocks read (with the CPU cost per row counted as a fraction of a block)
+
+    // the index that best answers a select on the table, or nullptr if none of them can
+    static DbIndex *choose_index(const DbIndexes &candidates, const ValueDict *conjunction);
+
+    // the same, but by estimated cost: nullptr if a scan is cheaper
+    static DbIndex *cheapest_index(const DbIndexes &candidates, const ValueDict *conjunction,
+                                   const TableStatistics &stats);
+
+    void estimate(const TableStatisticsMap &table_statistics);
+
+    static void use_indices(EvalPlan **link, const TableIndices &table_indices,
+                            const TableStatisticsMap *table_statistics);
+
+    static void use_range_index(EvalPlan **link, const DbIndexes &candidates, const TableStatistics *stats);
+
+    void choose_join_methods(const TableIndices &table_indices, const TableStatisticsMap *table_statistics);
+
+    static void skip_sorts(EvalPlan **link, const TableIndices &table_indices,
+                           const TableStatisticsMap *table_statistics);
+
+    void push_limits();
+
+    // an index an IndexNestedLoopJoin could look the right input's rows up in, or nullptr if there is none
+    DbIndex *join_index(const TableIndices &table_indices) const;
+
+    double join_cost(JoinMethod method, const TableStatisticsMap &table_statistics) const;
+
+    void swap_inputs();  // of a join (the rows it gives are the same)
+
+    // the join columns on one side (0 for left, 1 for right), as that input names them
+    ColumnNames join_key(uint side) const;
+
+    // whether the plan's rows are sure to come out in order of the given columns
+    bool ordered_by(const ColumnNames &column_names) const;
+
+    // what a join prefixes this plan's column names with: its table's name, or nothing if it is itself a join
+    Identifier qualifier() const;
+
+    bool build_on_left() const;  // whether a hash join should build its table from its left input
+
+    // the plan below a projection as batch operators reading the needed columns, or nullptr if it can't be
+    EvalBatchIterator *batch_iterator(ColumnNames &needed);
+
+    // the same, with the rows cut down to the given columns (nullptr for all) handed out one at a time
+    EvalIterator *batch_rows(const ColumnNames *column_names);
 };
 
+bool test_eval_plan();
+
@@ -63,24 +63,24 @@ SlottedPage *HeapFile::get_new(void) {
     int block_id = ++this->last;
     Dbt key(&block_id, sizeof(block_id));
 
-    // write out an empty block and read it back in so Berkeley DB is managing the memory
+    // write out an empty block and read it back in, so the page has memory of its own like any other
     SlottedPage *page = new SlottedPage(data, this->last, true);
     this->db.put(nullptr, &key, &data, 0); // write it out with initialization done to it
     delete page;
-    this->db.get(nullptr, &key, &data, 0);
-    return new SlottedPage(data, this->last);
+    return get(this->last);
 }
 
 /**
  * Get a block from the database file.
  * @param block_id
- * @return          the given slotted page (freed by caller)
+ * @return          the given slotted page (freed by caller), which owns its copy of the block
  */
 SlottedPage *HeapFile::get(BlockID block_id) {
     Dbt key(&block_id, sizeof(block_id));
     Dbt data;
+    data.set_flags(DB_DBT_MALLOC);  // not the handle's buffer, so several threads can read at once
     this->db.get(nullptr, &key, &data, 0);
-    return new SlottedPage(data, block_id, false);
+    return new SlottedPage(data, block_id, false, true);
 }
 
 /**
@@ -124,7 +124,7 @@ void HeapFile::db_open(uint flags) {
     if (!this->closed)
         return;
     this->db.set_re_len(DbBlock::BLOCK_SZ); // record length - will be ignored if file already exists
-    this->db.open(nullptr, this->dbfilename.c_str(), nullptr, DB_RECNO, flags, 0644);
+    this->db.open(nullptr, this->dbfilename.c_str(), nullptr, DB_RECNO, flags | DB_THREAD, 0644);
 
     this->last = flags ? 0 : get_block_count();
     this->closed = false;
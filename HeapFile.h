@@ -7,9 +7,53 @@
  */
 #pragma once
 
+#include <mutex>
+#include <pthread.h>
 #include "db_cxx.h"
 #include "SlottedPage.h"
 
+/**
+ * @class FileLatch - reader/writer latch (C++11 has no shared mutex of its own).
+ * Hold it exclusively with std::lock_guard and shared with FileLatch::Shared.
+ */
+class FileLatch {
+public:
+    FileLatch() { pthread_rwlock_init(&this->rwlock, nullptr); }
+
+    virtual ~FileLatch() { pthread_rwlock_destroy(&this->rwlock); }
+
+    FileLatch(const FileLatch &other) = delete;
+
+    FileLatch &operator=(const FileLatch &other) = delete;
+
+    void lock_shared() { pthread_rwlock_rdlock(&this->rwlock); }
+
+    void lock() { pthread_rwlock_wrlock(&this->rwlock); }
+
+    void unlock() { pthread_rwlock_unlock(&this->rwlock); }
+
+    /**
+     * @class Shared - holds a FileLatch shared until it goes out of scope (the reader's std::lock_guard)
+     */
+    class Shared {
+    public:
+        explicit Shared(FileLatch &latch) : latch(latch) { latch.lock_shared(); }
+
+        virtual ~Shared() { latch.unlock(); }
+
+        Shared(const Shared &other) = delete;
+
+        Shared &operator=(const Shared &other) = delete;
+
+    protected:
+        FileLatch &latch;
+    };
+
+protected:
+    pthread_rwlock_t rwlock;
+};
+
+
 
 /**
  * @class HeapFile - heap file implementation of DbFile
@@ -55,11 +99,19 @@ public:
      */
     virtual uint32_t get_last_block_id() { return last; }
 
+    /**
+     * A thread sharing the file with others holds this latch shared around get() and exclusively around put()
+     * and get_new(). Every get() reads into a block of its own, so readers don't wait for each other.
+     * @return the file's latch
+     */
+    FileLatch &get_latch() { return latch; }
+
 protected:
     std::string dbfilename;
     uint32_t last;
     bool closed;
     Db db;
+    FileLatch latch;
 
     virtual void db_open(uint flags = 0);
 
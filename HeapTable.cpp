@@ -94,6 +94,7 @@ void HeapTable::del(const Handle handle) {
     open();
     BlockID block_id = handle.first;
     RecordID record_id = handle.second;
+    std::lock_guard<FileLatch> guard(this->file.get_latch());
     SlottedPage *block = this->file.get(block_id);
     block->del(record_id);
     this->file.put(block);
@@ -118,15 +119,19 @@ Handles *HeapTable::select(const ValueDict *where) {
     Handles *handles = new Handles();
     BlockIDs *block_ids = file.block_ids();
     for (auto const &block_id: *block_ids) {
-        SlottedPage *block = file.get(block_id);
-        RecordIDs *record_ids = block->ids();
+        RecordIDs *record_ids;
+        {
+            FileLatch::Shared guard(file.get_latch());
+            SlottedPage *block = file.get(block_id);
+            record_ids = block->ids();
+            delete block;
+        }
         for (auto const &record_id: *record_ids) {
             Handle handle(block_id, record_id);
             if (selected(handle, where))
                 handles->push_back(handle);
         }
         delete record_ids;
-        delete block;
     }
     delete block_ids;
     return handles;
@@ -165,11 +170,15 @@ ValueDict *HeapTable::project(Handle handle) {
 ValueDict *HeapTable::project(Handle handle, const ColumnNames *column_names) {
     BlockID block_id = handle.first;
     RecordID record_id = handle.second;
-    SlottedPage *block = file.get(block_id);
-    Dbt *data = block->get(record_id);
-    ValueDict *row = unmarshal(data);
-    delete data;
-    delete block;
+    ValueDict *row;
+    {
+        FileLatch::Shared guard(file.get_latch());
+        SlottedPage *block = file.get(block_id);
+        Dbt *data = block->get(record_id);
+        row = unmarshal(data);
+        delete data;
+        delete block;
+    }
     if (column_names->empty())
         return row;
     ValueDict *result = new ValueDict();
@@ -182,6 +191,85 @@ ValueDict *HeapTable::project(Handle handle, const ColumnNames *column_names) {
     return result;
 }
 
+// Number of blocks in the table's file.
+BlockID HeapTable::get_block_count() {
+    open();
+    return file.get_last_block_id();
+}
+
+/**
+ * Unmarshal every row in a block, reading the block just once.
+ * @param block_id  which block
+ * @param handles   if not nullptr, the rows' handles are appended onto it
+ * @return          the rows, in record id order (freed by caller)
+ */
+ValueDicts *HeapTable::project_block(BlockID block_id, Handles *handles) {
+    open();
+    ValueDicts *rows = new ValueDicts();
+    FileLatch::Shared guard(file.get_latch());
+    SlottedPage *block = file.get(block_id);
+    RecordIDs *record_ids = block->ids();
+    for (auto const &record_id: *record_ids) {
+        Dbt *data = block->get(record_id);
+        rows->push_back(unmarshal(data));
+        delete data;
+        if (handles != nullptr)
+            handles->push_back(Handle(block_id, record_id));
+    }
+    delete record_ids;
+    delete block;
+    return rows;
+}
+
+/**
+ * Decode every row in a block straight into a batch's column vectors, without making a ValueDict for any of them.
+ * @param block_id  which block
+ * @param batch     where the rows go (only the batch's columns are kept)
+ */
+void HeapTable::project_block(BlockID block_id, ColumnBatch &batch) {
+    open();
+    std::vector<int> to_column;  // batch column for each of ours, -1 if the batch doesn't want it
+    for (auto const &column_name: this->column_names)
+        to_column.push_back(batch.column_index(column_name));
+    FileLatch::Shared guard(file.get_latch());
+    SlottedPage *block = file.get(block_id);
+    RecordIDs *record_ids = block->ids();
+    for (auto const &record_id: *record_ids) {
+        Dbt *data = block->get(record_id);
+        const char *bytes = (const char *) data->get_data();
+        uint offset = 0;
+        for (uint col_num = 0; col_num < this->column_names.size(); col_num++) {
+            int column = to_column[col_num];
+            switch (this->column_attributes[col_num].get_data_type()) {
+                case ColumnAttribute::DataType::INT:
+                    if (column >= 0)
+                        batch.ints(column).push_back(*(int32_t *) (bytes + offset));
+                    offset += sizeof(int32_t);
+                    break;
+                case ColumnAttribute::DataType::TEXT: {
+                    u16 size = *(u16 *) (bytes + offset);
+                    offset += sizeof(u16);
+                    if (column >= 0)
+                        batch.texts(column).push_back(string(bytes + offset, size));
+                    offset += size;
+                    break;
+                }
+                case ColumnAttribute::DataType::BOOLEAN:
+                    if (column >= 0)
+                        batch.ints(column).push_back(*(uint8_t *) (bytes + offset));
+                    offset += sizeof(uint8_t);
+                    break;
+                default:
+                    throw DbRelationError("Only know how to unmarshal INT, TEXT, and BOOLEAN");
+            }
+        }
+        batch.add_row();
+        delete data;
+    }
+    delete record_ids;
+    delete block;
+}
+
 /**
  * Check if the given row is acceptable to insert.
  * @param row to be validated
@@ -209,6 +297,7 @@ ValueDict *HeapTable::validate(const ValueDict *row) const {
  */
 Handle HeapTable::append(const ValueDict *row) {
     Dbt *data = marshal(row);
+    std::lock_guard<FileLatch> guard(this->file.get_latch());
     SlottedPage *block = this->file.get(this->file.get_last_block_id());
     RecordID record_id;
     try {
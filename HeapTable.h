@@ -57,6 +57,12 @@ public:
 
     using DbRelation::project;
 
+    virtual BlockID get_block_count();
+
+    virtual ValueDicts *project_block(BlockID block_id, Handles *handles = nullptr);
+
+    virtual void project_block(BlockID block_id, ColumnBatch &batch);
+
 protected:
     HeapFile file;
 
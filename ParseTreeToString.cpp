@@ -83,14 +83,20 @@ string ParseTreeToString::operator_expression(const Expr *expr) {
         case Expr::NONE:
             break;
         case Expr::BETWEEN:
+            ret += "BETWEEN";
+            if (expr->exprList != NULL && expr->exprList->size() == 2)
+                ret += " " + expression(expr->exprList->at(0)) + " AND " + expression(expr->exprList->at(1));
             break;
         case Expr::CASE:
             break;
         case Expr::NOT_EQUALS:
+            ret += "<>";
             break;
         case Expr::LESS_EQ:
+            ret += "<=";
             break;
         case Expr::GREATER_EQ:
+            ret += ">=";
             break;
         case Expr::LIKE:
             break;
@@ -3,6 +3,10 @@
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Spring 2020"
  */
+#include <algorithm>
+#include <functional>
+#include <regex>
+#include <sstream>
 #include "SQLExec.h"
 #include "EvalPlan.h"
 
@@ -12,6 +16,7 @@ using namespace hsql;
 // define static data
 Tables *SQLExec::tables = nullptr;
 Indices *SQLExec::indices = nullptr;
+Statistics *SQLExec::statistics = nullptr;
 
 // make query result be printable
 ostream &operator<<(ostream &out, const QueryResult &qres) {
@@ -60,17 +65,22 @@ QueryResult::~QueryResult() {
 }
 
 
-QueryResult *SQLExec::execute(const SQLStatement *statement) {
-    // initialize _tables table, if not yet present
+void SQLExec::initialize() {
     if (SQLExec::tables == nullptr) {
         SQLExec::tables = new Tables();
         SQLExec::indices = new Indices();
+        SQLExec::statistics = new Statistics();
     }
+}
+
+QueryResult *SQLExec::execute(const SQLStatement *statement, const QueryOptions &options) {
+    // initialize _tables table, if not yet present
+    initialize();
 
     try {
         switch (statement->type()) {
             case kStmtCreate:
-                return create((const CreateStatement *) statement);
+                return create((const CreateStatement *) statement, options);
             case kStmtDrop:
                 return drop((const DropStatement *) statement);
             case kStmtShow:
@@ -80,7 +90,7 @@ QueryResult *SQLExec::execute(const SQLStatement *statement) {
             case kStmtDelete:
                 return del((const DeleteStatement *) statement);
             case kStmtSelect:
-                return select((const SelectStatement *) statement);
+                return select((const SelectStatement *) statement, options);
             default:
                 return new QueryResult("not implemented");
         }
@@ -89,40 +99,559 @@ QueryResult *SQLExec::execute(const SQLStatement *statement) {
     }
 }
 
+/**
+ * Take our SQL extensions out of a query before it goes to the parser:
+ *      CREATE INDEX index ON table [USING LSM] (key columns) [INCLUDE (other columns)] [WITH BLOOM]
+ *      REBUILD BLOOM FILTER index ON table
+ *      SHOW INDEX STATS FROM table
+ *      ANALYZE [table]
+ *      EXPLAIN SELECT ...
+ * @param query    the SQL query (the extension clause is removed)
+ * @param options  returned by reference: the extension clauses taken off the query
+ * @return       the result of a query handled entirely here, else nullptr (the rest of the query still has
+ *               to be parsed and executed)
+ */
+QueryResult *SQLExec::preprocess(string &query, QueryOptions &options) {
+    options = QueryOptions();
+
+    static const regex rebuild_bloom("^\\s*REBUILD\\s+BLOOM\\s+FILTER\\s+(\\w+)\\s+ON\\s+(\\w+)\\s*;?\\s*$",
+                                     regex::icase);
+    static const regex index_stats("^\\s*SHOW\\s+INDEX\\s+STATS\\s+FROM\\s+(\\w+)\\s*;?\\s*$", regex::icase);
+    static const regex analyze_table("^\\s*ANALYZE(\\s+(\\w+))?\\s*;?\\s*$", regex::icase);
+    static const regex explain_select("^\\s*EXPLAIN\\s+(?=SELECT\\s)", regex::icase);
+    static const regex with_bloom("\\s+WITH\\s+BLOOM\\s*;?\\s*$", regex::icase);
+    static const regex using_lsm("\\s+USING\\s+LSM\\b", regex::icase);
+    static const regex include_clause("\\s+INCLUDE\\s*\\(([^)]*)\\)\\s*;?\\s*$", regex::icase);
+    static const regex create_index("^\\s*CREATE\\s+INDEX\\s", regex::icase);
+    static const regex column_name("\\s*(\\w+)\\s*(,|$)");
+    smatch match;
+    if (regex_match(query, match, rebuild_bloom))
+        return rebuild_bloom_filter(match[2].str(), match[1].str());
+    if (regex_match(query, match, index_stats))
+        return show_index_stats(match[1].str());
+    if (regex_match(query, match, analyze_table))
+        return analyze(match[2].str());
+    if (regex_search(query, match, explain_select)) {
+        query = match.suffix().str();
+        options.explain = true;
+    }
+    if (regex_search(query, match, with_bloom)) {
+        if (!regex_search(query, create_index))
+            throw SQLExecError("WITH BLOOM is only allowed on CREATE INDEX");
+        query = match.prefix().str();
+        options.bloom_filter = true;
+    }
+    if (regex_search(query, create_index) && regex_search(query, match, using_lsm)) {
+        query = match.prefix().str() + match.suffix().str();
+        options.index_type = "LSM";
+    }
+    if (regex_search(query, match, include_clause)) {
+        if (!regex_search(query, create_index))
+            throw SQLExecError("INCLUDE is only allowed on CREATE INDEX");
+        string columns = match[1].str();
+        query = match.prefix().str();
+        for (sregex_iterator it(columns.begin(), columns.end(), column_name), end; it != end; ++it)
+            options.include_columns.push_back((*it)[1].str());
+        if (options.include_columns.empty())
+            throw SQLExecError("INCLUDE needs at least one column");
+    }
+    return nullptr;
+}
+
+// REBUILD BLOOM FILTER index ON table (also adds one to an index that doesn't have one yet)
+QueryResult *SQLExec::rebuild_bloom_filter(Identifier table_name, Identifier index_name) {
+    initialize();
+    try {
+        DbIndex &index = SQLExec::indices->get_index(table_name, index_name);
+        index.create_filter();
+    } catch (DbRelationError &e) {
+        throw SQLExecError(string("DbRelationError: ") + e.what());
+    }
+    return new QueryResult("rebuilt Bloom filter for index " + index_name);
+}
+
+// SHOW INDEX STATS FROM table: the shape of each of the table's indices (those that can describe themselves)
+QueryResult *SQLExec::show_index_stats(Identifier table_name) {
+    initialize();
+    ColumnNames *column_names = new ColumnNames;
+    ColumnAttributes *column_attributes = new ColumnAttributes;
+    const char *text_columns[] = {"index_name", "index_type"};
+    for (auto const &column_name: text_columns) {
+        column_names->push_back(column_name);
+        column_attributes->push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    }
+    const char *int_columns[] = {"height", "leaf_pages", "interior_pages", "fill_percent", "keys", "splits"};
+    for (auto const &column_name: int_columns) {
+        column_names->push_back(column_name);
+        column_attributes->push_back(ColumnAttribute(ColumnAttribute::INT));
+    }
+    column_names->push_back("bloom_fp_rate");
+    column_attributes->push_back(ColumnAttribute(ColumnAttribute::TEXT));
+
+    ValueDicts *rows = new ValueDicts;
+    string without;
+    try {
+        for (auto const &index_name: SQLExec::indices->get_index_names(table_name)) {
+            ColumnNames key_columns;
+            Identifier index_type;
+            bool is_unique;
+            SQLExec::indices->get_columns(table_name, index_name, key_columns, index_type, is_unique);
+            IndexStats stats;
+            try {
+                stats = SQLExec::indices->get_index(table_name, index_name).get_stats();
+            } catch (DbRelationError &e) {
+                without += (without.empty() ? "" : ", ") + index_name;
+                continue;
+            }
+            ValueDict *row = new ValueDict;
+            (*row)["index_name"] = Value(index_name);
+            (*row)["index_type"] = Value(index_type);
+            (*row)["height"] = Value((int32_t) stats.height);
+            (*row)["leaf_pages"] = Value((int32_t) stats.leaf_pages);
+            (*row)["interior_pages"] = Value((int32_t) stats.interior_pages);
+            (*row)["fill_percent"] = Value((int32_t) (stats.fill * 100 + 0.5));
+            (*row)["keys"] = Value((int32_t) stats.key_count);
+            (*row)["splits"] = Value((int32_t) stats.splits);
+            string fp_rate = "none";
+            if (stats.has_filter) {
+                ostringstream out;
+                out << stats.filter_false_positive_rate * 100 << "% (expected "
+                    << stats.filter_expected_false_positive_rate * 100 << "%)";
+                fp_rate = out.str();
+            }
+            (*row)["bloom_fp_rate"] = Value(fp_rate);
+            rows->push_back(row);
+        }
+    } catch (DbRelationError &e) {
+        for (auto const &row: *rows)
+            delete row;
+        delete rows;
+        delete column_names;
+        delete column_attributes;
+        throw SQLExecError(string("DbRelationError: ") + e.what());
+    }
+    string message = "successfully returned " + to_string(rows->size()) + " rows";
+    if (!without.empty())
+        message += " (no statistics for " + without + ")";
+    return new QueryResult(column_names, column_attributes, rows, message);
+}
+
+/**
+ * ANALYZE [table]: gather the statistics the optimizer costs plans with, for the table or else every table.
+ * @param table_name  table to analyze, or empty for all of them (but the schema tables)
+ * @return            what was analyzed
+ */
+QueryResult *SQLExec::analyze(Identifier table_name) {
+    initialize();
+    IndexNames table_names;  // a list of identifiers, like index names
+    if (table_name.empty()) {
+        Handles *handles = SQLExec::tables->select();
+        for (auto const &handle: *handles) {
+            ValueDict *row = SQLExec::tables->project(handle);
+            Identifier name = row->at("table_name").s;
+            if (name[0] != '_')
+                table_names.push_back(name);
+            delete row;
+        }
+        delete handles;
+    } else {
+        table_names.push_back(table_name);
+    }
+    string message;
+    try {
+        for (auto const &name: table_names) {
+            TableStatistics stats;
+            stats.analyze(SQLExec::tables->get_table(name));
+            SQLExec::statistics->save(name, stats);
+            message += (message.empty() ? "analyzed " : ", ") + name + " (" + to_string(stats.get_row_count()) +
+                       " rows in " + to_string(stats.get_page_count()) + " blocks)";
+        }
+    } catch (DbRelationError &e) {
+        throw SQLExecError(string("DbRelationError: ") + e.what());
+    }
+    return new QueryResult(message.empty() ? "no tables to analyze" : message);
+}
+
+// The value of a constant in a predicate
+static Value literal_value(const Expr *expr) {
+    if (expr->type == kExprLiteralString)
+        return Value(expr->name);
+    if (expr->type == kExprLiteralInt)
+        return Value(expr->ival);
+    throw SQLExecError("Only support INT and TEXT data type");
+}
+
+// Is the predicate a comparison other than =: <, <=, >, >= or BETWEEN?
+static bool is_range_predicate(const Expr *expr) {
+    return expr->type == kExprOperator &&
+           ((expr->opType == Expr::SIMPLE_OP && (expr->opChar == '<' || expr->opChar == '>')) ||
+            expr->opType == Expr::LESS_EQ || expr->opType == Expr::GREATER_EQ || expr->opType == Expr::BETWEEN);
+}
+
+// Narrow the column's range to what a comparison of it with constants (see is_range_predicate) lets through
+static void add_range(ValueRanges &ranges, const Identifier &column_name, const Expr *expr) {
+    ValueRange &range = ranges[column_name];
+    if (expr->opType == Expr::BETWEEN) {
+        if (expr->exprList == nullptr || expr->exprList->size() != 2)
+            throw SQLExecError("BETWEEN needs two values");
+        range.above(literal_value(expr->exprList->at(0)), true);
+        range.below(literal_value(expr->exprList->at(1)), true);
+    } else if (expr->opType == Expr::GREATER_EQ || (expr->opType == Expr::SIMPLE_OP && expr->opChar == '>')) {
+        range.above(literal_value(expr->expr2), expr->opType == Expr::GREATER_EQ);
+    } else {
+        range.below(literal_value(expr->expr2), expr->opType == Expr::LESS_EQ);
+    }
+}
+
 /**
  *  Get where clause from sql parser
  *  @param parse_where  The expression represent for where clause
- *  @return             where clause
+ *  @param ranges       returned by reference: the columns' ranges for comparisons other than = (or nullptr if
+ *                      there mustn't be any)
+ *  @return             where clause (its = terms)
  */
-ValueDict* get_where_conjuction(const Expr *parse_where) {
+ValueDict* get_where_conjuction(const Expr *parse_where, ValueRanges *ranges = nullptr) {
+    if(parse_where->type != kExprOperator) {
+        throw SQLExecError("Only support operator where clause");
+    }
+    if(parse_where->opType == Expr::AND) {
+        ValueDict* where_list = get_where_conjuction(parse_where->expr, ranges);
+        ValueDict* where2;
+        try {
+            where2 = get_where_conjuction(parse_where->expr2, ranges);
+        } catch (SQLExecError &e) {
+            delete where_list;
+            throw;
+        }
+        where_list->insert(where2->begin(), where2->end());
+        delete where2;
+        return where_list;
+    }
+    if(is_range_predicate(parse_where)) {
+        if(ranges == nullptr) {
+            throw SQLExecError("Only equality predicates currently supported");
+        }
+        if(parse_where->expr->type != kExprColumnRef) {
+            throw SQLExecError("Only support comparing a column with values");
+        }
+        add_range(*ranges, parse_where->expr->name, parse_where);
+        return new ValueDict();
+    }
+    if(parse_where->opType != Expr::SIMPLE_OP) {
+        throw SQLExecError("Only support AND conjunctioins");
+    }
+    if(parse_where->opChar != '=') {
+        throw SQLExecError("Only support =, <, >, <=, >= and BETWEEN predicates");
+    }
     ValueDict* where_list = new ValueDict();
-    if(parse_where->type == kExprOperator) {
-        if(parse_where->opType == Expr::AND) {
-            ValueDict* where1 = get_where_conjuction(parse_where->expr);
-            ValueDict* where2 = get_where_conjuction(parse_where->expr2);
-            where_list->insert(where1->begin(), where1->end());
-            where_list->insert(where2->begin(), where2->end());
-            delete where1;
-            delete where2;
-        } else if(parse_where->opType == Expr::SIMPLE_OP) {
-            Identifier col_name = parse_where->expr->name;
-            if(parse_where->opChar != '=') {
-                throw SQLExecError("Only equality predicates currently supported");
+    (*where_list)[parse_where->expr->name] = literal_value(parse_where->expr2);
+    return where_list;
+}
+
+// The terms of a conjunction.
+static void conjunction_terms(const Expr *expr, vector<const Expr *> &terms) {
+    if (expr->type == kExprOperator && expr->opType == Expr::AND) {
+        conjunction_terms(expr->expr, terms);
+        conjunction_terms(expr->expr2, terms);
+    } else {
+        terms.push_back(expr);
+    }
+}
+
+// The FROM clause's tables (by name, and by alias too), and the ON conditions of its joins.
+static void from_tables(const TableRef *table_ref, vector<Identifier> &table_names,
+                        map<Identifier, Identifier> &aliases, vector<const Expr *> &terms) {
+    switch (table_ref->type) {
+        case kTableName: {
+            Identifier table_name = table_ref->name;
+            if (find(table_names.begin(), table_names.end(), table_name) != table_names.end())
+                throw SQLExecError("table " + table_name + " can only appear once in a join");
+            table_names.push_back(table_name);
+            aliases[table_name] = table_name;
+            if (table_ref->alias != nullptr)
+                aliases[table_ref->alias] = table_name;
+            break;
+        }
+        case kTableJoin:
+            if (table_ref->join->type != kJoinInner && table_ref->join->type != kJoinCross)
+                throw SQLExecError("Only inner joins currently supported");
+            from_tables(table_ref->join->left, table_names, aliases, terms);
+            from_tables(table_ref->join->right, table_names, aliases, terms);
+            if (table_ref->join->condition != nullptr)
+                conjunction_terms(table_ref->join->condition, terms);
+            break;
+        case kTableCrossProduct:
+            for (auto const &listed: *table_ref->list)
+                from_tables(listed, table_names, aliases, terms);
+            break;
+        default:
+            throw SQLExecError("Only tables and joins of tables currently supported in FROM");
+    }
+}
+
+// table.column for a column reference, finding the table if it isn't given
+static Identifier join_column(const Expr *expr, const vector<Identifier> &table_names,
+                              const map<Identifier, Identifier> &aliases) {
+    Identifier column_name = expr->name;
+    vector<Identifier> candidates;
+    if (expr->table != nullptr) {
+        auto found = aliases.find(expr->table);
+        if (found == aliases.end())
+            throw SQLExecError(string("unknown table ") + expr->table);
+        candidates.push_back(found->second);
+    } else {
+        candidates = table_names;
+    }
+    Identifier ret;
+    for (auto const &table_name: candidates) {
+        const ColumnNames &column_names = Tables::get_table(table_name).get_column_names();
+        if (find(column_names.begin(), column_names.end(), column_name) == column_names.end())
+            continue;
+        if (!ret.empty())
+            throw SQLExecError("column " + column_name + " is ambiguous");
+        ret = table_name + "." + column_name;
+    }
+    if (ret.empty())
+        throw SQLExecError("unknown column " + column_name);
+    return ret;
+}
+
+// The aggregate function a call in the select list makes, e.g., SUM(amount)
+static Aggregation aggregation(const Expr *expr, const function<Identifier(const Expr *)> &column) {
+    static const map<string, Aggregation::Function> functions = {
+            {"COUNT", Aggregation::COUNT}, {"SUM", Aggregation::SUM}, {"MIN", Aggregation::MIN},
+            {"MAX", Aggregation::MAX}, {"AVG", Aggregation::AVG}};
+    string name = expr->name;
+    transform(name.begin(), name.end(), name.begin(), ::toupper);
+    auto found = functions.find(name);
+    if (found == functions.end())
+        throw SQLExecError("unknown function " + string(expr->name));
+    if (expr->distinct)
+        throw SQLExecError("DISTINCT aggregates not supported");
+    const Expr *argument = expr->exprList != nullptr && !expr->exprList->empty() ? expr->exprList->at(0) : expr->expr;
+    Identifier column_name;
+    if (argument == nullptr || (argument->type == kExprStar && found->second != Aggregation::COUNT))
+        throw SQLExecError(name + " needs a column");
+    if (argument->type != kExprStar) {
+        if (argument->type != kExprColumnRef)
+            throw SQLExecError("Only support aggregates of a column");
+        column_name = column(argument);
+    }
+    Aggregation ret(found->second, column_name, "");
+    ret.name = expr->alias != nullptr ? expr->alias : ret.text();
+    return ret;
+}
+
+// The column an ORDER BY term sorts by: for aggregated rows, an aggregate (added if the select list hasn't got it),
+// an aggregate's alias or a group by column; otherwise any column of the rows.
+static Identifier order_column(const Expr *expr, const function<Identifier(const Expr *)> &column,
+                               const ColumnNames *group_by, Aggregations *aggregations) {
+    if (aggregations == nullptr) {
+        if (expr->type != kExprColumnRef)
+            throw SQLExecError("Only support ordering by columns");
+        return column(expr);
+    }
+    if (expr->type == kExprFunctionRef) {
+        Aggregation found = aggregation(expr, column);
+        for (auto const &other: *aggregations)
+            if (other.function == found.function && other.column_name == found.column_name)
+                return other.name;
+        found.name = found.text();
+        aggregations->push_back(found);
+        return found.name;
+    }
+    if (expr->type != kExprColumnRef)
+        throw SQLExecError("Only support ordering by columns and aggregate functions");
+    if (expr->table == nullptr)
+        for (auto const &other: *aggregations)
+            if (other.name == expr->name)
+                return other.name;
+    Identifier column_name = column(expr);
+    if (find(group_by->begin(), group_by->end(), column_name) == group_by->end())
+        throw SQLExecError("column " + column_name + " must be grouped by or in an aggregate function");
+    return column_name;
+}
+
+/**
+ * Plan the select list over the rows of the FROM and WHERE clauses. With a GROUP BY or aggregate functions in the
+ * select list (COUNT, SUM, MIN, MAX, AVG), the rows are first aggregated into a row for each group; the columns
+ * selected besides the aggregates must then be ones the rows are grouped by. An ORDER BY sorts the rows (or the
+ * groups) just before they are projected, so it can be by columns that aren't selected; LIMIT and OFFSET then
+ * pick out some of the rows, and nothing is read beyond what they need.
+ * @param statement    the SELECT
+ * @param plan         the rows (deleted if the select list can't be planned)
+ * @param all_columns  the rows' columns, for *
+ * @param column       what the rows name a column reference's column
+ * @param query_names  returned by reference: the columns selected
+ * @return             the plan (freed by caller)
+ */
+static EvalPlan *select_list_plan(const SelectStatement *statement, EvalPlan *plan, const ColumnNames &all_columns,
+                                  const function<Identifier(const Expr *)> &column, ColumnNames &query_names) {
+    try {
+        bool aggregated = statement->groupBy != nullptr;
+        for (auto const &expr: *statement->selectList)
+            aggregated = aggregated || expr->type == kExprFunctionRef;
+        bool star = !aggregated && statement->selectList->at(0)->type == kExprStar;
+        ColumnNames *group_by = nullptr;
+        Aggregations *aggregations = nullptr;
+        if (star) {
+            query_names = all_columns;
+        } else if (!aggregated) {
+            for (auto const &expr: *statement->selectList) {
+                if (expr->type != kExprColumnRef)
+                    throw SQLExecError("Only support columns and aggregate functions in the select list");
+                query_names.push_back(column(expr));
+            }
+        } else {
+            group_by = new ColumnNames();
+            aggregations = new Aggregations();
+            plan = new EvalPlan(group_by, aggregations, plan);  // now it's the one to delete
+            if (statement->groupBy != nullptr) {
+                if (statement->groupBy->having != nullptr)
+                    throw SQLExecError("HAVING not supported");
+                for (auto const &expr: *statement->groupBy->columns) {
+                    if (expr->type != kExprColumnRef)
+                        throw SQLExecError("Only support grouping by columns");
+                    group_by->push_back(column(expr));
+                }
             }
-            if(parse_where->expr2->type == kExprLiteralString) {
-                (*where_list)[col_name] = Value(parse_where->expr2->name);
-            } else if(parse_where->expr2->type == kExprLiteralInt) {
-                (*where_list)[col_name] = Value(parse_where->expr2->ival);
-            } else {
-                throw SQLExecError("Only support INT and TEXT data type");
+            for (auto const &expr: *statement->selectList) {
+                if (expr->type == kExprFunctionRef) {
+                    // the same aggregate twice under one name is computed once; anything else under a name already
+                    // taken would overwrite that column in the result rows
+                    Aggregation found = aggregation(expr, column);
+                    bool duplicate = false;
+                    for (auto const &other: *aggregations) {
+                        if (other.name != found.name)
+                            continue;
+                        if (other.function != found.function || other.column_name != found.column_name)
+                            throw SQLExecError("duplicate column name " + found.name + " in the select list");
+                        duplicate = true;
+                    }
+                    if (find(group_by->begin(), group_by->end(), found.name) != group_by->end())
+                        throw SQLExecError("duplicate column name " + found.name + " in the select list");
+                    if (!duplicate)
+                        aggregations->push_back(found);
+                    query_names.push_back(found.name);
+                } else if (expr->type == kExprColumnRef) {
+                    Identifier column_name = column(expr);
+                    if (find(group_by->begin(), group_by->end(), column_name) == group_by->end())
+                        throw SQLExecError(
+                                "column " + column_name + " must be grouped by or in an aggregate function");
+                    query_names.push_back(column_name);
+                } else {
+                    throw SQLExecError("Only support columns and aggregate functions in the select list");
+                }
             }
+        }
+
+        if (statement->order != nullptr && !statement->order->empty()) {
+            SortColumns sort_columns;
+            for (auto const &order: *statement->order)
+                sort_columns.push_back(make_pair(order_column(order->expr, column, group_by, aggregations),
+                                                 order->type == kOrderDesc));
+            plan = new EvalPlan(new SortColumns(sort_columns), plan);
+        }
+        if (statement->limit != nullptr && (statement->limit->limit >= 0 || statement->limit->offset > 0))
+            plan = new EvalPlan(statement->limit->limit >= 0 ? (u_long) statement->limit->limit : EvalPlan::NO_LIMIT,
+                                statement->limit->offset > 0 ? (u_long) statement->limit->offset : 0, plan);
+        if (star)
+            return new EvalPlan(EvalPlan::ProjectAll, plan);
+        return new EvalPlan(new ColumnNames(query_names), plan);
+    } catch (...) {
+        delete plan;
+        query_names.clear();
+        throw;
+    }
+}
+
+/**
+ * Plan a SELECT from several tables: FROM a JOIN b ON a.x = b.y, or FROM a, b WHERE a.x = b.y. Terms of the ON and
+ * WHERE clauses comparing a column to a value become a Select on that column's table (where an index can pick them
+ * up); those comparing columns of two tables become join conditions. The tables are joined left-deep, in the order
+ * given, each to those before it that it has join conditions with. Columns are named table.column.
+ * @param statement    the SELECT
+ * @param query_names  returned by reference: the columns selected
+ * @return             the plan (freed by caller)
+ */
+EvalPlan *SQLExec::join_plan(const SelectStatement *statement, ColumnNames &query_names) {
+    vector<Identifier> table_names;
+    map<Identifier, Identifier> aliases;
+    vector<const Expr *> terms;
+    from_tables(statement->fromTable, table_names, aliases, terms);
+    if (statement->whereClause != nullptr)
+        conjunction_terms(statement->whereClause, terms);
+
+    map<Identifier, ValueDict *> selects;  // by table
+    map<Identifier, ValueRanges *> ranges;  // by table
+    JoinColumns conditions;
+    for (auto const &term: terms) {
+        bool range = is_range_predicate(term);
+        if (!range && (term->type != kExprOperator || term->opType != Expr::SIMPLE_OP || term->opChar != '='))
+            throw SQLExecError("Only support =, <, >, <=, >= and BETWEEN predicates");
+        if (term->expr->type != kExprColumnRef)
+            throw SQLExecError("Only support comparing a column with values or (for =) another table's column");
+        Identifier column = join_column(term->expr, table_names, aliases);
+        Identifier table_name = column.substr(0, column.find('.'));
+        if (range) {
+            if (ranges.find(table_name) == ranges.end())
+                ranges[table_name] = new ValueRanges();
+            add_range(*ranges[table_name], column.substr(table_name.size() + 1), term);
+            continue;
+        }
+        if (term->expr2->type == kExprColumnRef) {
+            Identifier other = join_column(term->expr2, table_names, aliases);
+            if (other.substr(0, other.find('.')) == table_name)
+                throw SQLExecError("Only support comparing columns of different tables");
+            conditions.push_back(make_pair(column, other));
+            continue;
+        }
+        if (selects.find(table_name) == selects.end())
+            selects[table_name] = new ValueDict();
+        Identifier column_name = column.substr(table_name.size() + 1);
+        (*selects[table_name])[column_name] = literal_value(term->expr2);
+    }
+
+    EvalPlan *plan = nullptr;
+    vector<Identifier> joined;
+    for (auto const &table_name: table_names) {
+        EvalPlan *input = new EvalPlan(Tables::get_table(table_name));
+        if (selects.find(table_name) != selects.end() || ranges.find(table_name) != ranges.end()) {
+            if (selects.find(table_name) == selects.end())
+                selects[table_name] = new ValueDict();
+            input = new EvalPlan(selects[table_name], ranges.find(table_name) == ranges.end() ? nullptr :
+                                                      ranges[table_name], input);
+        }
+        if (plan == nullptr) {
+            plan = input;
         } else {
-            throw SQLExecError("Only support AND conjunctioins");
+            JoinColumns *on = new JoinColumns();
+            for (auto const &condition: conditions) {
+                Identifier first = condition.first.substr(0, condition.first.find('.'));
+                Identifier second = condition.second.substr(0, condition.second.find('.'));
+                if (second == table_name && find(joined.begin(), joined.end(), first) != joined.end())
+                    on->push_back(condition);
+                else if (first == table_name && find(joined.begin(), joined.end(), second) != joined.end())
+                    on->push_back(make_pair(condition.second, condition.first));
+            }
+            if (on->empty()) {
+                delete on;
+                delete input;
+                delete plan;
+                throw SQLExecError("no join condition for table " + table_name + " (cross products not supported)");
+            }
+            plan = new EvalPlan(plan, input, on);
         }
-    } else {
-        throw SQLExecError("Only support operator where clause");
+        joined.push_back(table_name);
     }
-    return where_list;
+
+    ColumnNames all_columns;
+    for (auto const &table_name: table_names)
+        for (auto const &column_name: Tables::get_table(table_name).get_column_names())
+            all_columns.push_back(table_name + "." + column_name);
+    return select_list_plan(statement, plan, all_columns, [&](const Expr *expr) {
+        return join_column(expr, table_names, aliases);
+    }, query_names);
 }
 
 /**
@@ -130,37 +659,80 @@ ValueDict* get_where_conjuction(const Expr *parse_where) {
  *  @param statement    The SQL select statement will be executed
  *  @return             the query result (freed by caller)
  */
-QueryResult *SQLExec::select(const SelectStatement *statement) {
-    Identifier table_name = statement->fromTable->name;
+QueryResult *SQLExec::select(const SelectStatement *statement, const QueryOptions &options) {
+    ColumnNames* query_names = new ColumnNames();
 
-    DbRelation &table = SQLExec::tables->get_table(table_name);
+    EvalPlan* plan;
 
-    ColumnNames* query_names = new ColumnNames();
+    if (statement->fromTable->type != kTableName) {
+        try {
+            plan = join_plan(statement, *query_names);
+        } catch (SQLExecError &e) {
+            delete query_names;
+            throw;
+        }
+    } else {
+        Identifier table_name = statement->fromTable->name;
 
-    vector<Expr*>*  select_list = statement->selectList;
+        DbRelation &table = SQLExec::tables->get_table(table_name);
 
-    EvalPlan* plan = new EvalPlan(table);
+        plan = new EvalPlan(table);
 
-    if(statement->whereClause != nullptr) {
-        plan = new EvalPlan(get_where_conjuction(statement->whereClause), plan);
-        cout << "where" << endl;
-    }
+        if(statement->whereClause != nullptr) {
+            ValueRanges *ranges = new ValueRanges();
+            ValueDict *where;
+            try {
+                where = get_where_conjuction(statement->whereClause, ranges);
+            } catch (SQLExecError &e) {
+                delete ranges;
+                delete plan;
+                delete query_names;
+                throw;
+            }
+            if (ranges->empty()) {
+                delete ranges;
+                ranges = nullptr;
+            }
+            plan = new EvalPlan(where, ranges, plan);
+        }
 
-    if(select_list->at(0)->type == kExprStar) {
-        *query_names = table.get_column_names();
-        plan = new EvalPlan(EvalPlan::ProjectAll, plan);
-    } else {
-        for(auto const& expr : *statement->selectList) {
-            query_names->push_back(string(expr->name));
-            cout << string(expr->name) << endl;
+        try {
+            plan = select_list_plan(statement, plan, table.get_column_names(), [](const Expr *expr) {
+                return Identifier(expr->name);
+            }, *query_names);
+        } catch (SQLExecError &e) {
+            delete query_names;
+            throw;
         }
-        plan = new EvalPlan(query_names, plan);
     }
 
-    ColumnAttributes *column_attributes = table.get_column_attributes(*query_names);
+    ColumnNames plan_names;
+    ColumnAttributes plan_attributes;
+    plan->get_columns(plan_names, plan_attributes);
+    ColumnAttributes *column_attributes = new ColumnAttributes(plan_attributes);
+
+    EvalPlan *best_plan = plan->optimize(*SQLExec::indices, SQLExec::statistics);
+    delete plan;
+
+    if (options.explain) {
+        vector<string> lines;
+        best_plan->explain(lines);
+        delete best_plan;
+        delete query_names;
+        delete column_attributes;
+        ColumnNames *plan_column = new ColumnNames;
+        plan_column->push_back("plan");
+        ColumnAttributes *plan_attribute = new ColumnAttributes;
+        plan_attribute->push_back(ColumnAttribute(ColumnAttribute::TEXT));
+        ValueDicts *plan_rows = new ValueDicts;
+        for (auto const &line: lines) {
+            ValueDict *row = new ValueDict;
+            (*row)["plan"] = Value(line);
+            plan_rows->push_back(row);
+        }
+        return new QueryResult(plan_column, plan_attribute, plan_rows, "estimated costs are in blocks read");
+    }
 
-    EvalPlan *best_plan = plan->optimize();
-    
     ValueDicts *rows = best_plan->evaluate();
 
     delete best_plan;
@@ -222,7 +794,7 @@ QueryResult *SQLExec::insert(const InsertStatement *statement) {
 
         for (Identifier index_name : index_names) {
             DbIndex &index = SQLExec::indices->get_index(table_name, index_name);
-            index.insert(table_handle);
+            index.insert(table_handle, &row);  // we have the row right here: no need to read it back
             indices += index_name;
             indices += ", ";
         }
@@ -249,27 +821,41 @@ QueryResult *SQLExec::del(const DeleteStatement *statement) {
     EvalPlan *plan = new EvalPlan(table);
 
     if (expr != NULL) {
-        ValueDict *where_list = get_where_conjuction(expr);
-        plan = new EvalPlan(where_list, plan);
+        ValueRanges *ranges = new ValueRanges();
+        ValueDict *where_list;
+        try {
+            where_list = get_where_conjuction(expr, ranges);
+        } catch (SQLExecError &e) {
+            delete ranges;
+            delete plan;
+            throw;
+        }
+        if (ranges->empty()) {
+            delete ranges;
+            ranges = nullptr;
+        }
+        plan = new EvalPlan(where_list, ranges, plan);
     }
 
-    plan = plan->optimize();
+    plan = plan->optimize(*SQLExec::indices, SQLExec::statistics);
 
     // get handles
     EvalPipeline pipeline = plan->pipeline();  // pair<DbRelation *, Handles *>
     Handles *handles = pipeline.second;
 
-    // remove from indices
+    // remove from indices (reading each row just once, however many indices there are)
     string indices = "";
     if (index_names.size() != 0) {
         indices = " and index ";
 
-        for (Identifier index_name : index_names) {
-            DbIndex &index = SQLExec::indices->get_index(table_name, index_name);
-
-            for (auto const &handle: *handles)
-                index.del(handle);
+        for (auto const &handle: *handles) {
+            ValueDict *row = table.project(handle);
+            for (Identifier index_name : index_names)
+                SQLExec::indices->get_index(table_name, index_name).del(handle, row);
+            delete row;
+        }
 
+        for (Identifier index_name : index_names) {
             indices += index_name;
             indices += ", ";
         }
@@ -302,12 +888,12 @@ SQLExec::column_definition(const ColumnDefinition *col, Identifier &column_name,
 }
 
 // CREATE ...
-QueryResult *SQLExec::create(const CreateStatement *statement) {
+QueryResult *SQLExec::create(const CreateStatement *statement, const QueryOptions &options) {
     switch (statement->type) {
         case CreateStatement::kTable:
             return create_table(statement);
         case CreateStatement::kIndex:
-            return create_index(statement);
+            return create_index(statement, options);
         default:
             return new QueryResult("Only CREATE TABLE and CREATE INDEX are implemented");
     }
@@ -365,7 +951,7 @@ QueryResult *SQLExec::create_table(const CreateStatement *statement) {
     return new QueryResult("created " + table_name);
 }
 
-QueryResult *SQLExec::create_index(const CreateStatement *statement) {
+QueryResult *SQLExec::create_index(const CreateStatement *statement, const QueryOptions &options) {
     Identifier index_name = statement->indexName;
     Identifier table_name = statement->tableName;
 
@@ -377,13 +963,28 @@ QueryResult *SQLExec::create_index(const CreateStatement *statement) {
     for (auto const &col_name: *statement->indexColumns)
         if (find(table_columns.begin(), table_columns.end(), col_name) == table_columns.end())
             throw SQLExecError(string("Column '") + col_name + "' does not exist in " + table_name);
+    const ColumnNames &include_columns = options.include_columns;
+    for (auto const &col_name: include_columns) {
+        if (find(table_columns.begin(), table_columns.end(), col_name) == table_columns.end())
+            throw SQLExecError(string("Column '") + col_name + "' does not exist in " + table_name);
+        for (auto const &key_col_name: *statement->indexColumns)
+            if (col_name == key_col_name)
+                throw SQLExecError(string("Column '") + col_name + "' is already in the index key");
+    }
+    Identifier index_type = options.index_type.empty() ? statement->indexType : options.index_type;
+    transform(index_type.begin(), index_type.end(), index_type.begin(), ::toupper);
+    if (!include_columns.empty() && index_type != "BTREE")
+        throw SQLExecError("INCLUDE columns are only supported on BTREE indices");
+    bool bloom_filter = options.bloom_filter;
+    if (bloom_filter && index_type != "BTREE")
+        throw SQLExecError("Bloom filters are only supported on BTREE indices");
 
     // insert a row for every column in index into _indices
     ValueDict row;
     row["table_name"] = Value(table_name);
     row["index_name"] = Value(index_name);
-    row["index_type"] = Value(statement->indexType);
-    row["is_unique"] = Value(string(statement->indexType) == "BTREE"); // assume HASH is non-unique --
+    row["index_type"] = Value(index_type);
+    row["is_unique"] = Value(index_type == "BTREE"); // assume HASH and LSM are non-unique --
     int seq = 0;
     Handles i_handles;
     try {
@@ -392,9 +993,18 @@ QueryResult *SQLExec::create_index(const CreateStatement *statement) {
             row["column_name"] = Value(col_name);
             i_handles.push_back(SQLExec::indices->insert(&row));
         }
+        seq = 0;
+        for (auto const &col_name: include_columns) {
+            row["seq_in_index"] = Value(--seq);  // included columns are numbered -1, -2, ...
+            row["column_name"] = Value(col_name);
+            i_handles.push_back(SQLExec::indices->insert(&row));
+        }
 
+        // one scan of the table, then the index is built from the rows (bottom up, for a BTREE)
         DbIndex &index = SQLExec::indices->get_index(table_name, index_name);
-        index.create();
+        DbIndex::create_all(table, std::vector<DbIndex *>(1, &index));
+        if (bloom_filter)
+            index.create_filter();
 
     } catch (...) {
         // attempt to remove from _indices
@@ -421,7 +1031,8 @@ QueryResult *SQLExec::drop(const DropStatement *statement) {
 
 QueryResult *SQLExec::drop_table(const DropStatement *statement) {
     Identifier table_name = statement->name;
-    if (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME)
+    if (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME ||
+        table_name == Statistics::TABLE_NAME)
         throw SQLExecError("cannot drop a schema table");
 
     ValueDict where;
@@ -440,6 +1051,9 @@ QueryResult *SQLExec::drop_table(const DropStatement *statement) {
         SQLExec::indices->del(handle);  // remove all rows from _indices for each index on this table
     delete handles;
 
+    // forget its statistics
+    SQLExec::statistics->forget(table_name);
+
     // remove from _columns schema
     DbRelation &columns = SQLExec::tables->get_table(Columns::TABLE_NAME);
     handles = columns.select(&where);
@@ -536,19 +1150,20 @@ QueryResult *SQLExec::show_tables() {
     column_attributes->push_back(ColumnAttribute(ColumnAttribute::TEXT));
 
     Handles *handles = SQLExec::tables->select();
-    u_long n = handles->size() - 3;
 
     ValueDicts *rows = new ValueDicts;
     for (auto const &handle: *handles) {
         ValueDict *row = SQLExec::tables->project(handle, column_names);
         Identifier table_name = row->at("table_name").s;
-        if (table_name != Tables::TABLE_NAME && table_name != Columns::TABLE_NAME && table_name != Indices::TABLE_NAME)
+        if (table_name != Tables::TABLE_NAME && table_name != Columns::TABLE_NAME &&
+            table_name != Indices::TABLE_NAME && table_name != Statistics::TABLE_NAME)
             rows->push_back(row);
         else
             delete row;
     }
     delete handles;
-    return new QueryResult(column_names, column_attributes, rows, "successfully returned " + to_string(n) + " rows");
+    return new QueryResult(column_names, column_attributes, rows,
+                           "successfully returned " + to_string(rows->size()) + " rows");
 }
 
 QueryResult *SQLExec::show_columns(const ShowStatement *statement) {
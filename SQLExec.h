@@ -53,6 +53,24 @@ protected:
 };
 
 
+/**
+ * @class QueryOptions - the parts of a query in our SQL dialect that the Hyrise parser doesn't know,
+ * taken off the query text by SQLExec::preprocess and handed to SQLExec::execute
+ */
+class QueryOptions {
+public:
+    QueryOptions() : include_columns(), bloom_filter(false), index_type(), explain(false) {}
+
+    // whether preprocess took none of these off the query
+    bool empty() const { return include_columns.empty() && !bloom_filter && index_type.empty() && !explain; }
+
+    ColumnNames include_columns;  // INCLUDE (...) columns of a CREATE INDEX
+    bool bloom_filter;            // whether a CREATE INDEX said WITH BLOOM
+    Identifier index_type;        // index type of a CREATE INDEX the parser doesn't know (USING LSM), else empty
+    bool explain;                 // whether a SELECT said EXPLAIN (so show the plan instead of running it)
+};
+
+
 /**
  * @class SQLExec - execution engine
  */
@@ -61,21 +79,41 @@ public:
     /**
      * Execute the given SQL statement.
      * @param statement   the Hyrise AST of the SQL statement to execute
+     * @param options     the clauses preprocess took off the query before it was parsed
      * @returns           the query result (freed by caller)
      */
-    static QueryResult *execute(const hsql::SQLStatement *statement);
+    static QueryResult *execute(const hsql::SQLStatement *statement, const QueryOptions &options = QueryOptions());
+
+    /**
+     * Deal with the parts of our SQL dialect that the Hyrise parser doesn't know, before the query is parsed.
+     * Clauses it recognizes are taken out of the query and returned in options, to be handed to execute.
+     * @param query    the SQL query text, rewritten in place to what is left for the parser
+     * @param options  returned by reference: the clauses taken out of the query
+     * @returns        the query result if the whole query was handled here (freed by caller), else nullptr
+     */
+    static QueryResult *preprocess(std::string &query, QueryOptions &options);
 
 protected:
     // the one place in the system that holds the _tables table and _indices table
     static Tables *tables;
     static Indices *indices;
+    static Statistics *statistics;
+
+    // open the schema tables and _statistics, if not yet done
+    static void initialize();
+
+    static QueryResult *rebuild_bloom_filter(Identifier table_name, Identifier index_name);
+
+    static QueryResult *show_index_stats(Identifier table_name);
+
+    static QueryResult *analyze(Identifier table_name);
 
     // recursive decent into the AST
-    static QueryResult *create(const hsql::CreateStatement *statement);
+    static QueryResult *create(const hsql::CreateStatement *statement, const QueryOptions &options);
 
     static QueryResult *create_table(const hsql::CreateStatement *statement);
 
-    static QueryResult *create_index(const hsql::CreateStatement *statement);
+    static QueryResult *create_index(const hsql::CreateStatement *statement, const QueryOptions &options);
 
     static QueryResult *drop(const hsql::DropStatement *statement);
 
@@ -95,7 +133,9 @@ protected:
 
     static QueryResult *del(const hsql::DeleteStatement *statement);
 
-    static QueryResult *select(const hsql::SelectStatement *statement);
+    static QueryResult *select(const hsql::SelectStatement *statement, const QueryOptions &options);
+
+    static EvalPlan *join_plan(const hsql::SelectStatement *statement, ColumnNames &query_names);
 
     /**
      * Pull out column name and attributes from AST's column definition clause
@@ -3,6 +3,7 @@
  * @author K Lundeen
  * @see Seattle University, CPSC5300
  */
+#include <cstdlib>
 #include <cstring>
 #include "SlottedPage.h"
 
@@ -14,8 +15,10 @@ typedef uint16_t u16;
  * @param block
  * @param block_id
  * @param is_new
+ * @param owned  whether the block's memory was malloc'ed for this page (as by HeapFile::get), to be freed with it
  */
-SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new) : DbBlock(block, block_id, is_new) {
+SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new, bool owned)
+        : DbBlock(block, block_id, is_new), memory(owned ? block.get_data() : nullptr, free) {
     if (is_new) {
         this->num_records = 0;
         this->end_free = DbBlock::BLOCK_SZ - 1;
@@ -43,6 +46,31 @@ RecordID SlottedPage::add(const Dbt *data) {
     return id;
 }
 
+/**
+ * Add a new record to the block at a given position, renumbering the records from there on up by one.
+ * Only for blocks that use record ids as positions (like B-tree nodes), since it changes existing ids.
+ * @param record_id  id the new record gets (from 1 to one past the last record)
+ * @param data
+ * @return record_id
+ */
+RecordID SlottedPage::insert(RecordID record_id, const Dbt *data) {
+    if (record_id < 1 || record_id > this->num_records + 1U)
+        throw std::out_of_range("record id out of range for insert");
+    if (!has_room((u16) data->get_size()))
+        throw DbBlockNoRoomError("not enough room for new record");
+    // shift the headers of record_id..num_records up one slot
+    memmove(this->address((u16) (4 * (record_id + 1))), this->address((u16) (4 * record_id)),
+            4U * (this->num_records + 1U - record_id));
+    this->num_records++;
+    u16 size = (u16) data->get_size();
+    this->end_free -= size;
+    u16 loc = this->end_free + 1U;
+    put_header();
+    put_header(record_id, size, loc);
+    memcpy(this->address(loc), data->get_data(), size);
+    return record_id;
+}
+
 /**
  * Get a record from the block.
  * @param record_id
@@ -352,6 +380,23 @@ bool test_slotted_page() {
     if (get_dbt != nullptr)
         return assertion_failure("get of deleted record was not null");
 
+    // test insert (renumbers the records after it)
+    rec1_dbt = Dbt(rec1, sizeof(rec1));
+    slot.insert(2, &rec1_dbt);
+    get_dbt = slot.get(3);
+    expected = string(rec2, sizeof(rec2));
+    actual = string((char *) get_dbt->get_data(), get_dbt->get_size());
+    delete get_dbt;
+    if (expected != actual)
+        return assertion_failure("get 3 back after insert at 2 " + actual);
+    get_dbt = slot.get(2);
+    expected = string(rec1, sizeof(rec1));
+    actual = string((char *) get_dbt->get_data(), get_dbt->get_size());
+    delete get_dbt;
+    if (expected != actual)
+        return assertion_failure("get 2 back after insert at 2 " + actual);
+    slot.del(2);
+
     // try adding something too big
     rec2_dbt = Dbt(nullptr, DbBlock::BLOCK_SZ - 10); // too big, but only because we have a record in there
     try {
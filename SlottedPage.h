@@ -9,6 +9,7 @@
  */
 #pragma once
 
+#include <memory>
 #include "storage_engine.h"
 
 /**
@@ -28,13 +29,15 @@
  */
 class SlottedPage : public DbBlock {
 public:
-    SlottedPage(Dbt &block, BlockID block_id, bool is_new = false);
+    SlottedPage(Dbt &block, BlockID block_id, bool is_new = false, bool owned = false);
 
     // Big 5 - use the defaults
     virtual ~SlottedPage() {}
 
     virtual RecordID add(const Dbt *data);
 
+    virtual RecordID insert(RecordID record_id, const Dbt *data);
+
     virtual Dbt *get(RecordID record_id) const;
 
     virtual void put(RecordID record_id, const Dbt &data);
@@ -53,6 +56,7 @@ public:
 protected:
     uint16_t num_records;
     uint16_t end_free;
+    std::shared_ptr<void> memory;  // the block's memory, if it was malloc'ed for this page (shared by copies)
 
     void get_header(uint16_t &size, uint16_t &loc, RecordID id = 0) const;
 
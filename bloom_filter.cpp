@@ -0,0 +1,196 @@
+/**
+ * @file bloom_filter.cpp - implementation of BloomFilter
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#include <cmath>
+#include <cstring>
+#include "bloom_filter.h"
+
+BloomFilter::BloomFilter(std::string name) : file(name), bits(), bit_count(0), key_count(0), header_dirty(false),
+                                             latch(), negatives(0), false_positives(0) {
+}
+
+/**
+ * Create the filter holding the given keys. It gets BITS_PER_KEY bits for twice as many keys, so that it can take
+ * as many inserts again before its false positive rate is much above plan.
+ * @param keys  keys to put in the filter
+ */
+void BloomFilter::create(const std::vector<std::string> &keys) {
+    std::lock_guard<std::mutex> guard(this->latch);
+    u_long planned = std::max((u_long) 1000, 2 * keys.size());
+    u_long byte_count = (planned * BITS_PER_KEY + 7) / 8;
+    u_long block_count = (byte_count + BYTES_PER_BLOCK - 1) / BYTES_PER_BLOCK;
+    std::vector<unsigned char> bytes(block_count * BYTES_PER_BLOCK, 0);
+    this->bit_count = (uint32_t) (bytes.size() * 8);
+    this->key_count = 0;
+    for (auto const &key: keys) {
+        uint64_t h1, h2;
+        hash(key, h1, h2);
+        for (uint i = 0; i < HASHES; i++) {
+            uint64_t bit = (h1 + i * h2) % this->bit_count;
+            bytes[bit / 8] |= (unsigned char) (1 << (bit % 8));
+        }
+        this->key_count++;
+    }
+    allocate(bytes.size());
+    for (u_long i = 0; i < bytes.size(); i++)
+        this->bits[i].store(bytes[i], std::memory_order_relaxed);
+
+    this->file.create();  // block 1, for the header
+    for (u_long block_num = 0; block_num < block_count; block_num++) {
+        SlottedPage *block = this->file.get_new();
+        Dbt dbt(&bytes[block_num * BYTES_PER_BLOCK], BYTES_PER_BLOCK);
+        block->add(&dbt);
+        this->file.put(block);
+        delete block;
+    }
+    SlottedPage *header = this->file.get(HEADER);
+    uint32_t counts[] = {this->bit_count, this->key_count};
+    Dbt dbt(counts, sizeof(counts));
+    header->add(&dbt);
+    this->file.put(header);
+    delete header;
+    this->header_dirty = false;
+}
+
+// Remove the filter's file (if it has one).
+void BloomFilter::drop() {
+    if (open())
+        this->file.drop();
+    this->bits.clear();
+}
+
+/**
+ * Read the filter in from its file.
+ * @return  false if it has never been created
+ */
+bool BloomFilter::open() {
+    std::lock_guard<std::mutex> guard(this->latch);
+    try {
+        this->file.open();
+    } catch (DbException &e) {
+        return false;
+    }
+    SlottedPage *header = this->file.get(HEADER);
+    Dbt *dbt = header->get(1);
+    this->bit_count = ((uint32_t *) dbt->get_data())[0];
+    this->key_count = ((uint32_t *) dbt->get_data())[1];
+    this->header_dirty = false;
+    delete dbt;
+    delete header;
+    allocate(this->bit_count / 8);
+    for (u_long block_num = 0; block_num * BYTES_PER_BLOCK < this->bits.size(); block_num++) {
+        SlottedPage *block = this->file.get((BlockID) (HEADER + 1 + block_num));
+        dbt = block->get(1);
+        const unsigned char *bytes = (const unsigned char *) dbt->get_data();
+        for (u_long i = 0; i < BYTES_PER_BLOCK; i++)
+            this->bits[block_num * BYTES_PER_BLOCK + i].store(bytes[i], std::memory_order_relaxed);
+        delete dbt;
+        delete block;
+    }
+    this->negatives = 0;
+    this->false_positives = 0;
+    return true;
+}
+
+void BloomFilter::close() {
+    flush();
+    this->file.close();
+    this->bits.clear();
+}
+
+void BloomFilter::flush() {
+    std::lock_guard<std::mutex> guard(this->latch);
+    if (this->header_dirty)
+        save_header();
+}
+
+// Add a key, writing the changed bits out.
+void BloomFilter::add(const std::string &key) {
+    std::lock_guard<std::mutex> guard(this->latch);
+    uint64_t h1, h2;
+    hash(key, h1, h2);
+    std::vector<u_long> changed;
+    for (uint i = 0; i < HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % this->bit_count;
+        unsigned char mask = (unsigned char) (1 << (bit % 8));
+        if ((this->bits[bit / 8].fetch_or(mask) & mask) == 0)
+            changed.push_back(bit / 8 / BYTES_PER_BLOCK);
+    }
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    for (auto const &block_num: changed)
+        save_bits(block_num);
+    this->key_count++;
+    this->header_dirty = true;
+}
+
+// False if the key was certainly never added; true if it may have been. An add that finished before the probe
+// started (so happened before it, by whatever the caller synchronized on) is always seen.
+bool BloomFilter::may_contain(const std::string &key) const {
+    uint64_t h1, h2;
+    hash(key, h1, h2);
+    for (uint i = 0; i < HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % this->bit_count;
+        if ((this->bits[bit / 8].load(std::memory_order_relaxed) & (1 << (bit % 8))) == 0) {
+            this->negatives++;
+            return false;
+        }
+    }
+    return true;
+}
+
+// (1 - e^(-kn/m))^k for k hashes, n keys and m bits
+double BloomFilter::expected_false_positive_rate() const {
+    if (this->bit_count == 0)
+        return 0.0;
+    return std::pow(1.0 - std::exp(-(double) HASHES * this->key_count / this->bit_count), (double) HASHES);
+}
+
+double BloomFilter::observed_false_positive_rate() const {
+    u_long absent = this->negatives + this->false_positives;
+    return absent == 0 ? 0.0 : (double) this->false_positives / absent;
+}
+
+// Two 64-bit hashes of the key (FNV-1a and a remix of it); probe i uses h1 + i * h2.
+void BloomFilter::hash(const std::string &key, uint64_t &h1, uint64_t &h2) {
+    h1 = 14695981039346656037ULL;
+    for (auto const c: key) {
+        h1 ^= (unsigned char) c;
+        h1 *= 1099511628211ULL;
+    }
+    h2 = h1;
+    h2 ^= h2 >> 33;
+    h2 *= 0xff51afd7ed558ccdULL;
+    h2 ^= h2 >> 33;
+    h2 *= 0xc4ceb9fe1a85ec53ULL;
+    h2 ^= h2 >> 33;
+    h2 |= 1;  // odd, so the probes don't fall into a short cycle
+}
+
+void BloomFilter::allocate(u_long byte_count) {
+    this->bits = std::vector<std::atomic<unsigned char>>(byte_count);
+    for (auto &byte: this->bits)
+        byte.store(0, std::memory_order_relaxed);
+}
+
+void BloomFilter::save_header() {
+    SlottedPage *header = this->file.get(HEADER);
+    uint32_t counts[] = {this->bit_count, this->key_count};
+    Dbt dbt(counts, sizeof(counts));
+    header->put(1, dbt);
+    this->file.put(header);
+    delete header;
+    this->header_dirty = false;
+}
+
+void BloomFilter::save_bits(u_long block_num) {
+    unsigned char bytes[BYTES_PER_BLOCK];
+    for (u_long i = 0; i < BYTES_PER_BLOCK; i++)
+        bytes[i] = this->bits[block_num * BYTES_PER_BLOCK + i].load(std::memory_order_relaxed);
+    SlottedPage *block = this->file.get((BlockID) (HEADER + 1 + block_num));
+    Dbt dbt(bytes, BYTES_PER_BLOCK);
+    block->put(1, dbt);
+    this->file.put(block);
+    delete block;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file bloom_filter.h - BloomFilter class
+ *
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include "heap_storage.h"
+
+/**
+ * @class BloomFilter - persistent Bloom filter over encoded keys, so that looking for a key that isn't there can
+ * usually be answered without reading any index or table blocks.
+ *
+ * The bits are kept in memory while open and written through to a heap file as they change (so the file never
+ * misses a key the index has). Block 1 holds the number of bits and of keys added; the bits follow, BYTES_PER_BLOCK
+ * bytes to a block. The key count is only statistics, so it is written out on flush or close rather than on every
+ * add. Keys can't be taken out, so after deletes the filter answers "maybe" for keys that are gone; rebuilding it
+ * (create again) clears those out and sizes it for the keys there are now.
+ *
+ * Probes read the bits without taking the latch (each byte is atomic), so lookups on many threads don't queue
+ * behind each other or behind adds. Adds take the latch among themselves, for the file.
+ */
+class BloomFilter {
+public:
+    static const uint BITS_PER_KEY = 10;  // with HASHES, about a 1% false positive rate at the planned size
+    static const uint HASHES = 7;
+
+    BloomFilter(std::string name);
+
+    virtual ~BloomFilter() {}
+
+    void create(const std::vector<std::string> &keys);  // sized for these keys (and room for as many more)
+
+    void drop();
+
+    bool open();  // false if there is no such filter
+
+    void close();  // flushes first
+
+    void flush();  // write out the key count, if it has changed
+
+    void add(const std::string &key);
+
+    bool may_contain(const std::string &key) const;
+
+    // a key may_contain let through turned out not to be there
+    void false_positive() const { this->false_positives++; }
+
+    u_long get_key_count() const { return this->key_count; }
+
+    u_long get_bit_count() const { return this->bit_count; }
+
+    double expected_false_positive_rate() const;  // from the size and the number of keys added
+
+    double observed_false_positive_rate() const;  // of lookups of absent keys since the filter was opened
+
+protected:
+    static const RecordID HEADER = 1;
+    static const u_int32_t BYTES_PER_BLOCK = 4000;
+
+    HeapFile file;
+    std::vector<std::atomic<unsigned char>> bits;  // set only under latch, read by probes without it
+    uint32_t bit_count;  // fixed from create or open until close
+    std::atomic<uint32_t> key_count;
+    bool header_dirty;  // key_count has changed since the header was written
+    mutable std::mutex latch;  // guards adds, header_dirty and the file
+    mutable std::atomic<u_long> negatives;
+    mutable std::atomic<u_long> false_positives;
+
+    static void hash(const std::string &key, uint64_t &h1, uint64_t &h2);
+
+    void allocate(u_long byte_count);  // all bits clear
+
+    void save_header();
+
+    void save_bits(u_long block_num);
+};
@@ -3,195 +3,1419 @@
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Spring 2020"
  */
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
 #include "btree.h"
 
-BTreeIndex::BTreeIndex(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique) : DbIndex(relation,
+template<class Traits>
+BTreeIndexT<Traits>::BTreeIndexT(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique,
+                                 ColumnNames include_columns) : DbIndex(relation,
                                                                                                               name,
                                                                                                               key_columns,
                                                                                                               unique),
                                                                                                       closed(true),
+                                                                                                      fill_factor(DEFAULT_FILL_FACTOR),
                                                                                                       stat(nullptr),
-                                                                                                      root(nullptr),
                                                                                                       file(relation.get_table_name() +
                                                                                                            "-" + name),
-                                                                                                      key_profile() {
+                                                                                                      key_profile(BTreeNode::column_profile(relation, key_columns)),
+                                                                                                      include_columns(
+                                                                                                              include_columns),
+                                                                                                      include_profile(BTreeNode::column_profile(relation, include_columns)),
+                                                                                                      filter(nullptr),
+                                                                                                      node_cache(),
+                                                                                                      tree_latch(),
+                                                                                                      latches(),
+                                                                                                      cache_latch() {
     if (!unique)
         throw DbRelationError("BTree index must have unique key");
-    build_key_profile();
 }
 
-BTreeIndex::~BTreeIndex() {
+template<class Traits>
+BTreeIndexT<Traits>::~BTreeIndexT() {
     delete stat;
-    delete root;
+    delete filter;
+    for (auto const &entry: latches)
+        delete entry.second;
 }
 
 // Create the index.
-void BTreeIndex::create() {
-    file.create();
-    stat = new BTreeStat(file, STAT, STAT + 1, key_profile);
-    root = new BTreeLeaf(file, stat->get_root_id(), key_profile, true);
-    closed = false;
+template<class Traits>
+void BTreeIndexT<Traits>::create() {
+    create_empty();
     Handles *table_rows = relation.select();
     for (auto const &row: *table_rows)
         insert(row);
     delete table_rows;
 }
 
+/**
+ * Create the index from rows already read from the relation, bottom up (see bulk_load).
+ * @param handles  every row in the relation
+ * @param rows     the values of those rows, in the same order
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::create(const Handles *handles, const ValueDicts *rows) {
+    std::vector<std::pair<Key, u_long>> entries;  // (key, which row)
+    for (u_long i = 0; i < rows->size(); i++)
+        entries.push_back(std::make_pair(this->tkey((*rows)[i]), i));
+    std::sort(entries.begin(), entries.end());
+    for (u_long i = 1; i < entries.size(); i++)
+        if (entries[i].first == entries[i - 1].first)
+            throw DbRelationError("Duplicate keys are not allowed in unique index");
+    create_empty();
+    bulk_load(entries, handles, rows);
+}
+
+/**
+ * @class BTreeBulkFill - bytes of its block taken so far by a node being bulk loaded, counted the way SlottedPage
+ * does (4 for the block's header and for each record's): the first-pointer or next-leaf record, the prefix common to
+ * the keys, and a (key, value) pair of records per entry, or, if Traits packs the keys, one record of keys and a
+ * value record per entry.
+ */
+template<class Traits>
+class BTreeBulkFill {
+public:
+    typedef typename Traits::Key Key;
+
+    BTreeBulkFill() : count(0), front(), key_bytes(0), value_bytes(0) {}
+
+    // whether the node still comes to no more than room with another entry (after all the others); always true
+    // for the first, so every node gets at least one
+    bool fits(const Key &key, u_long value_size, u_long room) const {
+        if (this->count == 0)
+            return true;
+        u_long n = this->count + 1;
+        u_long prefix = Traits::prefix(this->front, key).size();
+        u_long stored = this->key_bytes + Traits::marshal(key, BTreeKey()).size() - n * prefix;
+        u_long headers = Traits::PACKED_SIZE != 0 ? 4 * (4 + n) : 4 * (3 + 2 * n);
+        return headers + sizeof(BlockID) + prefix + stored + this->value_bytes + value_size <= room;
+    }
+
+    void add(const Key &key, u_long value_size) {
+        if (this->count++ == 0)
+            this->front = key;
+        this->key_bytes += Traits::marshal(key, BTreeKey()).size();
+        this->value_bytes += value_size;
+    }
+
+    void clear() {
+        this->count = this->key_bytes = this->value_bytes = 0;
+    }
+
+protected:
+    u_long count;
+    Key front;
+    u_long key_bytes;  // of the keys before the prefix is taken off
+    u_long value_bytes;
+};
+
+/**
+ * Build the tree bottom up from sorted, unique entries, rather than inserting them one at a time. The leaves are
+ * filled to the fill factor left to right and each written once; then every level of interior nodes is built the
+ * same way from the boundaries between the nodes of the level below, until the level is one node: the root.
+ * No node splits, and none is read back.
+ * @param entries  (key, which row) for every row, sorted by key
+ * @param handles  every row in the relation
+ * @param rows     the values of those rows, in the same order
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::bulk_load(const std::vector<std::pair<Key, u_long>> &entries, const Handles *handles,
+                                    const ValueDicts *rows) {
+    const u_long room = (u_long) (this->fill_factor * (DbBlock::BLOCK_SZ - 1));
+    const u_long handle_size = sizeof(BlockID) + sizeof(RecordID);
+
+    // the leaves, starting with the empty root create_empty made
+    std::vector<std::pair<Key, BlockID>> level;  // (boundary, node) of each node but the first
+    BlockID first = this->stat->get_root_id();
+    std::unique_ptr<Leaf> leaf(new Leaf(file, first, key_profile, false));
+    BTreeBulkFill<Traits> fill;
+    for (u_long i = 0; i < entries.size(); i++) {
+        const Key &key = entries[i].first;
+        const ValueDict *row = (*rows)[entries[i].second];
+        BTreeKey payload = this->payload(row);
+        if (!fill.fits(key, handle_size + payload.size(), room)) {
+            Leaf *next = new Leaf(file, 0, key_profile, true);
+            leaf->set_next_leaf(next->get_id());
+            leaf->save();
+            level.push_back(std::make_pair(Traits::separator(entries[i - 1].first, key), next->get_id()));
+            leaf.reset(next);
+            fill.clear();
+        }
+        leaf->append(key, (*handles)[entries[i].second], payload);
+        fill.add(key, handle_size + payload.size());
+        if (filter != nullptr)
+            filter->add(filter_key(key));
+    }
+    leaf->save();
+
+    // the interior levels: a node's first child needs no boundary, so the one for it goes up a level instead
+    uint height = 1;
+    BTreeNodePtr root;
+    while (!level.empty()) {
+        std::vector<std::pair<Key, BlockID>> parents;
+        Interior *node = new Interior(file, 0, key_profile, true);
+        node->set_first(first);
+        first = node->get_id();
+        fill.clear();
+        for (auto const &child: level) {
+            if (!fill.fits(child.first, sizeof(BlockID), room)) {
+                node->save();
+                delete node;
+                node = new Interior(file, 0, key_profile, true);
+                node->set_first(child.second);
+                parents.push_back(std::make_pair(child.first, node->get_id()));
+                fill.clear();
+                continue;
+            }
+            node->append(child.first, child.second);
+            fill.add(child.first, sizeof(BlockID));
+        }
+        node->save();
+        height++;
+        if (parents.empty())
+            root = BTreeNodePtr(node);
+        else
+            delete node;
+        level.swap(parents);
+    }
+
+    if (root) {
+        BTreeLatchPath path;
+        path.exclusive(tree_latch);
+        this->stat->set_root_id(root->get_id());
+        this->stat->set_height(height);
+        this->stat->save();
+        set_root(root);
+    }
+}
+
+// Make the file, with the stat block and an empty leaf for the root.
+template<class Traits>
+void BTreeIndexT<Traits>::create_empty() {
+    file.create();
+    stat = new BTreeStat(file, STAT, STAT + 1, key_profile);
+    BTreeNodePtr root(new Leaf(file, stat->get_root_id(), key_profile, true));
+    root->save();  // leaves are read from the file on every visit
+    set_root(root);
+    closed = false;
+}
+
 // Drop the index.
-void BTreeIndex::drop() {
+template<class Traits>
+void BTreeIndexT<Traits>::drop() {
     file.drop();
+    node_cache.clear();
+    if (filter == nullptr)
+        filter = new BloomFilter(filter_name());
+    filter->drop();
+    delete filter;
+    filter = nullptr;
 }
 
 // Open existing index. Enables: lookup, range, insert, delete, update.
-void BTreeIndex::open() {
+template<class Traits>
+void BTreeIndexT<Traits>::open() {
     if (closed) {
         file.open();
         stat = new BTreeStat(file, STAT, key_profile);
-        if (stat->get_height() == 1)
-            root = new BTreeLeaf(file, stat->get_root_id(), key_profile, false);
-        else
-            root = new BTreeInterior(file, stat->get_root_id(), key_profile, false);
-        closed = true;
+        set_root(fetch(stat->get_root_id(), stat->get_height()));
+        filter = new BloomFilter(filter_name());
+        if (!filter->open()) {
+            delete filter;  // this index doesn't have one
+            filter = nullptr;
+        }
+        closed = false;
     }
 }
 
 // Closes the index. Disables: lookup, range, insert, delete, update.
-void BTreeIndex::close() {
+template<class Traits>
+void BTreeIndexT<Traits>::close() {
     if (!closed) {
         file.close();
         delete stat;
         stat = nullptr;
-        delete root;
-        root = nullptr;
+        node_cache.clear();
+        if (filter != nullptr) {
+            filter->close();
+            delete filter;
+            filter = nullptr;
+        }
         closed = true;
     }
 }
 
+/**
+ * Get the decoded node for a block. Interior nodes come from (and are added to) the node cache.
+ * @param block_id  which block the node lives in
+ * @param height    height of the node in the tree (1 for leaves)
+ * @return          shared pointer to the node
+ */
+template<class Traits>
+BTreeNodePtr BTreeIndexT<Traits>::fetch(BlockID block_id, uint height) const {
+    if (height == 1)
+        return BTreeNodePtr(new Leaf(const_cast<HeapFile &>(file), block_id, key_profile, false));
+    std::lock_guard<std::mutex> guard(cache_latch);
+    auto cached = node_cache.find(block_id);
+    if (cached != node_cache.end())
+        return cached->second;
+    BTreeNodePtr node(new Interior(const_cast<HeapFile &>(file), block_id, key_profile, false));
+    node_cache[block_id] = node;
+    return node;
+}
 
+// The latch for a block (made the first time anyone asks for it).
+template<class Traits>
+BTreeLatch &BTreeIndexT<Traits>::latch(BlockID block_id) const {
+    std::lock_guard<std::mutex> guard(cache_latch);
+    BTreeLatch *&latch = latches[block_id];
+    if (latch == nullptr)
+        latch = new BTreeLatch();
+    return *latch;
+}
+
+// Put a new interior root into the cache (a leaf root is read from the file like any other leaf).
+template<class Traits>
+void BTreeIndexT<Traits>::set_root(BTreeNodePtr new_root) {
+    if (dynamic_cast<Interior *>(new_root.get()) != nullptr) {
+        std::lock_guard<std::mutex> guard(cache_latch);
+        node_cache[new_root->get_id()] = new_root;
+    }
+}
 
 // Find all the rows whose columns are equal to key. Assumes key is a dictionary whose keys are the column
 // names in the index. Returns a list of row handles.
-Handles *BTreeIndex::lookup(ValueDict *key_dict) const {
+template<class Traits>
+Handles *BTreeIndexT<Traits>::lookup(ValueDict *key_dict) const {
     //this->open();
-    KeyValue *key = this->tkey(key_dict);
-    Handles* handles = this->_lookup(this->root, this->stat->get_height(), key);
-    delete key;
-    return handles;
+    return this->_lookup(this->tkey(key_dict));
 }
 
 /**
 *   Helper lookup function
-*   Recursively traverse the Btree and look up the value match the given key
-*   @param node     Current Node pointed at
-*   @param height   Current height of the BTree
+*   Traverse the Btree from the root, latch coupling with shared latches, and look up the value match the given key
 *   @param key      Target key
+*   @param payload  if given, gets the included columns stored with the match
 *   @return         Return a handle stores the Value, return an empty handle if no match key exists
 */
-Handles *BTreeIndex::_lookup(BTreeNode *node, uint height, const KeyValue *key) const {
-    if(height == 1) {
-        Handles *handles = new Handles();
-        auto *leaf = dynamic_cast<BTreeLeaf*>(node);
-        Handle handle;
-        try {
-            handle = leaf->find_eq(key);
-        } catch(...) {
-            return handles;
-        }
-        handles -> push_back(handle);
-        return handles;
-    } else {
-        auto *interior = dynamic_cast<BTreeInterior*>(node);
-        auto *child = interior->find(key, height);
-        Handles *handles = _lookup(child, height - 1, key);
-        delete child;
+template<class Traits>
+Handles *BTreeIndexT<Traits>::_lookup(const Key &key, BTreeKey *payload) const {
+    if (filter != nullptr && !filter->may_contain(filter_key(key)))
+        return new Handles();  // certainly not here: no need to go down the tree
+    BTreeLatchPath path;
+    path.shared(tree_latch);
+    BlockID block_id = this->stat->get_root_id();
+    BTreeNodePtr node;  // held while it is used, so no one else can free it from under us
+    for (uint height = this->stat->get_height(); height > 1; height--) {
+        path.shared(latch(block_id));
+        path.release_above();
+        node = fetch(block_id, height);
+        block_id = dynamic_cast<Interior *>(node.get())->find(key);
+    }
+    path.shared(latch(block_id));
+    path.release_above();
+    node = fetch(block_id, 1);
+    auto *leaf = dynamic_cast<Leaf*>(node.get());
+    Handles *handles = new Handles();
+    Handle handle;
+    try {
+        handle = leaf->find_eq(key, payload);
+    } catch(...) {
+        if (filter != nullptr)
+            filter->false_positive();
         return handles;
     }
+    handles -> push_back(handle);
+    return handles;
+}
+
+/**
+ * Look up a batch of keys in one walk of the tree: the keys are sorted, so all of them that lead to the same
+ * child are taken down together, and each node on the way is visited (and latched) once per batch.
+ * @param key_dicts  values for the key columns, one dictionary per key
+ * @return           handles of the matching rows, sorted into block order (freed by caller)
+ */
+template<class Traits>
+Handles *BTreeIndexT<Traits>::lookup_many(const ValueDicts *key_dicts) const {
+    std::vector<Key> keys;
+    for (auto const &key_dict: *key_dicts)
+        keys.push_back(this->tkey(key_dict));
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    if (filter != nullptr)
+        keys.erase(std::remove_if(keys.begin(), keys.end(), [this](const Key &key) {
+            return !this->filter->may_contain(filter_key(key));
+        }), keys.end());
+    Handles *handles = new Handles();
+    if (!keys.empty()) {
+        BTreeLatchPath path;
+        path.shared(tree_latch);
+        BlockID root_id = this->stat->get_root_id();
+        path.shared(latch(root_id));
+        _lookup_many(root_id, this->stat->get_height(), keys, 0, keys.size(), handles);
+    }
+    for (u_long missing = handles->size(); filter != nullptr && missing < keys.size(); missing++)
+        filter->false_positive();  // unique keys: each one let through is either found once or a false positive
+    std::sort(handles->begin(), handles->end());
+    return handles;
+}
+
+/**
+ * Look up the sorted keys[begin..end), all of which lead to this node.
+ * @param block_id  the node (which the caller has latched)
+ * @param height    height of the node in the tree (1 for leaves)
+ * @param keys      all the keys of the batch, sorted
+ * @param begin     first of the keys to look for under this node
+ * @param end       one past the last of them
+ * @param handles   gets the handles of the ones found
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::_lookup_many(BlockID block_id, uint height, const std::vector<Key> &keys, u_long begin,
+                                       u_long end, Handles *handles) const {
+    BTreeNodePtr node = fetch(block_id, height);
+    if (height == 1) {
+        dynamic_cast<Leaf *>(node.get())->find_many(keys, begin, end, handles);
+        return;
+    }
+    auto *interior = dynamic_cast<Interior *>(node.get());
+    while (begin < end) {
+        BlockID child_id = interior->find(keys[begin]);
+        u_long next = begin + 1;
+        while (next < end && interior->find(keys[next]) == child_id)
+            next++;
+        BTreeLatchPath path;
+        path.shared(latch(child_id));
+        _lookup_many(child_id, height - 1, keys, begin, next, handles);
+        begin = next;
+    }
+}
+
+/**
+ * Index-only lookup: answer straight from the leaf, without going to the table for the row.
+ * @param key_dict      values for the key columns
+ * @param column_names  which columns to return; all must be covered by the index (see covers)
+ * @return              the matching rows, holding just column_names (freed by caller)
+ */
+template<class Traits>
+ValueDicts *BTreeIndexT<Traits>::lookup_values(ValueDict *key_dict, const ColumnNames *column_names) const {
+    BTreeKey payload;
+    Handles *handles = this->_lookup(this->tkey(key_dict), &payload);
+    ValueDicts *rows = new ValueDicts();
+    if (!handles->empty()) {
+        KeyValue *included = BTreeNode::decode_key(payload, this->include_profile);
+        ValueDict *row = new ValueDict();
+        for (auto const &column_name: *column_names) {
+            auto include = std::find(include_columns.begin(), include_columns.end(), column_name);
+            if (include != include_columns.end())
+                (*row)[column_name] = (*included)[include - include_columns.begin()];
+            else
+                (*row)[column_name] = key_dict->at(column_name);  // key columns are what we looked up
+        }
+        delete included;
+        rows->push_back(row);
+    }
+    delete handles;
+    return rows;
+}
+
+// False if the index's Bloom filter rules out the key (true if it can't, or there is no filter).
+template<class Traits>
+bool BTreeIndexT<Traits>::may_contain(const ValueDict *key_dict) const {
+    return filter == nullptr || filter->may_contain(filter_key(this->tkey(key_dict)));
+}
+
+/**
+ * Build the index's Bloom filter from the keys in the leaves, replacing any it had (which clears out keys that
+ * have since been deleted and resizes it for how many there are now). Not to be run alongside inserts.
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::create_filter() {
+    this->open();
+    std::vector<std::string> keys;
+    for (BlockID block_id = first_leaf(); block_id != 0;) {
+        BTreeNodePtr node = fetch(block_id, 1);
+        auto *leaf = dynamic_cast<Leaf *>(node.get());
+        for (auto const &key: leaf->get_keys())
+            keys.push_back(filter_key(key));
+        block_id = leaf->get_next_leaf();
+    }
+    if (filter == nullptr)
+        filter = new BloomFilter(filter_name());
+    filter->drop();
+    delete filter;
+    filter = new BloomFilter(filter_name());
+    filter->create(keys);
 }
 
-Handles *BTreeIndex::range(ValueDict *min_key, ValueDict *max_key) const {
-    throw DbRelationError("Don't know how to do a range query on Btree index yet");
-    // FIXME
+// Whether all of column_names are in the index's key or included columns.
+template<class Traits>
+bool BTreeIndexT<Traits>::covers(const ColumnNames &column_names) const {
+    for (auto const &column_name: column_names)
+        if (std::find(key_columns.begin(), key_columns.end(), column_name) == key_columns.end() &&
+            std::find(include_columns.begin(), include_columns.end(), column_name) == include_columns.end())
+            return false;
+    return true;
+}
+
+/**
+ * Lookup a range of keys, all of it at once (see cursor).
+ * @param min_key  lowest key wanted (all the key columns), or nullptr to start at the beginning
+ * @param max_key  highest key wanted, or nullptr to go to the end
+ * @return         handles of the rows with keys from min_key to max_key, inclusive, in key order (freed by caller)
+ */
+template<class Traits>
+Handles *BTreeIndexT<Traits>::range(ValueDict *min_key, ValueDict *max_key) const {
+    Cursor cursor(*this, min_key, max_key);
+    Handles *handles = new Handles(), leaf;
+    while (cursor.next(leaf))
+        handles->insert(handles->end(), leaf.begin(), leaf.end());
+    return handles;
+}
+
+/**
+ * Lookup a range of keys a leaf at a time: go down to the leaf where min_key belongs (or the first leaf), then walk
+ * along the leaves, as far as the reader wants to go, until a key is past max_key.
+ * @param min_key  lowest key wanted (all the key columns), or nullptr to start at the beginning
+ * @param max_key  highest key wanted, or nullptr to go to the end
+ * @return         a cursor over the handles of the rows with keys from min_key to max_key, inclusive, in key order
+ *                 (freed by caller)
+ */
+template<class Traits>
+IndexCursor *BTreeIndexT<Traits>::cursor(ValueDict *min_key, ValueDict *max_key) const {
+    return new Cursor(*this, min_key, max_key);
+}
+
+template<class Traits>
+BTreeIndexT<Traits>::Cursor::Cursor(const BTreeIndexT &index, ValueDict *min_key, ValueDict *max_key) :
+        IndexCursor(), index(index), min(), max(), has_min(min_key != nullptr), has_max(max_key != nullptr), last(),
+        started(false), done(false), block_id(0), splits(0) {
+    const_cast<BTreeIndexT &>(index).open();
+    if (min_key != nullptr)
+        this->min = index.tkey(min_key);
+    if (max_key != nullptr)
+        this->max = index.tkey(max_key);
+}
+
+/**
+ * Read the next leaf with any keys in range. The tree latch is held (shared) while the leaf is found and read, so
+ * no node splits meanwhile, and the leaf is latched (shared) while it is read.
+ * @param handles  gets the handles of the leaf's keys that are in range (and after the last key given)
+ * @return         false once the range is used up
+ */
+template<class Traits>
+bool BTreeIndexT<Traits>::Cursor::next(Handles &handles) {
+    handles.clear();
+    while (handles.empty() && !this->done) {
+        BTreeLatchPath path;
+        path.shared(this->index.tree_latch);
+        if (this->block_id == 0 || this->index.stat->get_splits() != this->splits) {
+            const Key *from = this->started ? &this->last : this->has_min ? &this->min : nullptr;
+            this->block_id = this->index.stat->get_root_id();
+            for (uint height = this->index.stat->get_height(); height > 1; height--) {
+                BTreeNodePtr node = this->index.fetch(this->block_id, height);
+                auto *interior = dynamic_cast<Interior *>(node.get());
+                this->block_id = from == nullptr ? interior->get_first() : interior->find(*from);
+            }
+            this->splits = this->index.stat->get_splits();
+        }
+        path.shared(this->index.latch(this->block_id));
+        BTreeNodePtr node = this->index.fetch(this->block_id, 1);
+        auto *leaf = dynamic_cast<Leaf *>(node.get());
+        const std::vector<Key> &keys = leaf->get_keys();
+        u_long given = keys.size();  // the last key given from this leaf, if any
+        for (u_long i = 0; i < keys.size() && !this->done; i++) {
+            if (this->started ? !(this->last < keys[i]) : this->has_min && keys[i] < this->min)
+                continue;
+            if (this->has_max && this->max < keys[i]) {
+                this->done = true;
+            } else {
+                handles.push_back(leaf->get_handles()[i]);
+                given = i;
+            }
+        }
+        if (given < keys.size()) {
+            this->last = keys[given];
+            this->started = true;
+        }
+        this->block_id = leaf->get_next_leaf();
+        this->done = this->done || this->block_id == 0;
+    }
+    return !handles.empty();
 }
 
 /**
  * Insert a row with the given handle. Row must exist in relation already.
  * @param handle the given handle of the row to insert
  */ 
-void BTreeIndex::insert(Handle handle) {
+template<class Traits>
+void BTreeIndexT<Traits>::insert(Handle handle) {
 
     this->open();
     ValueDict *projection = this->relation.project(handle); // map<Identifier, Value>
-    KeyValue *tkey = this->tkey(projection);
-    Insertion insertion = this->_insert(this->root, this->stat->get_height(), tkey, handle); // pair<BlockID, KeyValue>
+    this->insert(handle, projection);
+    delete projection;
+}
+
+/**
+ * Insert a row with the given handle and values (so the row needn't be read back from the relation).
+ * @param handle the given handle of the row to insert
+ * @param row the row's values
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::insert(Handle handle, const ValueDict *row) {
+    this->open();
+    this->insert_entry(this->tkey(row), handle, this->payload(row));
+}
+
+// Insert the entry for a row, given its key and payload.
+template<class Traits>
+void BTreeIndexT<Traits>::insert_entry(const Key &tkey, Handle handle, const BTreeKey &payload) {
+    if (this->insert_in_leaf(tkey, handle, payload)) {
+        if (filter != nullptr)
+            filter->add(filter_key(tkey));
+        return;
+    }
+
+    // the leaf is full: go again, this time holding the whole path exclusively in case the splits reach the root
+    BTreeLatchPath path;
+    path.exclusive(tree_latch);
+    BlockID root_id = this->stat->get_root_id();
+    u_long splits = this->stat->get_splits();
+    path.exclusive(latch(root_id));
+    BTreeNodePtr root = fetch(root_id, this->stat->get_height());
+    Insertion insertion = this->_insert(root.get(), this->stat->get_height(), true, tkey, handle, payload,
+                                        path); // pair<BlockID, KeyValue>
 
-    if (!BTreeNode::insertion_is_none(insertion)) {
-        BTreeInterior *new_root = new BTreeInterior(file, 0, this->key_profile, true);
-        new_root->set_first(this->root->get_id());
-        new_root->insert(&insertion.second, insertion.first);
+    if (!Interior::insertion_is_none(insertion)) {
+        Interior *new_root = new Interior(file, 0, this->key_profile, true);
+        new_root->set_first(root_id);
+        new_root->insert(insertion.second, insertion.first);
         new_root->save();
         this->stat->set_root_id(new_root->get_id());
         this->stat->set_height(this->stat->get_height() + 1);
         this->stat->save();
-        delete this->root;
-        this->root = new_root;
-        std::cout << "new root: " << *new_root << std::endl;
+        set_root(BTreeNodePtr(new_root));
     }
-    delete tkey;
-    delete projection;
+    if (this->stat->get_splits() != splits)
+        this->stat->save();
+    if (filter != nullptr)
+        filter->add(filter_key(tkey));
+}
+
+/**
+ * Optimistic insert: go down with shared latches and take only the leaf exclusively.
+ * @return false (having changed nothing) if the leaf would have to split or be rewritten
+ */
+template<class Traits>
+bool BTreeIndexT<Traits>::insert_in_leaf(const Key &key, Handle handle, const BTreeKey &payload) {
+    BTreeLatchPath path;
+    std::unique_ptr<Leaf> leaf(latch_leaf(key, path));
+    if (!leaf->has_room(key, payload))
+        return false;
+    leaf->insert(key, handle, payload);
+    leaf->flush();
+    return true;
+}
+
+/**
+ * Go down to the leaf where key belongs, with shared latches on the way, and latch it exclusively.
+ * @param key   the key
+ * @param path  holds the leaf's latch on return
+ * @return      the leaf (freed by caller)
+ */
+template<class Traits>
+typename BTreeIndexT<Traits>::Leaf *BTreeIndexT<Traits>::latch_leaf(const Key &key, BTreeLatchPath &path) {
+    path.shared(tree_latch);
+    BlockID block_id = this->stat->get_root_id();
+    for (uint height = this->stat->get_height(); height > 1; height--) {
+        path.shared(latch(block_id));
+        path.release_above();
+        BTreeNodePtr node = fetch(block_id, height);
+        block_id = dynamic_cast<Interior *>(node.get())->find(key);
+    }
+    path.exclusive(latch(block_id));
+    path.release_above();
+    return new Leaf(file, block_id, key_profile, false);
 }
 
 /**
  * Recursive insert. If a split happens at this level, return the (new node, boundary) of the split.
  * @param node the given node 
  * @param height the given height
+ * @param rightmost whether node is the last one at its level (where ascending keys pile up)
  * @param key the given keyvalue
  * @param handle the given handle
+ * @param payload the encoded included columns of the row
+ * @param path the latches held so far; the child's is added to them
  * @return insertion result
  */ 
-Insertion BTreeIndex::_insert(BTreeNode *node, uint height, const KeyValue *key, Handle handle) {
-
+template<class Traits>
+typename BTreeIndexT<Traits>::Insertion BTreeIndexT<Traits>::_insert(BTreeNode *node, uint height, bool rightmost,
+                                                                     const Key &key, Handle handle,
+                                                                     const BTreeKey &payload, BTreeLatchPath &path) {
+    double right_fill = rightmost ? this->fill_factor : 0.5;
     if (height == 1) {
-        auto *leaf = dynamic_cast<BTreeLeaf *>(node); // BTreeLeaf *leaf = (BTreeLeaf *) node;
-        return leaf->insert(key, handle);
+        auto *leaf = dynamic_cast<Leaf *>(node); // BTreeLeaf *leaf = (BTreeLeaf *) node;
+        Insertion insertion = leaf->insert(key, handle, payload, right_fill);
+        leaf->flush();
+        if (!Interior::insertion_is_none(insertion))
+            this->stat->add_splits(1);
+        return insertion;
 
     } else {
-        auto *interior = dynamic_cast<BTreeInterior *>(node); // BTreeInterior *interior = (BTreeInterior *) node
-        auto *child = interior->find(key, height);
-        Insertion insertion = _insert(child, height - 1, key, handle);
-        delete child;
-        if (!BTreeNode::insertion_is_none(insertion))
-            insertion = interior->insert(&insertion.second, insertion.first);
+        auto *interior = dynamic_cast<Interior *>(node); // BTreeInterior *interior = (BTreeInterior *) node
+        BlockID child_id = interior->find(key);
+        path.exclusive(latch(child_id));
+        BTreeNodePtr child = fetch(child_id, height - 1);
+        Insertion insertion = _insert(child.get(), height - 1, rightmost && child_id == interior->get_last(), key,
+                                      handle, payload, path);
+        if (!Interior::insertion_is_none(insertion)) {
+            insertion = interior->insert(insertion.second, insertion.first, right_fill);
+            if (!Interior::insertion_is_none(insertion))
+                this->stat->add_splits(1);
+        }
         return insertion;
     }
 }
 
-void BTreeIndex::del(Handle handle) {
-    throw DbRelationError("Don't know how to delete from a BTree index yet");
-    // FIXME
+template<class Traits>
+void BTreeIndexT<Traits>::set_fill_factor(double fill_factor) {
+    if (fill_factor < 0.5 || fill_factor > 1.0)
+        throw DbRelationError("BTree fill factor must be between 0.5 and 1.0");
+    this->fill_factor = fill_factor;
+}
+
+// The leftmost leaf, where a walk along the leaves starts.
+template<class Traits>
+BlockID BTreeIndexT<Traits>::first_leaf() const {
+    BlockID block_id = this->stat->get_root_id();
+    for (uint height = this->stat->get_height(); height > 1; height--) {
+        BTreeNodePtr node = fetch(block_id, height);
+        block_id = dynamic_cast<Interior *>(node.get())->get_first();
+    }
+    return block_id;
+}
+
+// Walk the leaves from left to right, counting them and averaging how much of each block is in use.
+template<class Traits>
+double BTreeIndexT<Traits>::get_leaf_utilization(uint &leaf_count) const {
+    BlockID block_id = first_leaf();
+    double used = 0.0;
+    leaf_count = 0;
+    while (block_id != 0) {
+        BTreeNodePtr leaf = fetch(block_id, 1);
+        used += (double) (DbBlock::BLOCK_SZ - leaf->get_unused_bytes()) / DbBlock::BLOCK_SZ;
+        leaf_count++;
+        block_id = dynamic_cast<Leaf *>(leaf.get())->get_next_leaf();
+    }
+    return leaf_count == 0 ? 0.0 : used / leaf_count;
+}
+
+// The root id and height change together, under the tree latch.
+template<class Traits>
+uint BTreeIndexT<Traits>::get_height() const {
+    const_cast<BTreeIndexT *>(this)->open();
+    BTreeLatchPath path;
+    path.shared(tree_latch);
+    return this->stat->get_height();
+}
+
+/**
+ * Walk the tree a level at a time, counting nodes and keys and seeing how full the leaves are. The tree latch is
+ * held (shared) throughout, so no node splits meanwhile, though inserts into leaves with room go on.
+ * @return  the tree's statistics
+ */
+template<class Traits>
+IndexStats BTreeIndexT<Traits>::get_stats() const {
+    const_cast<BTreeIndexT *>(this)->open();
+    IndexStats stats;
+    BTreeLatchPath path;
+    path.shared(tree_latch);
+    stats.height = this->stat->get_height();
+    stats.splits = this->stat->get_splits();
+    BlockPointers level(1, this->stat->get_root_id());
+    for (uint height = stats.height; height > 1; height--) {
+        BlockPointers children;
+        for (auto const &block_id: level) {
+            BTreeNodePtr node = fetch(block_id, height);
+            Interior *interior = dynamic_cast<Interior *>(node.get());
+            children.push_back(interior->get_first());
+            children.insert(children.end(), interior->get_pointers().begin(), interior->get_pointers().end());
+        }
+        stats.interior_pages += level.size();
+        level.swap(children);
+    }
+    double used = 0.0;
+    for (auto const &block_id: level) {
+        Leaf leaf(const_cast<HeapFile &>(file), block_id, key_profile, false);
+        used += (double) (DbBlock::BLOCK_SZ - leaf.get_unused_bytes()) / DbBlock::BLOCK_SZ;
+        stats.key_count += leaf.get_keys().size();
+    }
+    stats.leaf_pages = level.size();
+    stats.fill = used / stats.leaf_pages;
+    if (filter != nullptr) {
+        stats.has_filter = true;
+        stats.filter_false_positive_rate = filter->observed_false_positive_rate();
+        stats.filter_expected_false_positive_rate = filter->expected_false_positive_rate();
+    }
+    return stats;
+}
+
+/**
+ * Remove the entry for a row. Row must still be in the relation.
+ * @param handle the handle of the row to remove
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::del(Handle handle) {
+    this->open();
+    ValueDict *projection = this->relation.project(handle);
+    this->del(handle, projection);
+    delete projection;
+}
+
+/**
+ * Remove the entry for a row, given its values. Only the leaf changes (and is latched exclusively): leaves are
+ * not merged or rebalanced when they empty out.
+ * @param handle the handle of the row to remove
+ * @param row the row's values
+ */
+template<class Traits>
+void BTreeIndexT<Traits>::del(Handle handle, const ValueDict *row) {
+    this->open();
+    Key key = this->tkey(row);
+    BTreeLatchPath path;
+    std::unique_ptr<Leaf> leaf(latch_leaf(key, path));
+    if (!leaf->remove(key, handle))
+        throw DbRelationError("row is not in index " + name);
 }
 
-KeyValue *BTreeIndex::tkey(const ValueDict *key) const {
-    KeyValue *key_value = new KeyValue();
-    for (auto const &column_name: key_columns)
-        key_value->push_back(key->find(column_name)->second);
-    return key_value;
+template<class Traits>
+typename BTreeIndexT<Traits>::Key BTreeIndexT<Traits>::tkey(const ValueDict *key) const {
+    return Traits::tkey(key, key_columns, key_profile);
 }
 
-// Figure out the data types of each key component and encode them in key_profile, a list of int/str classes.
-void BTreeIndex::build_key_profile() {
-    std::map<const Identifier, ColumnAttribute::DataType> types_by_colname;
-    const ColumnAttributes column_attributes = relation.get_column_attributes();
+// Encode the row's included column values (in order) for storing alongside its handle in a leaf.
+template<class Traits>
+BTreeKey BTreeIndexT<Traits>::payload(const ValueDict *row) const {
+    BTreeKey encoded;
     uint col_num = 0;
-    for (auto const &column_name: relation.get_column_names()) {
-        ColumnAttribute ca = column_attributes[col_num++];
-        types_by_colname[column_name] = ca.get_data_type();
+    for (auto const &column_name: include_columns)
+        BTreeNode::encode_value(encoded, row->at(column_name), include_profile[col_num++]);
+    return encoded;
+}
+
+// the two kinds of BTree index we build
+template class BTreeIndexT<BTreeBytesKey>;
+template class BTreeIndexT<BTreeIntKey>;
+
+// Check that encoded keys sort bytewise the same way their values do.
+bool test_btree_key_encoding() {
+    KeyProfile profile;
+    profile.push_back(ColumnAttribute::INT);
+    profile.push_back(ColumnAttribute::TEXT);
+    std::vector<KeyValue> ordered;
+    int ints[] = {INT32_MIN, -70000, -1, 0, 1, 255, 256, 70000, INT32_MAX};
+    std::string texts[] = {"", std::string("\0", 1), std::string("\0a", 2), "a", std::string("a\0", 2), "ab", "b"};
+    for (int n: ints)
+        for (auto const &text: texts)
+            ordered.push_back(KeyValue{Value(n), Value(text)});
+    for (uint i = 1; i < ordered.size(); i++) {
+        BTreeKey lo = BTreeNode::encode_key(&ordered[i - 1], profile);
+        BTreeKey hi = BTreeNode::encode_key(&ordered[i], profile);
+        if (!(lo < hi))
+            return false;
+        KeyValue *decoded = BTreeNode::decode_key(hi, profile);
+        bool same = *decoded == ordered[i];
+        delete decoded;
+        if (!same)
+            return false;
+    }
+    return true;
+}
+
+// Composite (tenant, name) TEXT keys, which share long prefixes within a node.
+bool test_btree_composite() {
+    ColumnNames column_names;
+    column_names.push_back("tenant");
+    column_names.push_back("name");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable table("__test_btree_composite", column_names, column_attributes);
+    table.create();
+    const int tenants = 20, names = 1000;
+    char buffer[32];
+    for (int t = 0; t < tenants; t++)
+        for (int n = 0; n < names; n++) {
+            ValueDict row;
+            snprintf(buffer, sizeof(buffer), "tenant-%06d", t);
+            row["tenant"] = Value(std::string(buffer));
+            snprintf(buffer, sizeof(buffer), "customer-name-%05d", n);
+            row["name"] = Value(std::string(buffer));
+            table.insert(&row);
+        }
+    BTreeIndex index(table, "fooindex", column_names, true);
+    index.create();
+    uint entries = tenants * names;
+    uint blocks = index.get_block_count();
+    std::cout << "composite text keys: " << entries << " entries in " << blocks << " blocks, height "
+              << index.get_height() << ", " << (double) entries / (blocks - 1) << " entries/block" << std::endl;
+
+    bool ok = true;
+    ValueDict lookup;
+    for (int t = 0; t < tenants && ok; t += 7)
+        for (int n = 0; n < names && ok; n += 13) {
+            snprintf(buffer, sizeof(buffer), "tenant-%06d", t);
+            lookup["tenant"] = Value(std::string(buffer));
+            snprintf(buffer, sizeof(buffer), "customer-name-%05d", n);
+            lookup["name"] = Value(std::string(buffer));
+            Handles *handles = index.lookup(&lookup);
+            ValueDict *result = handles->size() == 1 ? table.project(handles->back()) : nullptr;
+            ok = result != nullptr && *result == lookup;
+            delete result;
+            delete handles;
+        }
+    if (!ok)
+        std::cout << "composite lookup failed" << std::endl;
+    index.drop();
+    table.drop();
+    return ok;
+}
+
+// Build and probe the same single-INT index as a BTreeIndex and as a BTreeIntIndex and compare their speed
+// (and size, in blocks).
+template<class Index>
+bool time_btree_int_key(HeapTable &table, const ColumnNames &column_names, int rows, const char *kind, u_long &blocks) {
+    Index index(table, kind, column_names, true);
+    auto start = std::chrono::steady_clock::now();
+    index.create();
+    auto create_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    ValueDict lookup;
+    bool ok = true;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rows && ok; i++) {
+        lookup["a"] = Value((i * 7919) % rows - rows / 2);
+        Handles *handles = index.lookup(&lookup);
+        ok = handles->size() == 1;
+        delete handles;
     }
-    for (auto const &column_name: key_columns)
-        key_profile.push_back(types_by_colname[column_name]);
+    auto lookup_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    std::cout << kind << ": create " << (double) create_usecs / rows << " us/row, lookup "
+              << (double) lookup_usecs / rows << " us/key, " << index.get_block_count() << " blocks, height "
+              << index.get_height() << std::endl;
+    if (!ok)
+        std::cout << kind << " lookup failed" << std::endl;
+    blocks = index.get_block_count();
+    index.drop();
+    return ok;
+}
+
+bool test_btree_int_key() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    HeapTable table("__test_btree_int", column_names, column_attributes);
+    table.create();
+    const int rows = 50 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["a"] = Value((i * 7919) % rows - rows / 2);  // every key once, in scattered order, half negative
+        table.insert(&row);
+    }
+    u_long generic_blocks, int_blocks;
+    bool ok = time_btree_int_key<BTreeIndex>(table, column_names, rows, "generic", generic_blocks) &&
+              time_btree_int_key<BTreeIntIndex>(table, column_names, rows, "int", int_blocks);
+
+    // with its keys packed, the int tree fans out at least as far as the generic one
+    if (ok && int_blocks > generic_blocks) {
+        std::cout << "int index takes more blocks than generic" << std::endl;
+        ok = false;
+    }
+    table.drop();
+    return ok;
+}
+
+// Load ascending keys (as from a generated id column) at a few fill factors and report how full the leaves end up.
+bool test_btree_sequential() {
+    ColumnNames column_names;
+    column_names.push_back("id");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    HeapTable table("__test_btree_seq", column_names, column_attributes);
+    table.create();
+    const int rows = 50 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["id"] = Value(i);
+        table.insert(&row);
+    }
+    bool ok = true;
+    double fill_factors[] = {0.5, BTreeIntIndex::DEFAULT_FILL_FACTOR, 1.0};
+    for (double fill_factor: fill_factors) {
+        BTreeIntIndex index(table, "seqindex", column_names, true);
+        index.set_fill_factor(fill_factor);
+        index.create();
+        uint leaves;
+        double utilization = index.get_leaf_utilization(leaves);
+        IndexStats stats = index.get_stats();
+        std::cout << "sequential keys, fill factor " << fill_factor << ": " << leaves << " leaves ("
+                  << (int) (utilization * 100) << "% full), " << index.get_block_count() << " blocks, height "
+                  << index.get_height() << ", " << stats.splits << " splits" << std::endl;
+
+        // every node but the first leaf came from a split or (for each level added) a new root; splits persist
+        ok = ok && stats.key_count == (u_long) rows && stats.leaf_pages == leaves && stats.height == index.get_height() &&
+             stats.leaf_pages + stats.interior_pages == stats.splits + stats.height && std::abs(stats.fill - utilization) < 1e-9;
+        index.close();
+        index.open();
+        ok = ok && index.get_stats().splits == stats.splits;
+        if (!ok)
+            std::cout << "sequential index stats wrong" << std::endl;
+        ValueDict lookup;
+        for (int i = 0; i < rows && ok; i += 97) {
+            lookup["id"] = Value(i);
+            Handles *handles = index.lookup(&lookup);
+            ok = handles->size() == 1;
+            delete handles;
+        }
+        index.drop();
+        if (!ok)
+            std::cout << "sequential lookup failed" << std::endl;
+    }
+    table.drop();
+    return ok;
+}
+
+// An index with INCLUDE columns answers lookups of them without going to the table.
+bool test_btree_covering() {
+    ColumnNames column_names;
+    column_names.push_back("id");
+    column_names.push_back("name");
+    column_names.push_back("score");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    HeapTable table("__test_btree_cover", column_names, column_attributes);
+    table.create();
+    const int rows = 10 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["id"] = Value(i);
+        row["name"] = Value("name-" + std::to_string(i * 31 % rows));
+        row["score"] = Value(-i);
+        table.insert(&row);
+    }
+    ColumnNames key_columns(1, "id"), include_columns;
+    include_columns.push_back("name");
+    include_columns.push_back("score");
+    BTreeIntIndex index(table, "coverindex", key_columns, true, include_columns);
+    index.create();
+    bool ok = index.covers(column_names) && !index.covers(ColumnNames(1, "other"));
+
+    // same answers either way
+    ValueDict lookup;
+    long project_usecs = 0, covered_usecs = 0;
+    for (int i = 0; i < rows && ok; i += 3) {
+        lookup["id"] = Value(i);
+        auto start = std::chrono::steady_clock::now();
+        Handles *handles = index.lookup(&lookup);
+        ValueDict *expected = table.project(handles->back());
+        auto middle = std::chrono::steady_clock::now();
+        ValueDicts *covered = index.lookup_values(&lookup, &column_names);
+        auto end = std::chrono::steady_clock::now();
+        project_usecs += std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count();
+        covered_usecs += std::chrono::duration_cast<std::chrono::microseconds>(end - middle).count();
+        ok = covered->size() == 1 && *covered->back() == *expected;
+        delete handles;
+        delete expected;
+        for (auto row: *covered)
+            delete row;
+        delete covered;
+    }
+    lookup["id"] = Value(rows);
+    ValueDicts *covered = index.lookup_values(&lookup, &column_names);
+    ok = ok && covered->empty();
+    delete covered;
+    std::cout << "covering index: lookup + project " << project_usecs * 3.0 / rows << " us, index-only "
+              << covered_usecs * 3.0 / rows << " us" << std::endl;
+    if (!ok)
+        std::cout << "covering lookup failed" << std::endl;
+    index.drop();
+    table.drop();
+    return ok;
+}
+
+// Probe an index with a batch of keys (some repeated, some missing) both ways: lookup_many and one lookup each.
+template<class Index>
+bool time_btree_lookup_many(HeapTable &table, const ColumnNames &column_names, int rows, const char *kind) {
+    Index index(table, kind, column_names, true);
+    index.create();
+    ValueDicts probes;
+    for (int i = 0; i < rows / 4; i++) {
+        ValueDict *probe = new ValueDict();
+        (*probe)["a"] = Value((i * 7919) % (rows + rows / 10));  // about 1 in 11 is not in the table
+        probes.push_back(probe);
+    }
+    auto start = std::chrono::steady_clock::now();
+    Handles expected;
+    for (auto const &probe: probes) {
+        Handles *handles = index.lookup(probe);
+        expected.insert(expected.end(), handles->begin(), handles->end());
+        delete handles;
+    }
+    auto single_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    std::sort(expected.begin(), expected.end());
+    expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+    start = std::chrono::steady_clock::now();
+    Handles *handles = index.lookup_many(&probes);
+    auto batch_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    bool ok = *handles == expected;
+    std::cout << kind << " lookup_many of " << probes.size() << " keys: " << batch_usecs << " us (one at a time "
+              << single_usecs << " us), " << handles->size() << " found" << std::endl;
+    if (!ok)
+        std::cout << kind << " lookup_many failed" << std::endl;
+    delete handles;
+    for (auto probe: probes)
+        delete probe;
+    ValueDicts none;
+    handles = index.lookup_many(&none);
+    ok = ok && handles->empty();
+    delete handles;
+    index.drop();
+    return ok;
+}
+
+bool test_btree_lookup_many() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    HeapTable table("__test_btree_many", column_names, column_attributes);
+    table.create();
+    const int rows = 50 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["a"] = Value((i * 7919) % rows);
+        table.insert(&row);
+    }
+    bool ok = time_btree_lookup_many<BTreeIndex>(table, column_names, rows, "generic") &&
+              time_btree_lookup_many<BTreeIntIndex>(table, column_names, rows, "int");
+    table.drop();
+    return ok;
+}
+
+// Build three indices on a table one after another (a scan each), then all at once with DbIndex::create_all
+// (which builds them bottom up).
+bool test_btree_create_all() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    column_names.push_back("b");
+    column_names.push_back("c");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    HeapTable table("__test_btree_all", column_names, column_attributes);
+    table.create();
+    const int rows = 30 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["a"] = Value((i * 7919) % rows);
+        row["b"] = Value("b-" + std::to_string(i * 31 % rows));
+        row["c"] = Value(i % 100);
+        table.insert(&row);
+    }
+    ColumnNames c_a;
+    c_a.push_back("c");
+    c_a.push_back("a");
+    bool ok = true;
+    long usecs[2];
+    for (int all = 0; all < 2 && ok; all++) {
+        BTreeIntIndex a_index(table, all ? "all_a" : "one_a", ColumnNames(1, "a"), true);
+        BTreeIndex b_index(table, all ? "all_b" : "one_b", ColumnNames(1, "b"), true);
+        BTreeIndex c_a_index(table, all ? "all_ca" : "one_ca", c_a, true);
+        std::vector<DbIndex *> indices;
+        indices.push_back(&a_index);
+        indices.push_back(&b_index);
+        indices.push_back(&c_a_index);
+        auto start = std::chrono::steady_clock::now();
+        if (all)
+            DbIndex::create_all(table, indices);
+        else
+            for (auto index: indices)
+                index->create();
+        usecs[all] = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        ValueDict lookup;
+        for (int i = 0; i < rows && ok; i += 101) {
+            lookup["a"] = Value((i * 7919) % rows);
+            lookup["b"] = Value("b-" + std::to_string(i * 31 % rows));
+            lookup["c"] = Value(i % 100);
+            Handles *by_a = a_index.lookup(&lookup);
+            Handles *by_b = b_index.lookup(&lookup);
+            Handles *by_c_a = c_a_index.lookup(&lookup);
+            ok = by_a->size() == 1 && *by_a == *by_b && *by_a == *by_c_a;
+            delete by_a;
+            delete by_b;
+            delete by_c_a;
+        }
+        uint leaves;
+        double utilization = a_index.get_leaf_utilization(leaves);
+        std::cout << (all ? "create_all" : "one at a time") << ": " << usecs[all] / 1000 << " ms, a index leaves "
+                  << (int) (utilization * 100) << "% full" << std::endl;
+        if (!ok)
+            std::cout << "create_all lookup failed" << std::endl;
+
+        // built bottom up: no splits, and the leaves packed to the fill factor
+        if (all && ok) {
+            ok = utilization > BTreeIntIndex::DEFAULT_FILL_FACTOR - 0.05 &&
+                 utilization <= BTreeIntIndex::DEFAULT_FILL_FACTOR + 0.01;
+            for (auto index: indices) {
+                IndexStats stats = index->get_stats();
+                ok = ok && stats.splits == 0 && stats.key_count == (u_long) rows;
+            }
+            if (!ok)
+                std::cout << "create_all bulk load not packed" << std::endl;
+        }
+        for (auto index: indices)
+            index->drop();
+    }
+
+    // half-full nodes with the b column in the leaves as well: enough of them for more than one interior level
+    BTreeIndex cover_index(table, "all_cover", ColumnNames(1, "a"), true, ColumnNames(1, "b"));
+    cover_index.set_fill_factor(0.5);
+    DbIndex::create_all(table, std::vector<DbIndex *>(1, &cover_index));
+    uint leaves;
+    double utilization = cover_index.get_leaf_utilization(leaves);
+    bool cover_ok = cover_index.get_height() >= 3 && utilization > 0.45 && utilization <= 0.51;
+    Handles *handles = cover_index.range(nullptr, nullptr);
+    cover_ok = cover_ok && handles->size() == (u_long) rows;
+    delete handles;
+    ColumnNames a_b(1, "a");
+    a_b.push_back("b");
+    for (int i = 0; i < rows && cover_ok; i += 101) {
+        ValueDict lookup;
+        lookup["a"] = Value((i * 7919) % rows);
+        ValueDicts *found = cover_index.lookup_values(&lookup, &a_b);
+        cover_ok = found->size() == 1 && found->at(0)->at("b") == Value("b-" + std::to_string(i * 31 % rows));
+        for (auto row: *found)
+            delete row;
+        delete found;
+    }
+    cover_index.drop();
+    if (!cover_ok) {
+        std::cout << "create_all covering bulk load failed" << std::endl;
+        ok = false;
+    }
+
+    // a unique index on a column with duplicates fails
+    BTreeIntIndex c_index(table, "all_c", ColumnNames(1, "c"), true);
+    try {
+        DbIndex::create_all(table, std::vector<DbIndex *>(1, &c_index));
+        std::cout << "create_all allowed duplicates in a unique index" << std::endl;
+        ok = false;
+    } catch (DbRelationError &e) {
+        // expected
+    }
+    c_index.drop();
+    table.drop();
+    return ok;
+}
+
+// Lookups of keys that aren't there, with and without a Bloom filter; the filter has to survive inserts and reopening.
+bool test_btree_bloom_filter() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    HeapTable table("__test_btree_bloom", column_names, column_attributes);
+    table.create();
+    const int rows = 20 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["a"] = Value(2 * i);  // only even keys
+        table.insert(&row);
+    }
+    BTreeIntIndex index(table, "bloomindex", column_names, true);
+    index.create();
+    bool ok = !index.has_filter();
+    long usecs[2];
+    for (int filtered = 0; filtered < 2 && ok; filtered++) {
+        if (filtered)
+            index.create_filter();
+        ValueDict lookup;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rows && ok; i++) {
+            lookup["a"] = Value(2 * i + 1);
+            Handles *handles = index.lookup(&lookup);
+            ok = handles->empty();
+            delete handles;
+        }
+        usecs[filtered] = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+    ok = ok && index.has_filter();
+    if (ok)
+        std::cout << "absent key lookups: " << (double) usecs[0] / rows << " us without Bloom filter, "
+                  << (double) usecs[1] / rows << " us with (false positive rate "
+                  << index.get_filter()->observed_false_positive_rate() * 100 << "%, expected "
+                  << index.get_filter()->expected_false_positive_rate() * 100 << "%)" << std::endl;
+
+    // no false negatives, for the keys it was built with and those inserted since, also after reopening (which
+    // also has the key count, written out only on close)
+    u_long key_count = ok ? index.get_filter()->get_key_count() : 0;
+    ValueDict row;
+    row["a"] = Value(2 * rows + 1);
+    index.insert(table.insert(&row), &row);
+    index.close();
+    index.open();
+    ok = ok && index.has_filter() && index.get_filter()->get_key_count() == key_count + 1;
+    ValueDict lookup;
+    for (int i = 0; i <= rows && ok; i++) {
+        lookup["a"] = Value(i == rows ? 2 * rows + 1 : 2 * i);
+        ok = index.may_contain(&lookup);
+        Handles *handles = index.lookup(&lookup);
+        ok = ok && handles->size() == 1;
+        delete handles;
+    }
+    if (!ok)
+        std::cout << "Bloom filter lookup failed" << std::endl;
+
+    // probes on several threads, while inserts set more bits, still find every key that is there
+    std::atomic<int> misses(0);
+    std::vector<std::thread> probers;
+    for (int t = 0; t < 4 && ok; t++)
+        probers.push_back(std::thread([&, t]() {
+            ValueDict probe;
+            for (int i = t; i < rows; i += 4) {
+                probe["a"] = Value(2 * i);
+                if (!index.may_contain(&probe))
+                    misses++;
+            }
+        }));
+    for (int i = 1; i <= 1000 && ok; i++) {
+        row["a"] = Value(2 * rows + 1 + 2 * i);
+        index.insert(table.insert(&row), &row);
+    }
+    for (auto &prober: probers)
+        prober.join();
+    if (misses > 0) {
+        std::cout << "Bloom filter missed " << misses << " keys under concurrent inserts" << std::endl;
+        ok = false;
+    }
+
+    // dropping the index takes its filter with it
+    index.drop();
+    BTreeIntIndex again(table, "bloomindex", column_names, true);
+    again.create();
+    ok = ok && !again.has_filter();
+    again.drop();
+    table.drop();
+    return ok;
+}
+
+// Whether the table's row for handle is row.
+static bool projects_to(HeapTable &table, Handle handle, const ValueDict &row) {
+    ValueDict *result = table.project(handle);
+    bool same = *result == row;
+    delete result;
+    return same;
+}
+
+// Several threads insert into one index at once (interleaved keys, so they meet in the same leaves), each
+// looking up what it has already inserted as it goes and reading the row back from the table (so reads of both
+// files run alongside writes to the index). Timed at a few thread counts, along with parallel lookups.
+bool test_btree_concurrent() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    const int rows = 40 * 1000;
+    std::atomic<int> failures(0);
+    int thread_counts[] = {1, 2, 4, 8};
+    long base_insert_usecs = 0, base_lookup_usecs = 0;
+    for (int threads: thread_counts) {
+        HeapTable table("__test_btree_mt", column_names, column_attributes);
+        table.create();
+        BTreeIndex index(table, "mtindex", column_names, true);
+        index.create();  // empty: the rows go in from all the threads together
+        Handles row_handles;
+        for (int i = 0; i < rows; i++) {
+            ValueDict row;
+            row["a"] = Value((i * 7919) % rows);
+            row_handles.push_back(table.insert(&row));
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++)
+            workers.push_back(std::thread([&, t]() {
+                ValueDict lookup;
+                for (int i = t; i < rows; i += threads) {
+                    index.insert(row_handles[i]);
+                    int back = i >= threads * 4 ? i - threads * (i % 5) : i;  // one of my own recent inserts
+                    lookup["a"] = Value((back * 7919) % rows);
+                    Handles *handles = index.lookup(&lookup);
+                    if (handles->size() != 1 || handles->back() != row_handles[back])
+                        failures++;
+                    else if (!projects_to(table, handles->back(), lookup))
+                        failures++;
+                    delete handles;
+                }
+            }));
+        for (auto &worker: workers)
+            worker.join();
+        auto insert_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        workers.clear();
+        start = std::chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++)
+            workers.push_back(std::thread([&, t]() {
+                ValueDict lookup;
+                for (int i = t; i < rows; i += threads) {
+                    lookup["a"] = Value((i * 7919) % rows);
+                    Handles *handles = index.lookup(&lookup);
+                    if (handles->size() != 1 || handles->back() != row_handles[i])
+                        failures++;
+                    else if (!projects_to(table, handles->back(), lookup))
+                        failures++;
+                    delete handles;
+                }
+            }));
+        for (auto &worker: workers)
+            worker.join();
+        auto lookup_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        if (threads == 1) {
+            base_insert_usecs = insert_usecs;
+            base_lookup_usecs = lookup_usecs;
+        }
+        std::cout << "concurrent btree, " << threads << " thread(s): insert " << rows * 1000L / insert_usecs
+                  << " rows/ms (x" << (double) base_insert_usecs / insert_usecs << "), lookup "
+                  << rows * 1000L / lookup_usecs << " keys/ms (x" << (double) base_lookup_usecs / lookup_usecs
+                  << "), height " << index.get_height() << std::endl;
+        index.drop();
+        table.drop();
+    }
+    if (failures > 0)
+        std::cout << "concurrent btree: " << failures << " lookups failed" << std::endl;
+    return failures == 0;
 }
 
 bool test_btree() {
     std::cout<<"test btree start 1 " << std::endl;
+    if (!test_btree_key_encoding()) {
+        std::cout << "key encoding order failed" << std::endl;
+        return false;
+    }
     ColumnNames column_names;
     column_names.push_back("a");
     column_names.push_back("b");
@@ -253,6 +1477,7 @@ bool test_btree() {
     }
     delete handles;
 
+    auto lookup_start = std::chrono::steady_clock::now();
     for (uint j = 0; j < 10; j++)
         for (int i = 0; i < 1000; i++) {
             lookup["a"] = i + 100;
@@ -271,75 +1496,145 @@ bool test_btree() {
             delete handles;
             delete result;
         }
+    auto lookup_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - lookup_start).count();
+    std::cout << "10000 lookups (with project): " << lookup_usecs / 10000.0 << " us/lookup" << std::endl;
 
     // test delete
-    // ValueDict row;
-    // row["a"] = 44;
-    // row["b"] = 44;
-    // auto thandle = table.insert(&row);
-    // index.insert(thandle);
-    // lookup["a"] = 44;
-    // handles = index.lookup(&lookup);
-    // thandle = handles->back();
-    // delete handles;
-    // result = table.project(thandle);
-    // if (*result != row) {
-    //     std::cout << "44 lookup failed" << std::endl;
-    //     return false;
-    // }
-    // delete result;
-    // std::cout<<"insertion test done" << std::endl;
-
-    // index.del(thandle);
-    // table.del(thandle);
-    // handles = index.lookup(&lookup);
-    // if (handles->size() != 0) {
-    //     std::cout << "delete failed" << std::endl;
-    //     return false;
-    // }
-    // delete handles;
-
-    // // test range
-    // ValueDict minkey, maxkey;
-    // minkey["a"] = 100;
-    // maxkey["a"] = 310;
-    // handles = index.range(&minkey, &maxkey);
-    // ValueDicts *results = table.project(handles);
-    // for (int i = 0; i < 210; i++) {
-    //     if (results->at(i)->at("a") != Value(100 + i)) {
-    //         ValueDict *wrong = results->at(i);
-    //         std::cout << "range failed: " << i << ", a: " << wrong->at("a").n << ", b: " << wrong->at("b").n
-    //                   << std::endl;
-    //         return false;
-    //     }
-    // }
-    // delete handles;
-    // for (auto vd: *results)
-    //     delete vd;
-    // delete results;
-
-    // // test range from beginning and to end
-    // handles = index.range(nullptr, nullptr);
-    // u_long count_i = handles->size();
-    // delete handles;
-    // handles = table.select();
-    // u_long count_t = handles->size();
-    // if (count_i != count_t) {
-    //     std::cout << "full range failed: " << count_i << std::endl;
-    //     return false;
-    // }
-    // for (u_long i = 0; i < count_t; i++)
-    //     index.del((*handles)[i]);
-    // delete handles;
-    // handles = index.range(nullptr, nullptr);
-    // count_i = handles->size();
-    // delete handles;
-    // if (count_i != 0) {
-    //     std::cout << "delete everything failed: " << count_i << std::endl;
-    //     return false;
-    // }
+    ValueDict row;
+    row["a"] = 44;
+    row["b"] = 44;
+    auto thandle = table.insert(&row);
+    index.insert(thandle);
+    lookup["a"] = 44;
+    handles = index.lookup(&lookup);
+    thandle = handles->back();
+    delete handles;
+    result = table.project(thandle);
+    if (*result != row) {
+        std::cout << "44 lookup failed" << std::endl;
+        return false;
+    }
+    delete result;
+    std::cout<<"insertion test done" << std::endl;
+
+    index.del(thandle);
+    table.del(thandle);
+    handles = index.lookup(&lookup);
+    if (handles->size() != 0) {
+        std::cout << "delete failed" << std::endl;
+        return false;
+    }
+    delete handles;
+
+    // the same again, handing the index the row instead of having it read the table
+    row["a"] = 45;
+    thandle = table.insert(&row);
+    index.insert(thandle, &row);
+    lookup["a"] = 45;
+    handles = index.lookup(&lookup);
+    bool found = handles->size() == 1 && handles->back() == thandle;
+    delete handles;
+    index.del(thandle, &row);
+    handles = index.lookup(&lookup);
+    if (!found || handles->size() != 0) {
+        std::cout << "insert/delete with row failed" << std::endl;
+        return false;
+    }
+    delete handles;
+    try {
+        index.del(thandle, &row);
+        std::cout << "deleted a row that wasn't there" << std::endl;
+        return false;
+    } catch (DbRelationError &e) {
+        // expected
+    }
+    table.del(thandle);
+
+    // test range
+    ValueDict minkey, maxkey;
+    minkey["a"] = 100;
+    maxkey["a"] = 310;
+    handles = index.range(&minkey, &maxkey);
+    ValueDicts *results = table.project(handles);
+    for (int i = 0; i < 210; i++) {
+        if (results->at(i)->at("a") != Value(100 + i)) {
+            ValueDict *wrong = results->at(i);
+            std::cout << "range failed: " << i << ", a: " << wrong->at("a").n << ", b: " << wrong->at("b").n
+                      << std::endl;
+            return false;
+        }
+    }
+    for (auto vd: *results)
+        delete vd;
+    delete results;
+
+    // a cursor gives a range a leaf at a time
+    delete handles;
+    maxkey["a"] = 5000;
+    handles = index.range(&minkey, &maxkey);
+    IndexCursor *cursor = index.cursor(&minkey, &maxkey);
+    Handles batch, batches;
+    u_long batch_count = 0;
+    while (cursor->next(batch)) {
+        batches.insert(batches.end(), batch.begin(), batch.end());
+        batch_count++;
+    }
+    delete cursor;
+    bool cursor_ok = handles->size() == 4901 && batches == *handles && batch_count > 1;
+    delete handles;
+
+    // and from 100 on, it picks up rows inserted partway (splitting the leaves ahead of it), none given twice
+    cursor = index.cursor(&minkey, nullptr);
+    cursor_ok = cursor_ok && cursor->next(batch) && !batch.empty() && batch.size() < 1000;
+    int next_a = 100;
+    for (auto const &handle: batch) {
+        result = table.project(handle);
+        cursor_ok = cursor_ok && result->at("a").n == next_a++;
+        delete result;
+    }
+    for (int i = 0; i < 5000; i++) {
+        row["a"] = Value(50100 + i);
+        row["b"] = Value(i);
+        index.insert(table.insert(&row), &row);
+    }
+    while (cursor->next(batch)) {
+        for (auto const &handle: batch) {
+            result = table.project(handle);
+            cursor_ok = cursor_ok && result->at("a").n == next_a++;
+            delete result;
+        }
+    }
+    delete cursor;
+    if (!cursor_ok || next_a != 50100 + 5000) {
+        std::cout << "range cursor failed" << std::endl;
+        return false;
+    }
+
+    // test range from beginning and to end
+    handles = index.range(nullptr, nullptr);
+    u_long count_i = handles->size();
+    delete handles;
+    handles = table.select();
+    u_long count_t = handles->size();
+    if (count_i != count_t) {
+        std::cout << "full range failed: " << count_i << std::endl;
+        return false;
+    }
+    for (u_long i = 0; i < count_t; i++)
+        index.del((*handles)[i]);
+    delete handles;
+    handles = index.range(nullptr, nullptr);
+    count_i = handles->size();
+    delete handles;
+    if (count_i != 0) {
+        std::cout << "delete everything failed: " << count_i << std::endl;
+        return false;
+    }
     index.drop();
     table.drop();
-    return true;
+    return test_btree_composite() && test_btree_int_key() && test_btree_sequential() && test_btree_covering() &&
+           test_btree_lookup_many() && test_btree_create_all() && test_btree_bloom_filter() &&
+           test_btree_concurrent();
 }
 
@@ -1,21 +1,97 @@
 /**
- * @file btree.h - BTreeIndex and BTreeRelation classes
+ * @file btree.h - BTreeIndex, BTreeIntIndex and BTreeRelation classes
  *
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Spring 2020"
  */
 #pragma once
 
+#include <mutex>
 #include "BTreeNode.h"
+#include "bloom_filter.h"
 
-class BTreeIndex : public DbIndex {
+// reader/writer latch on a block of a BTree index (the same kind of latch a HeapFile has)
+typedef FileLatch BTreeLatch;
+
+/**
+ * @class BTreeLatchPath - the latches one operation holds on its way down the tree, the top one first.
+ * Whatever is still held is released when it goes out of scope (so also when the operation throws).
+ */
+class BTreeLatchPath {
 public:
-    BTreeIndex(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique);
+    BTreeLatchPath() : held() {}
+
+    virtual ~BTreeLatchPath() { release(); }
+
+    void shared(BTreeLatch &latch) {
+        latch.lock_shared();
+        this->held.push_back(&latch);
+    }
+
+    void exclusive(BTreeLatch &latch) {
+        latch.lock();
+        this->held.push_back(&latch);
+    }
+
+    // let go of everything but the latch taken last (latch coupling: once the child is latched, the parent can go)
+    void release_above() {
+        for (u_long i = 0; i + 1 < this->held.size(); i++)
+            this->held[i]->unlock();
+        if (!this->held.empty())
+            this->held.erase(this->held.begin(), this->held.end() - 1);
+    }
+
+    // let go of the latch taken last (as on moving along to the next leaf)
+    void release_last() {
+        if (!this->held.empty()) {
+            this->held.back()->unlock();
+            this->held.pop_back();
+        }
+    }
+
+    void release() {
+        while (!this->held.empty()) {
+            this->held.back()->unlock();
+            this->held.pop_back();
+        }
+    }
+
+protected:
+    std::vector<BTreeLatch *> held;
+};
+
+/**
+ * @class BTreeIndexT - unique B+ tree index, parameterized by how its keys are represented (see BTreeNode.h).
+ * Use BTreeIndex in general and BTreeIntIndex when the key is a single INT column.
+ *
+ * Once open, lookups and inserts may run on several threads at once. Each block has a latch, taken top-down
+ * with latch coupling. Lookups hold shared latches. An insert first goes down the same way and takes just the
+ * leaf exclusively; if the leaf has no room without splitting, it lets go and goes down again holding exclusive
+ * latches on the whole path (splits are rare, so this costs little). The root id and height are covered by
+ * tree_latch, which acts as the root's parent.
+ *
+ * An index may also have a Bloom filter on its keys (see create_filter), which lets lookups of keys that aren't
+ * there skip the descent. It is kept in its own file and is added to on every insert.
+ */
+template<class Traits>
+class BTreeIndexT : public DbIndex {
+public:
+    typedef typename Traits::Key Key;
+    typedef BTreeInteriorT<Traits> Interior;
+    typedef BTreeLeafT<Traits> Leaf;
+    typedef typename Interior::Insertion Insertion;
+
+    static constexpr double DEFAULT_FILL_FACTOR = 0.9;
 
-    virtual ~BTreeIndex();
+    BTreeIndexT(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique,
+                ColumnNames include_columns = ColumnNames());
+
+    virtual ~BTreeIndexT();
 
     virtual void create();
 
+    virtual void create(const Handles *handles, const ValueDicts *rows);
+
     virtual void drop();
 
     virtual void open();
@@ -24,28 +100,127 @@ public:
 
     virtual Handles *lookup(ValueDict *key) const;
 
-    virtual Handles *range(ValueDict *min_key, ValueDict *max_key) const;
+    virtual Handles *lookup_many(const ValueDicts *keys) const;
+
+    virtual ValueDicts *lookup_values(ValueDict *key, const ColumnNames *column_names) const;
+
+    virtual Handles *range(ValueDict *min_key, ValueDict *max_key) const;  // in key order
+
+    virtual IndexCursor *cursor(ValueDict *min_key, ValueDict *max_key) const;  // a leaf at a time
+
+    virtual bool is_ordered() const { return true; }
 
     virtual void insert(Handle handle);
 
+    virtual void insert(Handle handle, const ValueDict *row);
+
     virtual void del(Handle handle);
 
-    virtual KeyValue *tkey(const ValueDict *key) const; // pull out the key values from the ValueDict in order
+    virtual void del(Handle handle, const ValueDict *row);
+
+    virtual bool covers(const ColumnNames &column_names) const;
+
+    virtual const ColumnNames &get_include_columns() const { return this->include_columns; }
+
+    virtual bool may_contain(const ValueDict *key) const;
+
+    virtual bool has_filter() const { return this->filter != nullptr; }
+
+    virtual void create_filter();
+
+    const BloomFilter *get_filter() const { return this->filter; }  // nullptr if none
+
+    virtual IndexStats get_stats() const;
+
+    virtual Key tkey(const ValueDict *key) const; // pull the key columns out of the ValueDict in order
+
+    BTreeKey payload(const ValueDict *row) const;  // encode the included columns of the row
+
+    virtual uint get_height() const;  // as the stat block has it, without walking the tree
+
+    uint get_block_count() const { return const_cast<HeapFile &>(this->file).get_last_block_id(); }
+
+    // how full a node on the right edge of the tree is left when it splits under ascending inserts, and how full
+    // a bulk load (create from rows) leaves every node (0.5 to 1.0)
+    void set_fill_factor(double fill_factor);
+
+    double get_leaf_utilization(uint &leaf_count) const;  // average fraction of each leaf block in use (quiesced)
 
 protected:
     static const BlockID STAT = 1;
     bool closed;
+    double fill_factor;
     BTreeStat *stat;
-    BTreeNode *root;
     HeapFile file;
     KeyProfile key_profile;
+    ColumnNames include_columns;  // non-key columns stored in the leaves, so lookups of them needn't go to the table
+    KeyProfile include_profile;
+    BloomFilter *filter;
+
+    // Decoded interior nodes keyed by block id. Interior levels are small and hot, so they stay pinned here
+    // for as long as the index is open; a cached node is the only in-memory copy of its block, so saving it
+    // writes through and the cache never holds a stale image. Leaves are decoded on each visit.
+    mutable std::map<BlockID, BTreeNodePtr> node_cache;
+
+    mutable BTreeLatch tree_latch;  // guards the root id and height in stat
+    mutable std::map<BlockID, BTreeLatch *> latches;  // one per block, made as blocks are first visited
+    mutable std::mutex cache_latch;  // guards node_cache and latches
+
+    void create_empty();
+
+    void bulk_load(const std::vector<std::pair<Key, u_long>> &entries, const Handles *handles, const ValueDicts *rows);
+
+    std::string filter_name() const { return relation.get_table_name() + "-" + name + "-bloom"; }
 
-    void build_key_profile();
+    static BTreeKey filter_key(const Key &key) { return Traits::marshal(key, BTreeKey()); }  // the key's bytes
 
-    Handles *_lookup(BTreeNode *node, uint height, const KeyValue *key) const;
+    BlockID first_leaf() const;
 
-    Insertion _insert(BTreeNode *node, uint height, const KeyValue *key, Handle handle);
+    void insert_entry(const Key &key, Handle handle, const BTreeKey &payload);
+
+    BTreeNodePtr fetch(BlockID block_id, uint height) const;
+
+    BTreeLatch &latch(BlockID block_id) const;
+
+    void set_root(BTreeNodePtr new_root);
+
+    Handles *_lookup(const Key &key, BTreeKey *payload = nullptr) const;
+
+    void _lookup_many(BlockID block_id, uint height, const std::vector<Key> &keys, u_long begin, u_long end,
+                      Handles *handles) const;
+
+    bool insert_in_leaf(const Key &key, Handle handle, const BTreeKey &payload);
+
+    Leaf *latch_leaf(const Key &key, BTreeLatchPath &path);
+
+    Insertion _insert(BTreeNode *node, uint height, bool rightmost, const Key &key, Handle handle,
+                      const BTreeKey &payload, BTreeLatchPath &path);
+
+    /**
+     * @class Cursor - a range of the index's keys, a leaf at a time. No latch is held between leaves. A split in the
+     * meantime may have moved keys past the next leaf it knows of, so then it goes down the tree again to the leaf
+     * after the last key it gave: rows inserted as it goes are seen or not, but none are skipped or given twice.
+     */
+    class Cursor : public IndexCursor {
+    public:
+        Cursor(const BTreeIndexT &index, ValueDict *min_key, ValueDict *max_key);
+
+        virtual bool next(Handles &handles);
+
+    protected:
+        const BTreeIndexT &index;
+        Key min, max;
+        bool has_min, has_max;
+        Key last;  // the last key given
+        bool started;  // whether any key has been given (so last is set)
+        bool done;
+        BlockID block_id;  // the next leaf to read, or 0 to go down the tree to it
+        u_long splits;  // the index's split count as of when block_id was found
+    };
 };
 
+typedef BTreeIndexT<BTreeBytesKey> BTreeIndex;
+typedef BTreeIndexT<BTreeIntKey> BTreeIntIndex;
+
 bool test_btree();
 
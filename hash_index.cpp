@@ -0,0 +1,647 @@
+/**
+ * @file hash_index.cpp - implementation of HashIndex, HashBucket
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#include <chrono>
+#include <cstring>
+#include "hash_index.h"
+
+/**************
+ * HashBucket *
+ **************/
+
+HashBucket::HashBucket(HeapFile &file, BlockID block_id, bool create) : block(nullptr), file(file), id(block_id),
+                                                                         depth(0), overflow(0) {
+    SlottedPage *file_block;
+    if (create) {
+        std::lock_guard<FileLatch> guard(file.get_latch());
+        file_block = file.get_new();
+    } else {
+        FileLatch::Shared guard(file.get_latch());
+        file_block = file.get(block_id);
+    }
+    this->id = file_block->get_block_id();
+    memcpy(this->page, file_block->get_data(), DbBlock::BLOCK_SZ);
+    delete file_block;
+    Dbt dbt(this->page, DbBlock::BLOCK_SZ);
+    this->block = new SlottedPage(dbt, this->id);
+    if (create) {
+        clear();
+        save();
+    } else {
+        Dbt *header = this->block->get(HEADER);
+        this->depth = *(uint32_t *) header->get_data();
+        this->overflow = *(BlockID *) ((char *) header->get_data() + sizeof(uint32_t));
+        delete header;
+    }
+}
+
+HashBucket::~HashBucket() {
+    delete this->block;
+}
+
+// Try to add an entry (from marshal_entry) to the block.
+bool HashBucket::add(const std::string &entry) {
+    Dbt dbt((void *) entry.data(), (u_int32_t) entry.size());
+    try {
+        this->block->add(&dbt);
+        return true;
+    } catch (DbBlockNoRoomError &e) {
+        return false;
+    }
+}
+
+// Add the handles of all the entries in this block for key (whose hash is hash) onto handles.
+void HashBucket::find(uint32_t hash, const BTreeKey &key, Handles *handles) const {
+    RecordIDs *record_ids = this->block->ids();
+    for (auto const &record_id: *record_ids) {
+        if (record_id == HEADER)
+            continue;
+        Dbt *dbt = this->block->get(record_id);
+        const char *data = (const char *) dbt->get_data();
+        if (*(uint32_t *) data == hash && dbt->get_size() - KEY_OFFSET == key.size() &&
+            memcmp(data + KEY_OFFSET, key.data(), key.size()) == 0)
+            handles->push_back(Handle(*(BlockID *) (data + HANDLE_OFFSET),
+                                      *(RecordID *) (data + HANDLE_OFFSET + sizeof(BlockID))));
+        delete dbt;
+    }
+    delete record_ids;
+}
+
+// Remove the entry for handle (whose key has the given hash), if it is in this block.
+bool HashBucket::remove(uint32_t hash, Handle handle) {
+    RecordIDs *record_ids = this->block->ids();
+    bool found = false;
+    for (auto const &record_id: *record_ids) {
+        if (record_id == HEADER)
+            continue;
+        Dbt *dbt = this->block->get(record_id);
+        const char *data = (const char *) dbt->get_data();
+        found = *(uint32_t *) data == hash && *(BlockID *) (data + HANDLE_OFFSET) == handle.first &&
+                *(RecordID *) (data + HANDLE_OFFSET + sizeof(BlockID)) == handle.second;
+        delete dbt;
+        if (found) {
+            this->block->del(record_id);
+            break;
+        }
+    }
+    delete record_ids;
+    return found;
+}
+
+// Append all the entries in this block onto entries.
+void HashBucket::entries(std::vector<std::string> &entries) const {
+    RecordIDs *record_ids = this->block->ids();
+    for (auto const &record_id: *record_ids) {
+        if (record_id == HEADER)
+            continue;
+        Dbt *dbt = this->block->get(record_id);
+        entries.push_back(std::string((char *) dbt->get_data(), dbt->get_size()));
+        delete dbt;
+    }
+    delete record_ids;
+}
+
+// Remove all the entries (the depth and overflow stay as they are).
+void HashBucket::clear() {
+    this->block->clear();
+    char header[sizeof(uint32_t) + sizeof(BlockID)];
+    memset(header, 0, sizeof(header));
+    Dbt dbt(header, sizeof(header));
+    this->block->add(&dbt);
+}
+
+// Write the header and block out to the file.
+void HashBucket::save() {
+    char header[sizeof(uint32_t) + sizeof(BlockID)];
+    *(uint32_t *) header = this->depth;
+    *(BlockID *) (header + sizeof(uint32_t)) = this->overflow;
+    Dbt dbt(header, sizeof(header));
+    this->block->put(HEADER, dbt);
+    std::lock_guard<FileLatch> guard(this->file.get_latch());
+    this->file.put(this->block);
+}
+
+// Bytes of an entry: hash, handle, encoded key.
+std::string HashBucket::marshal_entry(uint32_t hash, Handle handle, const BTreeKey &key) {
+    std::string entry(KEY_OFFSET, '\0');
+    *(uint32_t *) &entry[0] = hash;
+    *(BlockID *) &entry[HANDLE_OFFSET] = handle.first;
+    *(RecordID *) &entry[HANDLE_OFFSET + sizeof(BlockID)] = handle.second;
+    return entry + key;
+}
+
+
+/*************
+ * HashIndex *
+ *************/
+
+HashIndex::HashIndex(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique) : DbIndex(relation,
+                                                                                                            name,
+                                                                                                            key_columns,
+                                                                                                            unique),
+                                                                                                    closed(true),
+                                                                                                    file(relation.get_table_name() +
+                                                                                                         "-" + name),
+                                                                                                    key_profile(BTreeNode::column_profile(relation, key_columns)),
+                                                                                                    global_depth(0),
+                                                                                                    directory(),
+                                                                                                    chunks(),
+                                                                                                    dirty_chunks() {
+}
+
+// Create the index: one empty bucket that every hash goes to, then an entry for each row already in the table.
+void HashIndex::create() {
+    create_empty();
+    Handles *table_rows = relation.select();
+    for (auto const &row: *table_rows)
+        insert(row);
+    delete table_rows;
+}
+
+/**
+ * Create the index from rows already read from the relation.
+ * @param handles  every row in the relation
+ * @param rows     the values of those rows, in the same order
+ */
+void HashIndex::create(const Handles *handles, const ValueDicts *rows) {
+    create_empty();
+    for (u_long i = 0; i < rows->size(); i++)
+        insert_entry(tkey((*rows)[i]), (*handles)[i]);
+}
+
+// Make the file, with the stat block, one empty bucket and a directory pointing every hash to it.
+void HashIndex::create_empty() {
+    file.create();  // the stat block
+    HashBucket bucket(file, 0, true);
+    global_depth = 0;
+    directory.assign(1, bucket.get_id());
+    chunks.clear();
+    dirty_chunks.clear();
+    SlottedPage *chunk = file.get_new();
+    chunks.push_back(chunk->get_block_id());
+    delete chunk;
+    dirty_chunks.insert(0);
+    save_directory();
+    closed = false;
+}
+
+// Drop the index.
+void HashIndex::drop() {
+    file.drop();
+    directory.clear();
+    chunks.clear();
+    closed = true;
+}
+
+// Open existing index (reading in the directory). Enables: lookup, insert, delete.
+void HashIndex::open() {
+    if (closed) {
+        file.open();
+        load_directory();
+        closed = false;
+    }
+}
+
+// Closes the index. Disables: lookup, insert, delete.
+void HashIndex::close() {
+    if (!closed) {
+        file.close();
+        directory.clear();
+        chunks.clear();
+        closed = true;
+    }
+}
+
+// Find all the rows whose key columns are equal to key. Reads one block (more only for heavily duplicated keys).
+Handles *HashIndex::lookup(ValueDict *key_dict) const {
+    const_cast<HashIndex *>(this)->open();
+    BTreeKey key = tkey(key_dict);
+    uint32_t h = hash(key);
+    Handles *handles = new Handles();
+    for (BlockID block_id = bucket_for(h); block_id != 0;) {
+        HashBucket bucket(const_cast<HeapFile &>(file), block_id, false);
+        bucket.find(h, key, handles);
+        block_id = bucket.get_overflow();
+    }
+    return handles;
+}
+
+// Look up a batch of keys, reading each bucket once however many of the keys hash to it.
+Handles *HashIndex::lookup_many(const ValueDicts *key_dicts) const {
+    const_cast<HashIndex *>(this)->open();
+    std::vector<std::pair<BlockID, BTreeKey>> probes;  // (bucket, key), sorted so a bucket's keys are together
+    for (auto const &key_dict: *key_dicts) {
+        BTreeKey key = tkey(key_dict);
+        probes.push_back(std::make_pair(bucket_for(hash(key)), key));
+    }
+    std::sort(probes.begin(), probes.end());
+    probes.erase(std::unique(probes.begin(), probes.end()), probes.end());
+    Handles *handles = new Handles();
+    u_long next = 0;
+    for (u_long first = 0; first < probes.size(); first = next) {
+        for (BlockID block_id = probes[first].first; block_id != 0;) {
+            HashBucket bucket(const_cast<HeapFile &>(file), block_id, false);
+            for (next = first; next < probes.size() && probes[next].first == probes[first].first; next++)
+                bucket.find(hash(probes[next].second), probes[next].second, handles);
+            block_id = bucket.get_overflow();
+        }
+    }
+    std::sort(handles->begin(), handles->end());
+    return handles;
+}
+
+/**
+ * Insert the entry for a row. Row must exist in relation already.
+ * @param handle  the row's handle
+ */
+void HashIndex::insert(Handle handle) {
+    open();
+    ValueDict *row = relation.project(handle);
+    insert(handle, row);
+    delete row;
+}
+
+// Insert the entry for a row, given its values (so it needn't be read back from the relation).
+void HashIndex::insert(Handle handle, const ValueDict *row) {
+    open();
+    insert_entry(tkey(row), handle);
+}
+
+/**
+ * Insert the entry for a row, given its encoded key.
+ * If the row's bucket is full, the bucket is split (and the insert tried again), unless all its entries have the
+ * same hash, in which case splitting can't help and the bucket gets another block instead.
+ * @param key     the row's encoded key
+ * @param handle  the row's handle
+ */
+void HashIndex::insert_entry(const BTreeKey &key, Handle handle) {
+    uint32_t h = hash(key);
+    if (unique) {
+        Handles found;
+        for (BlockID block_id = bucket_for(h); block_id != 0;) {
+            HashBucket bucket(file, block_id, false);
+            bucket.find(h, key, &found);
+            block_id = bucket.get_overflow();
+        }
+        if (!found.empty())
+            throw DbRelationError("Duplicate keys are not allowed in unique index");
+    }
+    std::string entry = HashBucket::marshal_entry(h, handle, key);
+
+    while (true) {
+        BlockID bucket_id = bucket_for(h);
+        uint depth = 0;
+        bool mixed = false;  // does the bucket have entries with different hashes (so a split would help)?
+        BlockID last = 0;
+        for (BlockID block_id = bucket_id; block_id != 0;) {
+            HashBucket bucket(file, block_id, false);
+            if (bucket.add(entry)) {
+                bucket.save();
+                return;
+            }
+            if (block_id == bucket_id)
+                depth = bucket.get_depth();
+            if (!mixed) {
+                std::vector<std::string> entries;
+                bucket.entries(entries);
+                for (auto const &other: entries)
+                    mixed = mixed || HashBucket::entry_hash(other) != h;
+            }
+            last = block_id;
+            block_id = bucket.get_overflow();
+        }
+
+        if (mixed && depth < MAX_DEPTH) {
+            split(bucket_id);
+            continue;  // try again, now that there are two buckets
+        }
+
+        // chain another block onto the bucket
+        HashBucket more(file, 0, true);
+        more.set_depth(depth);
+        more.add(entry);
+        more.save();
+        HashBucket tail(file, last, false);
+        tail.set_overflow(more.get_id());
+        tail.save();
+        return;
+    }
+}
+
+// Remove the entry for a row. Row must still be in the relation.
+void HashIndex::del(Handle handle) {
+    open();
+    ValueDict *row = relation.project(handle);
+    del(handle, row);
+    delete row;
+}
+
+// Remove the entry for a row, given its values.
+void HashIndex::del(Handle handle, const ValueDict *row) {
+    open();
+    BTreeKey key = tkey(row);
+    uint32_t h = hash(key);
+    for (BlockID block_id = bucket_for(h); block_id != 0;) {
+        HashBucket bucket(file, block_id, false);
+        if (bucket.remove(h, handle)) {
+            bucket.save();
+            return;
+        }
+        block_id = bucket.get_overflow();
+    }
+    throw DbRelationError("row is not in hash index " + name);
+}
+
+// Encode the key columns of the row, as for a BTreeIndex.
+BTreeKey HashIndex::tkey(const ValueDict *key) const {
+    return BTreeNode::encode_columns(key, key_columns, key_profile);
+}
+
+// 32-bit FNV-1a of the encoded key, finished with a mixer so the low bits (which the directory uses) are good.
+uint32_t HashIndex::hash(const BTreeKey &key) {
+    uint32_t h = 2166136261U;
+    for (auto const c: key) {
+        h ^= (unsigned char) c;
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+void HashIndex::set_directory(u_long slot, BlockID bucket_id) {
+    directory[slot] = bucket_id;
+    dirty_chunks.insert(slot / CHUNK_SIZE);
+}
+
+// Use one more bit of the hash: each bucket is now pointed to from twice as many slots.
+void HashIndex::double_directory() {
+    u_long size = directory.size();
+    directory.resize(2 * size);
+    for (u_long slot = 0; slot < size; slot++)
+        set_directory(size + slot, directory[slot]);
+    global_depth++;
+    while (chunks.size() * CHUNK_SIZE < directory.size()) {
+        SlottedPage *chunk = file.get_new();
+        chunks.push_back(chunk->get_block_id());
+        delete chunk;
+    }
+}
+
+// Read the global depth and directory in from the file.
+void HashIndex::load_directory() {
+    SlottedPage *stat = file.get(STAT);
+    Dbt *dbt = stat->get(GLOBAL_DEPTH);
+    global_depth = *(uint32_t *) dbt->get_data();
+    delete dbt;
+    dbt = stat->get(CHUNKS);
+    BlockID *chunk_ids = (BlockID *) dbt->get_data();
+    chunks.assign(chunk_ids, chunk_ids + dbt->get_size() / sizeof(BlockID));
+    delete dbt;
+    delete stat;
+
+    directory.clear();
+    for (auto const &chunk_id: chunks) {
+        SlottedPage *chunk = file.get(chunk_id);
+        dbt = chunk->get(1);
+        BlockID *bucket_ids = (BlockID *) dbt->get_data();
+        directory.insert(directory.end(), bucket_ids, bucket_ids + dbt->get_size() / sizeof(BlockID));
+        delete dbt;
+        delete chunk;
+    }
+    directory.resize(1U << global_depth);
+    dirty_chunks.clear();
+}
+
+// Write the global depth and the changed parts of the directory out to the file.
+void HashIndex::save_directory() {
+    SlottedPage *stat = file.get(STAT);
+    stat->clear();
+    Dbt depth_dbt(&global_depth, sizeof(global_depth));
+    stat->add(&depth_dbt);
+    Dbt chunks_dbt(chunks.data(), (u_int32_t) (chunks.size() * sizeof(BlockID)));
+    stat->add(&chunks_dbt);
+    file.put(stat);
+    delete stat;
+
+    for (auto const &chunk_num: dirty_chunks) {
+        u_long begin = chunk_num * CHUNK_SIZE;
+        u_long end = std::min(directory.size(), begin + CHUNK_SIZE);
+        SlottedPage *chunk = file.get(chunks[chunk_num]);
+        chunk->clear();
+        Dbt dbt(&directory[begin], (u_int32_t) ((end - begin) * sizeof(BlockID)));
+        chunk->add(&dbt);
+        file.put(chunk);
+        delete chunk;
+    }
+    dirty_chunks.clear();
+}
+
+/**
+ * Split a full bucket in two on the next bit of the hash. The entries with that bit set move to a new bucket,
+ * and the directory slots for them are pointed at it. No other bucket is touched.
+ * @param bucket_id  first block of the bucket to split
+ */
+void HashIndex::split(BlockID bucket_id) {
+    // gather up the bucket's entries (from all its blocks)
+    std::vector<std::string> entries;
+    BlockPointers chain;
+    uint depth = 0;
+    for (BlockID block_id = bucket_id; block_id != 0;) {
+        HashBucket bucket(file, block_id, false);
+        if (block_id == bucket_id)
+            depth = bucket.get_depth();
+        bucket.entries(entries);
+        chain.push_back(block_id);
+        block_id = bucket.get_overflow();
+    }
+    if (depth == global_depth)
+        double_directory();
+
+    uint32_t bit = 1U << depth;
+    std::vector<std::string> stay, move;
+    for (auto const &entry: entries)
+        (HashBucket::entry_hash(entry) & bit ? move : stay).push_back(entry);
+
+    HashBucket sibling(file, 0, true);
+    BlockID sibling_id = sibling.get_id();
+    write_chain(chain, stay, depth + 1);
+    write_chain(BlockPointers(1, sibling_id), move, depth + 1);
+
+    // the slots that lead to the bucket are the ones matching its low depth bits; the half with the next bit set
+    // now lead to the sibling
+    u_long base = HashBucket::entry_hash(entries.front()) & (bit - 1);
+    for (u_long slot = base; slot < directory.size(); slot += bit)
+        if (slot & bit)
+            set_directory(slot, sibling_id);
+    save_directory();
+}
+
+/**
+ * Rewrite a bucket's blocks with the given entries, adding blocks to the chain if they don't fit. Blocks of the
+ * chain that end up not needed are left on it, empty, for later inserts.
+ * @param chain    the bucket's blocks, in order
+ * @param entries  entries to put in the bucket
+ * @param depth    local depth of the bucket
+ */
+void HashIndex::write_chain(const BlockPointers &chain, const std::vector<std::string> &entries, uint depth) {
+    u_long link = 0;
+    HashBucket *bucket = new HashBucket(file, chain[link], false);
+    bucket->clear();
+    bucket->set_depth(depth);
+    for (auto const &entry: entries) {
+        while (!bucket->add(entry)) {
+            // this block is full: go on to the next one in the chain (or a new one)
+            link++;
+            HashBucket *next = link < chain.size() ? new HashBucket(file, chain[link], false)
+                                                   : new HashBucket(file, 0, true);
+            bucket->set_overflow(next->get_id());
+            bucket->save();
+            delete bucket;
+            bucket = next;
+            bucket->clear();
+            bucket->set_depth(depth);
+        }
+    }
+    bucket->save();
+    delete bucket;
+    for (link++; link < chain.size(); link++) {
+        HashBucket spare(file, chain[link], false);
+        spare.clear();
+        spare.set_depth(depth);
+        spare.save();
+    }
+}
+
+
+// Test helper: check that lookup of value in column (of index) finds exactly the expected handles.
+bool test_hash_lookup(HashIndex &index, const Identifier &column, const Value &value, Handles expected) {
+    ValueDict key;
+    key[column] = value;
+    Handles *handles = index.lookup(&key);
+    std::sort(handles->begin(), handles->end());
+    std::sort(expected.begin(), expected.end());
+    bool ok = *handles == expected;
+    delete handles;
+    return ok;
+}
+
+bool test_hash_index() {
+    ColumnNames column_names;
+    column_names.push_back("id");
+    column_names.push_back("grp");
+    column_names.push_back("tag");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable table("__test_hash", column_names, column_attributes);
+    table.create();
+    const int rows = 20 * 1000, groups = 1000, hot = 1500;
+    Handles row_handles;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["id"] = Value(i);
+        row["grp"] = Value(i % groups);  // rows / groups duplicates of each
+        row["tag"] = Value(i < hot ? std::string("hot") : "tag-" + std::to_string(i));  // one very common value
+        row_handles.push_back(table.insert(&row));
+    }
+
+    // unique, high-cardinality key: one bucket read per lookup
+    HashIndex id_index(table, "hash_id", ColumnNames(1, "id"), true);
+    id_index.create();
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rows && ok; i++)
+        ok = test_hash_lookup(id_index, "id", Value(i), Handles(1, row_handles[i]));
+    auto lookup_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    std::cout << "hash id index: " << rows << " keys in " << id_index.get_block_count() << " blocks, global depth "
+              << id_index.get_global_depth() << ", " << (double) lookup_usecs / rows << " us/lookup" << std::endl;
+    ok = ok && test_hash_lookup(id_index, "id", Value(rows), Handles());
+    if (!ok)
+        std::cout << "hash id lookup failed" << std::endl;
+
+    // a batch of keys (one missing, one twice)
+    ValueDicts probes;
+    Handles expected;
+    for (int i = rows - 1; i >= -1 && ok; i -= 97) {
+        ValueDict *probe = new ValueDict();
+        (*probe)["id"] = Value(i < 0 ? rows : i);
+        probes.push_back(probe);
+        if (i >= 0)
+            expected.push_back(row_handles[i]);
+    }
+    probes.push_back(new ValueDict(*probes.front()));
+    std::sort(expected.begin(), expected.end());
+    Handles *found = id_index.lookup_many(&probes);
+    ok = ok && *found == expected;
+    delete found;
+    for (auto probe: probes)
+        delete probe;
+    if (!ok)
+        std::cout << "hash lookup_many failed" << std::endl;
+
+    // duplicates
+    HashIndex grp_index(table, "hash_grp", ColumnNames(1, "grp"), false);
+    grp_index.create();
+    for (int g = 0; g < groups && ok; g += 7) {
+        Handles expected;
+        for (int i = g; i < rows; i += groups)
+            expected.push_back(row_handles[i]);
+        ok = test_hash_lookup(grp_index, "grp", Value(g), expected);
+    }
+    if (!ok)
+        std::cout << "hash duplicate lookup failed" << std::endl;
+
+    // too many of one key for a block: the bucket has to overflow
+    HashIndex tag_index(table, "hash_tag", ColumnNames(1, "tag"), false);
+    tag_index.create();
+    ok = ok && test_hash_lookup(tag_index, "tag", Value("hot"), Handles(row_handles.begin(), row_handles.begin() + hot));
+    ok = ok && test_hash_lookup(tag_index, "tag", Value("tag-" + std::to_string(rows - 1)),
+                                Handles(1, row_handles[rows - 1]));
+    if (!ok)
+        std::cout << "hash overflow lookup failed" << std::endl;
+
+    // delete, and reopen to check the directory was saved
+    for (int i = 0; i < rows && ok; i += 2) {
+        id_index.del(row_handles[i]);
+        tag_index.del(row_handles[i]);
+    }
+    id_index.close();
+    tag_index.close();
+    for (int i = 0; i < rows && ok; i += 101)
+        ok = test_hash_lookup(id_index, "id", Value(i), i % 2 == 0 ? Handles() : Handles(1, row_handles[i]));
+    Handles odd_hot;
+    for (int i = 1; i < hot; i += 2)
+        odd_hot.push_back(row_handles[i]);
+    ok = ok && test_hash_lookup(tag_index, "tag", Value("hot"), odd_hot);
+    if (!ok)
+        std::cout << "hash delete failed" << std::endl;
+
+    // unique index turns away a duplicate
+    if (ok) {
+        ValueDict row;
+        row["id"] = Value(1);
+        row["grp"] = Value(0);
+        row["tag"] = Value("dup");
+        Handle dup = table.insert(&row);
+        try {
+            id_index.insert(dup);
+            std::cout << "hash unique index took a duplicate" << std::endl;
+            ok = false;
+        } catch (DbRelationError &e) {
+            // expected
+        }
+    }
+
+    id_index.drop();
+    grp_index.drop();
+    tag_index.drop();
+    table.drop();
+    return ok;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file hash_index.h - HashIndex and HashBucket classes
+ *
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#pragma once
+
+#include <set>
+#include "BTreeNode.h"  // for KeyProfile and the key encoding (BTreeNode::encode_value)
+
+/**
+ * @class HashBucket - one block of a hash index bucket.
+ *
+ * Record 1 is a header holding the bucket's local depth and the id of the bucket's next block (0 if none); a
+ * bucket only gets more than one block when its entries can't be told apart by splitting (heavy duplicates).
+ * The rest of the records are entries, in no particular order:
+ *      4 bytes hash, 4 bytes block id + 2 bytes record id (the handle), then the encoded key
+ * Like a BTreeNode, it keeps its own copy of the block, so several can be in hand at once.
+ */
+class HashBucket {
+public:
+    static const RecordID HEADER = 1;
+
+    HashBucket(HeapFile &file, BlockID block_id, bool create);
+
+    virtual ~HashBucket();
+
+    BlockID get_id() const { return this->id; }
+
+    uint get_depth() const { return this->depth; }
+
+    void set_depth(uint depth) { this->depth = depth; }
+
+    BlockID get_overflow() const { return this->overflow; }
+
+    void set_overflow(BlockID overflow) { this->overflow = overflow; }
+
+    bool add(const std::string &entry);  // false if there's no room for it
+
+    void find(uint32_t hash, const BTreeKey &key, Handles *handles) const;
+
+    bool remove(uint32_t hash, Handle handle);
+
+    void entries(std::vector<std::string> &entries) const;
+
+    void clear();
+
+    void save();
+
+    static std::string marshal_entry(uint32_t hash, Handle handle, const BTreeKey &key);
+
+    static uint32_t entry_hash(const std::string &entry) { return *(uint32_t *) entry.data(); }
+
+protected:
+    static const u_int32_t HANDLE_OFFSET = sizeof(uint32_t);
+    static const u_int32_t KEY_OFFSET = HANDLE_OFFSET + sizeof(BlockID) + sizeof(RecordID);
+
+    char page[DbBlock::BLOCK_SZ];  // private copy of the block
+    SlottedPage *block;
+    HeapFile &file;
+    BlockID id;
+    uint depth;
+    BlockID overflow;
+};
+
+/**
+ * @class HashIndex - extendible hash index.
+ *
+ * The directory maps the low global_depth bits of a key's hash to the block of its bucket. It is small and kept
+ * in memory while the index is open (stored in the file in chunk blocks listed in the stat block), so a lookup
+ * reads just the one bucket block. A bucket that fills up splits in two on the next bit of the hash, doubling
+ * the directory first only if the bucket already uses all of its bits; nothing else is rehashed.
+ * Duplicate keys are allowed unless the index is unique.
+ */
+class HashIndex : public DbIndex {
+public:
+    HashIndex(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique);
+
+    virtual ~HashIndex() {}
+
+    virtual void create();
+
+    virtual void create(const Handles *handles, const ValueDicts *rows);
+
+    virtual void drop();
+
+    virtual void open();
+
+    virtual void close();
+
+    virtual Handles *lookup(ValueDict *key) const;
+
+    virtual Handles *lookup_many(const ValueDicts *keys) const;
+
+    virtual void insert(Handle handle);
+
+    virtual void insert(Handle handle, const ValueDict *row);
+
+    virtual void del(Handle handle);
+
+    virtual void del(Handle handle, const ValueDict *row);
+
+    virtual BTreeKey tkey(const ValueDict *key) const; // encode the key columns of the ValueDict in order
+
+    static uint32_t hash(const BTreeKey &key);
+
+    uint get_global_depth() const { return this->global_depth; }
+
+    uint get_block_count() const { return const_cast<HeapFile &>(this->file).get_last_block_id(); }
+
+protected:
+    static const BlockID STAT = 1;
+    static const RecordID GLOBAL_DEPTH = 1;  // where we store the global depth in the stat block
+    static const RecordID CHUNKS = GLOBAL_DEPTH + 1;  // where we store the directory's chunk block ids
+    static const uint MAX_DEPTH = 19;  // so the list of chunk blocks fits in the stat block
+    static const uint CHUNK_SIZE = 1000;  // directory entries per chunk block
+
+    bool closed;
+    HeapFile file;
+    KeyProfile key_profile;
+    uint global_depth;
+    BlockPointers directory;  // bucket for each value of the low global_depth bits of a hash
+    BlockPointers chunks;  // blocks the directory is saved in
+    std::set<u_long> dirty_chunks;
+
+    void create_empty();
+
+    void insert_entry(const BTreeKey &key, Handle handle);
+
+    BlockID bucket_for(uint32_t hash) const { return this->directory[hash & ((1U << this->global_depth) - 1)]; }
+
+    void set_directory(u_long slot, BlockID bucket_id);
+
+    void double_directory();
+
+    void load_directory();
+
+    void save_directory();
+
+    void split(BlockID bucket_id);
+
+    void write_chain(const BlockPointers &chain, const std::vector<std::string> &entries, uint depth);
+};
+
+bool test_hash_index();
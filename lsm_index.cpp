@@ -0,0 +1,715 @@
+/**
+ * @file lsm_index.cpp - implementation of LSMIndex, LSMRun
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include "lsm_index.h"
+#include "btree.h"  // for the ingest comparison in the test
+
+/**********
+ * LSMRun *
+ **********/
+
+LSMRun::LSMRun(Identifier name, uint number, uint level) : file(name), filter(name + "-bloom"), number(number),
+                                                           level(level), data_blocks(0), entry_count(0), fences(),
+                                                           retired(false), block(nullptr), keys() {
+}
+
+// A retired run takes its files with it.
+LSMRun::~LSMRun() {
+    delete this->block;
+    if (this->retired) {
+        this->file.drop();
+        this->filter.drop();
+    }
+}
+
+// Start writing the run (into block 1, which creating the file makes).
+void LSMRun::create() {
+    this->file.create();
+    this->block = this->file.get(1);
+    this->data_blocks = 1;
+}
+
+/**
+ * Add the next entry of the run. Entries have to come in LSMKey order.
+ * @param key   the entry's encoded key and handle
+ * @param live  false for a tombstone
+ */
+void LSMRun::append(const LSMKey &key, bool live) {
+    std::string entry(KEY_OFFSET, '\0');
+    *(BlockID *) &entry[0] = key.second.first;
+    *(RecordID *) &entry[sizeof(BlockID)] = key.second.second;
+    entry[KEY_OFFSET - 1] = (char) live;
+    entry += key.first;
+    Dbt dbt((void *) entry.data(), (u_int32_t) entry.size());
+    try {
+        this->block->add(&dbt);
+    } catch (DbBlockNoRoomError &e) {
+        this->file.put(this->block);
+        delete this->block;
+        this->block = this->file.get_new();
+        this->data_blocks++;
+        this->block->add(&dbt);
+    }
+    if (this->fences.size() < this->data_blocks)
+        this->fences.push_back(key.first);
+    if (this->keys.empty() || this->keys.back() != key.first)
+        this->keys.push_back(key.first);
+    this->entry_count++;
+}
+
+// Write out the last data block, then the fence keys after it, and build the run's Bloom filter.
+void LSMRun::finish() {
+    this->file.put(this->block);
+    delete this->block;
+    this->block = nullptr;
+    SlottedPage *fence_block = nullptr;
+    for (auto const &fence: this->fences) {
+        Dbt dbt((void *) fence.data(), (u_int32_t) fence.size());
+        try {
+            if (fence_block == nullptr)
+                throw DbBlockNoRoomError("first fence block");
+            fence_block->add(&dbt);
+        } catch (DbBlockNoRoomError &e) {
+            if (fence_block != nullptr) {
+                this->file.put(fence_block);
+                delete fence_block;
+            }
+            fence_block = this->file.get_new();
+            fence_block->add(&dbt);
+        }
+    }
+    if (fence_block != nullptr) {
+        this->file.put(fence_block);
+        delete fence_block;
+    }
+    this->filter.create(this->keys);
+    this->keys.clear();
+}
+
+/**
+ * Open a run written before, reading in its fence keys and Bloom filter.
+ * @param data_blocks  how many of its blocks hold entries (the rest hold fence keys)
+ * @param entry_count  how many entries it has
+ */
+void LSMRun::open(BlockID data_blocks, u_long entry_count) {
+    this->file.open();
+    this->data_blocks = data_blocks;
+    this->entry_count = entry_count;
+    this->fences.clear();
+    for (BlockID block_id = data_blocks + 1; block_id <= this->file.get_last_block_id(); block_id++) {
+        SlottedPage *fence_block = this->file.get(block_id);
+        RecordIDs *record_ids = fence_block->ids();
+        for (auto const &record_id: *record_ids) {
+            Dbt *dbt = fence_block->get(record_id);
+            this->fences.push_back(BTreeKey((char *) dbt->get_data(), dbt->get_size()));
+            delete dbt;
+        }
+        delete record_ids;
+        delete fence_block;
+    }
+    this->filter.open();
+}
+
+void LSMRun::close() {
+    this->file.close();
+    this->filter.close();
+}
+
+/**
+ * Find the versions of the entries for key in this run.
+ * @param key   encoded key to look for
+ * @param seen  handles found so far, with whether they are live; entries for handles already there (from newer
+ *              runs) are left as they are
+ */
+void LSMRun::find(const BTreeKey &key, std::map<Handle, bool> &seen) const {
+    if (!this->filter.may_contain(key))
+        return;
+    // the key's entries start in the last block whose fence is before it (or the first with the key as its fence)
+    u_long index = std::lower_bound(this->fences.begin(), this->fences.end(), key) - this->fences.begin();
+    if (index > 0)
+        index--;
+    bool found = false, past = false;
+    std::vector<LSMEntry> entries;
+    for (BlockID block_id = (BlockID) (index + 1); block_id <= this->data_blocks && !past; block_id++) {
+        entries.clear();
+        read(block_id, entries);
+        for (auto const &entry: entries) {
+            if (entry.first.first == key) {
+                seen.emplace(entry.first.second, entry.second);
+                found = true;
+            } else if (entry.first.first > key) {
+                past = true;
+                break;
+            }
+        }
+    }
+    if (!found)
+        this->filter.false_positive();
+}
+
+/**
+ * Read the entries of one data block.
+ * @param block_id  which block (1 to data_blocks)
+ * @param entries   the block's entries get appended onto this, in order
+ */
+void LSMRun::read(BlockID block_id, std::vector<LSMEntry> &entries) const {
+    HeapFile &file = const_cast<HeapFile &>(this->file);
+    FileLatch::Shared guard(file.get_latch());
+    SlottedPage *data_block = file.get(block_id);
+    RecordIDs *record_ids = data_block->ids();
+    for (auto const &record_id: *record_ids) {
+        Dbt *dbt = data_block->get(record_id);
+        const char *data = (const char *) dbt->get_data();
+        Handle handle(*(BlockID *) data, *(RecordID *) (data + sizeof(BlockID)));
+        BTreeKey key(data + KEY_OFFSET, dbt->get_size() - KEY_OFFSET);
+        entries.push_back(LSMEntry(LSMKey(key, handle), data[KEY_OFFSET - 1] != 0));
+        delete dbt;
+    }
+    delete record_ids;
+    delete data_block;
+}
+
+
+/************
+ * LSMIndex *
+ ************/
+
+LSMIndex::LSMIndex(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique) : DbIndex(relation,
+                                                                                                          name,
+                                                                                                          key_columns,
+                                                                                                          unique),
+                                                                                                  closed(true),
+                                                                                                  file(relation.get_table_name() +
+                                                                                                       "-" + name),
+                                                                                                  key_profile(BTreeNode::column_profile(relation, key_columns)),
+                                                                                                  next_number(1),
+                                                                                                  memtable(),
+                                                                                                  immutables(),
+                                                                                                  runs(),
+                                                                                                  latch(),
+                                                                                                  work(),
+                                                                                                  idle(),
+                                                                                                  compactor(),
+                                                                                                  stopping(false),
+                                                                                                  compacting(false),
+                                                                                                  compactions(0) {
+    if (unique)
+        throw DbRelationError("LSM indices can't be unique");
+}
+
+// Closing writes out the memtable (and stops the compaction thread).
+LSMIndex::~LSMIndex() {
+    close();
+}
+
+// Create the index, with the rows already in the table as one sorted run.
+void LSMIndex::create() {
+    create_empty();
+    std::vector<LSMEntry> entries;
+    Handles *table_rows = relation.select();
+    for (auto const &handle: *table_rows) {
+        ValueDict *row = relation.project(handle, &key_columns);
+        entries.push_back(LSMEntry(LSMKey(tkey(row), handle), true));
+        delete row;
+    }
+    delete table_rows;
+    bulk_load(entries);
+}
+
+/**
+ * Create the index from rows already read from the relation.
+ * @param handles  every row in the relation
+ * @param rows     the values of those rows, in the same order
+ */
+void LSMIndex::create(const Handles *handles, const ValueDicts *rows) {
+    create_empty();
+    std::vector<LSMEntry> entries;
+    for (u_long i = 0; i < rows->size(); i++)
+        entries.push_back(LSMEntry(LSMKey(tkey((*rows)[i]), (*handles)[i]), true));
+    bulk_load(entries);
+}
+
+// Make the file, with a manifest of no runs, and start compacting.
+void LSMIndex::create_empty() {
+    file.create();  // the manifest block
+    next_number = 1;
+    memtable = std::make_shared<LSMMemtable>();
+    immutables.clear();
+    runs.clear();
+    save_manifest();
+    closed = false;
+    start_compactor();
+}
+
+// Write the entries out as a single run, at the level a run of that size would have got to by compaction.
+void LSMIndex::bulk_load(std::vector<LSMEntry> &entries) {
+    if (entries.empty())
+        return;
+    std::sort(entries.begin(), entries.end());
+    LSMRunPtr run = std::make_shared<LSMRun>(run_name(next_number), next_number, level_for(entries.size()));
+    next_number++;
+    run->create();
+    for (auto const &entry: entries)
+        run->append(entry.first, entry.second);
+    run->finish();
+    std::lock_guard<std::mutex> guard(latch);
+    add_run(run);
+    save_manifest();
+}
+
+// Drop the index, with all its runs.
+void LSMIndex::drop() {
+    open();
+    stop_compactor();
+    for (auto const &run: runs)
+        run->retire();
+    runs.clear();
+    immutables.clear();
+    memtable.reset();
+    file.drop();
+    closed = true;
+}
+
+// Open existing index (reading in the manifest and opening the runs). Enables: lookup, insert, delete.
+void LSMIndex::open() {
+    if (closed) {
+        file.open();
+        load_manifest();
+        memtable = std::make_shared<LSMMemtable>();
+        closed = false;
+        start_compactor();
+    }
+}
+
+// Closes the index, writing out the memtable first. Disables: lookup, insert, delete.
+void LSMIndex::close() {
+    if (!closed) {
+        stop_compactor();
+        if (!memtable->empty()) {
+            uint number = next_number++;
+            flush(number, memtable);
+        }
+        for (auto const &run: runs)
+            run->close();
+        runs.clear();
+        memtable.reset();
+        file.close();
+        closed = true;
+    }
+}
+
+/**
+ * Find all the rows whose key columns are equal to key: the newest version of each entry for the key, from the
+ * memtable or else the newest run that has one, unless that is a tombstone.
+ * @param key_dict  dictionary of values for the search key
+ * @returns         handles of the matching rows, sorted (freed by caller)
+ */
+Handles *LSMIndex::lookup(ValueDict *key_dict) const {
+    const_cast<LSMIndex *>(this)->open();
+    BTreeKey key = tkey(key_dict);
+    std::map<Handle, bool> seen;
+    std::vector<LSMRunPtr> runs;
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        for (auto entry = memtable->lower_bound(LSMKey(key, Handle(0, 0)));
+             entry != memtable->end() && entry->first.first == key; entry++)
+            seen.emplace(entry->first.second, entry->second);
+        for (auto const &immutable: immutables)
+            for (auto entry = immutable.second->lower_bound(LSMKey(key, Handle(0, 0)));
+                 entry != immutable.second->end() && entry->first.first == key; entry++)
+                seen.emplace(entry->first.second, entry->second);
+        runs = this->runs;  // a run compacted away meanwhile stays readable until we're done with it
+    }
+    for (auto const &run: runs)
+        run->find(key, seen);
+    Handles *handles = new Handles();
+    for (auto const &entry: seen)
+        if (entry.second)
+            handles->push_back(entry.first);
+    return handles;
+}
+
+/**
+ * Insert the entry for a row. Row must exist in relation already.
+ * @param handle  the row's handle
+ */
+void LSMIndex::insert(Handle handle) {
+    open();
+    ValueDict *row = relation.project(handle, &key_columns);
+    insert(handle, row);
+    delete row;
+}
+
+// Insert the entry for a row, given its values (so it needn't be read back from the relation).
+void LSMIndex::insert(Handle handle, const ValueDict *row) {
+    open();
+    put(tkey(row), handle, true);
+}
+
+// Remove the entry for a row. Row must still be in the relation.
+void LSMIndex::del(Handle handle) {
+    open();
+    ValueDict *row = relation.project(handle, &key_columns);
+    del(handle, row);
+    delete row;
+}
+
+// Remove the entry for a row, given its values: a tombstone goes in that hides any older version of the entry.
+void LSMIndex::del(Handle handle, const ValueDict *row) {
+    open();
+    put(tkey(row), handle, false);
+}
+
+// Encode the key columns of the row, as for a BTreeIndex.
+BTreeKey LSMIndex::tkey(const ValueDict *key) const {
+    return BTreeNode::encode_columns(key, key_columns, key_profile);
+}
+
+// Wait until the compaction thread has merged every level that has FANOUT runs.
+void LSMIndex::wait_for_compaction() {
+    open();
+    std::unique_lock<std::mutex> guard(latch);
+    std::vector<LSMRunPtr> inputs;
+    idle.wait(guard, [this, &inputs] { return !compacting && !pick_compaction(inputs); });
+}
+
+uint LSMIndex::get_run_count() const {
+    std::lock_guard<std::mutex> guard(latch);
+    return (uint) runs.size();
+}
+
+/**
+ * Put an entry (or a tombstone) in the memtable. If that fills it, it is set aside (still found by lookups) and
+ * written out as a run by this thread, while other threads go on with a new memtable.
+ * @param key     the row's encoded key
+ * @param handle  the row's handle
+ * @param live    false for a tombstone
+ */
+void LSMIndex::put(const BTreeKey &key, Handle handle, bool live) {
+    std::shared_ptr<const LSMMemtable> full;
+    uint number = 0;
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        (*memtable)[LSMKey(key, handle)] = live;
+        if (memtable->size() >= MEMTABLE_ENTRIES) {
+            number = next_number++;
+            full = memtable;
+            immutables.insert(immutables.begin(), std::make_pair(number, full));
+            memtable = std::make_shared<LSMMemtable>();
+        }
+    }
+    if (full)
+        flush(number, full);
+}
+
+/**
+ * Write a memtable out as a level 0 run and add it to the manifest.
+ * @param number  the run's number (taken when the memtable was set aside, so runs are numbered oldest first)
+ * @param full    the memtable
+ */
+void LSMIndex::flush(uint number, std::shared_ptr<const LSMMemtable> full) {
+    LSMRunPtr run = std::make_shared<LSMRun>(run_name(number), number, 0);
+    run->create();
+    for (auto const &entry: *full)
+        run->append(entry.first, entry.second);
+    run->finish();
+    std::lock_guard<std::mutex> guard(latch);
+    add_run(run);
+    for (auto immutable = immutables.begin(); immutable != immutables.end(); immutable++)
+        if (immutable->first == number) {
+            immutables.erase(immutable);
+            break;
+        }
+    save_manifest();
+    work.notify_one();
+}
+
+Identifier LSMIndex::run_name(uint number) const {
+    return relation.get_table_name() + "-" + name + "-" + std::to_string(number);
+}
+
+// The level at which runs have about this many entries.
+uint LSMIndex::level_for(u_long entry_count) {
+    uint level = 0;
+    for (u_long size = MEMTABLE_ENTRIES; entry_count > size; size *= FANOUT)
+        level++;
+    return level;
+}
+
+// Put a run into runs, keeping them newest first. Latch must be held.
+void LSMIndex::add_run(LSMRunPtr run) {
+    auto position = runs.begin();
+    while (position != runs.end() && ((*position)->get_level() < run->get_level() ||
+                                      ((*position)->get_level() == run->get_level() &&
+                                       (*position)->get_number() > run->get_number())))
+        position++;
+    runs.insert(position, run);
+}
+
+// Read the manifest and open each of the runs it lists.
+void LSMIndex::load_manifest() {
+    SlottedPage *manifest = file.get(MANIFEST);
+    Dbt *dbt = manifest->get(1);
+    next_number = *(uint32_t *) dbt->get_data();
+    delete dbt;
+    dbt = manifest->get(2);
+    uint32_t *fields = (uint32_t *) dbt->get_data();  // number, level, data blocks, entry count for each run
+    runs.clear();
+    for (u_long i = 0; i < dbt->get_size() / sizeof(uint32_t); i += 4) {
+        LSMRunPtr run = std::make_shared<LSMRun>(run_name(fields[i]), fields[i], fields[i + 1]);
+        run->open(fields[i + 2], fields[i + 3]);
+        add_run(run);
+    }
+    delete dbt;
+    delete manifest;
+}
+
+// Write the next run number and the list of runs to the manifest block. Latch must be held.
+void LSMIndex::save_manifest() {
+    SlottedPage *manifest = file.get(MANIFEST);
+    manifest->clear();
+    uint32_t number = next_number;
+    Dbt number_dbt(&number, sizeof(number));
+    manifest->add(&number_dbt);
+    std::vector<uint32_t> fields;
+    for (auto const &run: runs) {
+        fields.push_back(run->get_number());
+        fields.push_back(run->get_level());
+        fields.push_back(run->get_data_blocks());
+        fields.push_back((uint32_t) run->get_entry_count());
+    }
+    Dbt runs_dbt(fields.data(), (u_int32_t) (fields.size() * sizeof(uint32_t)));
+    manifest->add(&runs_dbt);
+    file.put(manifest);
+    delete manifest;
+}
+
+void LSMIndex::start_compactor() {
+    stopping = false;
+    compactor = std::thread(&LSMIndex::compact_loop, this);
+}
+
+// Stop the compaction thread, letting it finish the merge it is in the middle of.
+void LSMIndex::stop_compactor() {
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        stopping = true;
+    }
+    work.notify_all();
+    if (compactor.joinable())
+        compactor.join();
+}
+
+// The compaction thread: merge runs while there are levels to merge, then wait for flushes to make more.
+void LSMIndex::compact_loop() {
+    std::unique_lock<std::mutex> guard(latch);
+    while (!stopping) {
+        std::vector<LSMRunPtr> inputs;
+        if (!pick_compaction(inputs)) {
+            idle.notify_all();
+            work.wait(guard);
+            continue;
+        }
+        uint level = inputs.front()->get_level() + 1;
+        uint number = next_number++;
+        // tombstones can go once nothing older than the inputs is left for them to hide
+        bool drop_tombstones = runs.back()->get_level() < level;
+        compacting = true;
+        guard.unlock();
+
+        LSMRunPtr output = merge(inputs, number, level, drop_tombstones);
+
+        guard.lock();
+        for (auto const &input: inputs) {
+            input->retire();
+            runs.erase(std::find(runs.begin(), runs.end(), input));
+        }
+        if (output)
+            add_run(output);
+        save_manifest();
+        compacting = false;
+        compactions++;
+    }
+    idle.notify_all();
+}
+
+/**
+ * Choose the runs for the next compaction: the FANOUT oldest runs of the first level that has that many. At level
+ * 0 only runs older than every memtable still being written out can go, so that a merged run is never newer than
+ * a level 0 run to come. Latch must be held.
+ * @param inputs  the chosen runs, newest first
+ * @returns       false if there is nothing to merge
+ */
+bool LSMIndex::pick_compaction(std::vector<LSMRunPtr> &inputs) const {
+    uint oldest_pending = std::numeric_limits<uint>::max();
+    for (auto const &immutable: immutables)
+        oldest_pending = std::min(oldest_pending, immutable.first);
+    for (u_long first = 0, next = 0; first < runs.size(); first = next) {
+        uint level = runs[first]->get_level();
+        inputs.clear();
+        for (next = first; next < runs.size() && runs[next]->get_level() == level; next++)
+            if (level > 0 || runs[next]->get_number() < oldest_pending)
+                inputs.push_back(runs[next]);
+        if (inputs.size() >= FANOUT) {
+            inputs.erase(inputs.begin(), inputs.end() - FANOUT);
+            return true;
+        }
+    }
+    inputs.clear();
+    return false;
+}
+
+/**
+ * Merge runs into one, keeping only the newest version of each entry.
+ * @param inputs           the runs, newest first
+ * @param number           number for the new run
+ * @param level            level for the new run
+ * @param drop_tombstones  leave out tombstones (when there's nothing older for them to hide)
+ * @returns                the new run, or nullptr if it has no entries
+ */
+LSMRunPtr LSMIndex::merge(const std::vector<LSMRunPtr> &inputs, uint number, uint level, bool drop_tombstones) {
+    struct Cursor {
+        LSMRunPtr run;
+        BlockID block_id;
+        std::vector<LSMEntry> entries;
+        u_long next;
+
+        bool done() const { return next == entries.size(); }
+
+        void advance() {
+            if (++next == entries.size() && block_id < run->get_data_blocks()) {
+                entries.clear();
+                run->read(++block_id, entries);
+                next = 0;
+            }
+        }
+    };
+    std::vector<Cursor> cursors;
+    for (auto const &input: inputs) {
+        cursors.push_back(Cursor{input, 1, std::vector<LSMEntry>(), 0});
+        input->read(1, cursors.back().entries);
+    }
+
+    LSMRunPtr output;
+    while (true) {
+        // the smallest entry of any cursor, from the newest run that has it
+        Cursor *newest = nullptr;
+        for (auto &cursor: cursors)
+            if (!cursor.done() && (newest == nullptr || cursor.entries[cursor.next].first < newest->entries[newest->next].first))
+                newest = &cursor;
+        if (newest == nullptr)
+            break;
+        LSMEntry entry = newest->entries[newest->next];
+        for (auto &cursor: cursors)
+            if (!cursor.done() && cursor.entries[cursor.next].first == entry.first)
+                cursor.advance();
+        if (!entry.second && drop_tombstones)
+            continue;
+        if (!output) {
+            output = std::make_shared<LSMRun>(run_name(number), number, level);
+            output->create();
+        }
+        output->append(entry.first, entry.second);
+    }
+    if (output)
+        output->finish();
+    return output;
+}
+
+// Insert rows in scrambled key order into a B-tree and an LSM index, then check the LSM index's lookups and
+// deletes, also after compaction and reopening.
+bool test_lsm_index() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    column_names.push_back("b");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable table("__test_lsm", column_names, column_attributes);
+    table.create();
+    BTreeIntIndex btree_index(table, "btree_ingest", ColumnNames(1, "a"), true);
+    btree_index.create();
+    LSMIndex lsm_index(table, "lsm_ingest", ColumnNames(1, "a"), false);
+    lsm_index.create();
+
+    const int rows = 40 * 1000, prime = 7919;
+    Handles row_handles;
+    ValueDicts row_values;
+    for (int i = 0; i < rows; i++) {
+        ValueDict *row = new ValueDict();
+        (*row)["a"] = Value(i * prime % rows);  // each key once, in no particular order
+        (*row)["b"] = Value("row " + std::to_string(i));
+        row_handles.push_back(table.insert(row));
+        row_values.push_back(row);
+    }
+
+    // time just the index inserts (the rows are already in the table)
+    long usecs[2];
+    DbIndex *indices[] = {&btree_index, &lsm_index};
+    for (int which = 0; which < 2; which++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rows; i++)
+            indices[which]->insert(row_handles[i], row_values[i]);
+        usecs[which] = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+    std::cout << "ingest of " << rows << " rows: btree " << rows * 1000L / usecs[0] << " rows/ms, lsm "
+              << rows * 1000L / usecs[1] << " rows/ms (x" << (double) usecs[0] / usecs[1] << "), "
+              << lsm_index.get_run_count() << " runs" << std::endl;
+
+    // every row is found, and deleted rows aren't, before and after compaction and reopening
+    for (int i = 0; i < rows; i += 10)
+        lsm_index.del(row_handles[i], row_values[i]);
+    bool ok = true;
+    for (int round = 0; round < 3 && ok; round++) {
+        if (round == 1) {
+            lsm_index.wait_for_compaction();
+            ok = lsm_index.get_compaction_count() > 0 && lsm_index.get_run_count() < LSMIndex::FANOUT * 3;
+        } else if (round == 2) {
+            lsm_index.close();
+            lsm_index.open();
+        }
+        ValueDict lookup;
+        for (int i = 0; i < rows && ok; i++) {
+            lookup["a"] = (*row_values[i])["a"];
+            Handles *handles = lsm_index.lookup(&lookup);
+            ok = i % 10 == 0 ? handles->empty() : handles->size() == 1 && handles->front() == row_handles[i];
+            delete handles;
+        }
+        if (!ok)
+            std::cout << "lsm index lookup failed in round " << round << std::endl;
+    }
+
+    // and a key that is in several runs at once (some of its rows deleted): two and a half memtables' worth, so
+    // the last of them haven't filled the memtable again and are still in it
+    ValueDict dup;
+    dup["a"] = Value(-1);
+    dup["b"] = Value("dup");
+    Handles dups;
+    for (u_long i = 0; i < LSMIndex::MEMTABLE_ENTRIES * 5 / 2 && ok; i++) {
+        dups.push_back(table.insert(&dup));
+        lsm_index.insert(dups.back(), &dup);
+    }
+    lsm_index.del(dups[7], &dup);  // by now in a run
+    lsm_index.del(dups.back(), &dup);  // still in the memtable
+    Handles *found = lsm_index.lookup(&dup);
+    ok = ok && found->size() == dups.size() - 2 &&
+         !std::binary_search(found->begin(), found->end(), dups[7]) &&
+         !std::binary_search(found->begin(), found->end(), dups.back());
+    for (u_long i = 0; i + 1 < dups.size() && ok; i += 1000)
+        ok = i == 7 || std::binary_search(found->begin(), found->end(), dups[i]);
+    delete found;
+    if (!ok)
+        std::cout << "lsm index duplicate key lookup failed" << std::endl;
+
+    for (auto const &row: row_values)
+        delete row;
+    lsm_index.drop();
+    btree_index.drop();
+    table.drop();
+    return ok;
+}
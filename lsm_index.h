@@ -0,0 +1,173 @@
+/**
+ * @file lsm_index.h - LSMIndex and LSMRun classes
+ *
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#pragma once
+
+#include <condition_variable>
+#include <thread>
+#include "BTreeNode.h"  // for KeyProfile and the key encoding (BTreeNode::encode_value)
+#include "bloom_filter.h"
+
+typedef std::pair<BTreeKey, Handle> LSMKey;  // entries are ordered by encoded key, then by handle
+typedef std::pair<LSMKey, bool> LSMEntry;  // an entry and whether it is live (false for a tombstone)
+typedef std::map<LSMKey, bool> LSMMemtable;
+
+/**
+ * @class LSMRun - one sorted, immutable run of an LSM index, in a heap file of its own.
+ *
+ * Blocks 1 to data_blocks hold the entries in LSMKey order, as many to a block as fit:
+ *      4 bytes block id + 2 bytes record id (the handle), 1 byte live (0 for a tombstone), then the encoded key
+ * The blocks after those hold the fence keys (the first key of each data block), which are kept in memory so that
+ * a lookup reads only the blocks its key can be in. Each run also has a BloomFilter over its keys.
+ * A run that compaction has replaced is retired; its files are dropped when the last lookup using it lets go.
+ */
+class LSMRun {
+public:
+    LSMRun(Identifier name, uint number, uint level);
+
+    virtual ~LSMRun();
+
+    void create();  // then append the entries in order, then finish
+
+    void append(const LSMKey &key, bool live);
+
+    void finish();
+
+    void open(BlockID data_blocks, u_long entry_count);
+
+    void close();
+
+    void retire() { this->retired = true; }
+
+    void find(const BTreeKey &key, std::map<Handle, bool> &seen) const;
+
+    void read(BlockID block_id, std::vector<LSMEntry> &entries) const;
+
+    uint get_number() const { return this->number; }
+
+    uint get_level() const { return this->level; }
+
+    BlockID get_data_blocks() const { return this->data_blocks; }
+
+    u_long get_entry_count() const { return this->entry_count; }
+
+protected:
+    static const u_int32_t KEY_OFFSET = sizeof(BlockID) + sizeof(RecordID) + 1;
+
+    HeapFile file;
+    BloomFilter filter;
+    uint number;
+    uint level;
+    BlockID data_blocks;
+    u_long entry_count;
+    BTreeKeys fences;  // first key of each data block
+    bool retired;
+
+    // while the run is being written
+    SlottedPage *block;
+    std::vector<std::string> keys;
+};
+
+typedef std::shared_ptr<LSMRun> LSMRunPtr;
+
+/**
+ * @class LSMIndex - log-structured merge tree index, for tables that take many more inserts than lookups.
+ *
+ * Inserts and deletes go into an in-memory memtable (a delete as a tombstone), so they cost no I/O at all. When the
+ * memtable has MEMTABLE_ENTRIES entries it is written out, in one sequential pass, as a sorted run at level 0.
+ * A compaction thread merges the FANOUT oldest runs of a level into one run at the next level, keeping only the
+ * newest version of each entry and dropping tombstones once there is nothing older left for them to hide. A lookup
+ * looks in the memtable and then in each run, newest first; the runs' Bloom filters keep it from reading the
+ * ones that can't have the key.
+ *
+ * Block 1 of the index's own file is the manifest: the next run number and the runs there are. The memtable is
+ * only written out when it fills up or the index is closed. Duplicate keys are allowed; LSM indices can't be
+ * unique (checking would take a lookup per insert).
+ */
+class LSMIndex : public DbIndex {
+public:
+    static const u_long MEMTABLE_ENTRIES = 4096;
+    static const uint FANOUT = 4;
+
+    LSMIndex(DbRelation &relation, Identifier name, ColumnNames key_columns, bool unique);
+
+    virtual ~LSMIndex();
+
+    virtual void create();
+
+    virtual void create(const Handles *handles, const ValueDicts *rows);
+
+    virtual void drop();
+
+    virtual void open();
+
+    virtual void close();
+
+    virtual Handles *lookup(ValueDict *key) const;
+
+    virtual void insert(Handle handle);
+
+    virtual void insert(Handle handle, const ValueDict *row);
+
+    virtual void del(Handle handle);
+
+    virtual void del(Handle handle, const ValueDict *row);
+
+    virtual BTreeKey tkey(const ValueDict *key) const; // encode the key columns of the ValueDict in order
+
+    void wait_for_compaction();  // until no level has FANOUT runs to merge
+
+    uint get_run_count() const;
+
+    u_long get_compaction_count() const { return this->compactions; }
+
+protected:
+    static const BlockID MANIFEST = 1;
+
+    bool closed;
+    HeapFile file;
+    KeyProfile key_profile;
+    uint next_number;  // for the next run
+    std::shared_ptr<LSMMemtable> memtable;
+    std::vector<std::pair<uint, std::shared_ptr<const LSMMemtable>>> immutables;  // being written out, newest first
+    std::vector<LSMRunPtr> runs;  // newest first: by level, then highest number first
+    mutable std::mutex latch;  // guards all of the above
+    std::condition_variable work;  // the compaction thread waits on this for runs to merge (or to stop)
+    std::condition_variable idle;  // and signals this when it has nothing left to do
+    std::thread compactor;
+    bool stopping;
+    bool compacting;
+    std::atomic<u_long> compactions;
+
+    void create_empty();
+
+    void bulk_load(std::vector<LSMEntry> &entries);
+
+    void put(const BTreeKey &key, Handle handle, bool live);
+
+    void flush(uint number, std::shared_ptr<const LSMMemtable> full);
+
+    Identifier run_name(uint number) const;
+
+    static uint level_for(u_long entry_count);
+
+    void add_run(LSMRunPtr run);
+
+    void load_manifest();
+
+    void save_manifest();
+
+    void start_compactor();
+
+    void stop_compactor();
+
+    void compact_loop();
+
+    bool pick_compaction(std::vector<LSMRunPtr> &inputs) const;
+
+    LSMRunPtr merge(const std::vector<LSMRunPtr> &inputs, uint number, uint level, bool drop_tombstones);
+};
+
+bool test_lsm_index();
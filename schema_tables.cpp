@@ -6,6 +6,8 @@
 #include "schema_tables.h"
 #include "ParseTreeToString.h"
 #include "btree.h"
+#include "hash_index.h"
+#include "lsm_index.h"
 
 
 void initialize_schema_tables() {
@@ -18,6 +20,9 @@ void initialize_schema_tables() {
     Indices indices;
     indices.create_if_not_exists();
     indices.close();
+    Statistics statistics;
+    statistics.create_if_not_exists();
+    statistics.close();
 
 }
 
@@ -87,6 +92,8 @@ void Tables::create() {
     insert(&row);
     row["table_name"] = Value("_indices");
     insert(&row);
+    row["table_name"] = Value("_statistics");
+    insert(&row);
 }
 
 // Manually check that table_name is unique.
@@ -230,6 +237,24 @@ void Columns::create() {
     row["column_name"] = Value("is_unique");
     row["data_type"] = Value("BOOLEAN");
     insert(&row);
+
+    row["table_name"] = Value("_statistics");
+    row["data_type"] = Value("TEXT");
+    row["column_name"] = Value("table_name");
+    insert(&row);
+    row["column_name"] = Value("column_name");
+    insert(&row);
+    row["column_name"] = Value("value");
+    insert(&row);
+    row["data_type"] = Value("INT");
+    row["column_name"] = Value("bucket");
+    insert(&row);
+    row["column_name"] = Value("row_count");
+    insert(&row);
+    row["column_name"] = Value("distinct_count");
+    insert(&row);
+    row["column_name"] = Value("page_count");
+    insert(&row);
 }
 
 // Manually check that (table_name, column_name) is unique.
@@ -313,7 +338,7 @@ Handle Indices::insert(const ValueDict *row) {
     ValueDict where;
     where["table_name"] = row->at("table_name");
     where["index_name"] = row->at("index_name");
-    if (row->at("seq_in_index").n > 1)
+    if (row->at("seq_in_index").n != 1)
         where["column_name"] = row->at("column_name");  // check for duplicate columns on the same index
     Handles *handles = select(&where);
     bool unique = handles->empty();
@@ -341,8 +366,8 @@ void Indices::del(Handle handle) {
 }
 
 // Return a list of column names and column attributes for given table.
-void Indices::get_columns(Identifier table_name, Identifier index_name, ColumnNames &column_names, bool &is_hash,
-                          bool &is_unique) {
+void Indices::get_columns(Identifier table_name, Identifier index_name, ColumnNames &column_names,
+                          Identifier &index_type, bool &is_unique, ColumnNames *include_columns) {
     // SELECT * FROM _indices WHERE table_name = <table_name> AND index_name = <index_name>
     ValueDict where;
     where["table_name"] = table_name;
@@ -350,45 +375,37 @@ void Indices::get_columns(Identifier table_name, Identifier index_name, ColumnNa
     Handles *handles = select(&where);
 
     Identifier colnames[DbIndex::MAX_COMPOSITE];
-    uint size = 0;
+    Identifier include_colnames[DbIndex::MAX_COMPOSITE];
+    uint size = 0, include_size = 0;
     for (auto const &handle: *handles) {
         ValueDict *row = project(handle);
 
         Identifier column_name = (*row)["column_name"].s;
-        uint which = (uint) (*row)["seq_in_index"].n;
-        colnames[which - 1] = column_name;  // seq_in_index is 1-based
-        if (which > size)
-            size = which;
+        int seq = (*row)["seq_in_index"].n;
+        if (seq < 0) {
+            // included (non-key) columns are numbered -1, -2, ...
+            uint which = (uint) -seq;
+            include_colnames[which - 1] = column_name;
+            if (which > include_size)
+                include_size = which;
+        } else {
+            uint which = (uint) seq;
+            colnames[which - 1] = column_name;  // seq_in_index is 1-based
+            if (which > size)
+                size = which;
+        }
         is_unique = (*row)["is_unique"].n != 0;
-        is_hash = (*row)["index_type"].s == "HASH";
+        index_type = (*row)["index_type"].s;
         delete row;
     }
     for (uint i = 0; i < size; i++)
         column_names.push_back(colnames[i]);
+    if (include_columns != nullptr)
+        for (uint i = 0; i < include_size; i++)
+            include_columns->push_back(include_colnames[i]);
     delete handles;
 }
 
-// FIXME - use this for now until we have BTreeIndex and HashIndex
-class DummyIndex : public DbIndex {
-public:
-    DummyIndex(DbRelation &rel, Identifier idx, ColumnNames key, bool unq) : DbIndex(rel, idx, key, unq) {}
-
-    void create() {}
-
-    void drop() {}
-
-    void open() {}
-
-    void close() {}
-
-    Handles *lookup(ValueDict *key_values) const { return nullptr; }
-
-    void insert(Handle handle) {}
-
-    void del(Handle handle) {}
-};
-
-
 // Return a table for given table_name.
 DbIndex &Indices::get_index(Identifier table_name, Identifier index_name) {
     // if they are asking about an index we've once constructed, then just return that one
@@ -396,21 +413,37 @@ DbIndex &Indices::get_index(Identifier table_name, Identifier index_name) {
     if (Indices::index_cache.find(cache_key) != Indices::index_cache.end())
         return *Indices::index_cache[cache_key];
 
-    // otherwise assume it is a DummyIndex (for now)
-    ColumnNames column_names;
-    bool is_hash, is_unique;
-    get_columns(table_name, index_name, column_names, is_hash, is_unique);
+    // otherwise construct it from what the schema says
+    ColumnNames column_names, include_columns;
+    Identifier index_type;
+    bool is_unique;
+    get_columns(table_name, index_name, column_names, index_type, is_unique, &include_columns);
     DbRelation &table = Tables::get_table(table_name);
     DbIndex *index;
-    if (is_hash) {
-        index = new DummyIndex(table, index_name, column_names, is_unique);  // FIXME - change to HashIndex
+    if (index_type == "HASH") {
+        index = new HashIndex(table, index_name, column_names, is_unique);
+    } else if (index_type == "LSM") {
+        index = new LSMIndex(table, index_name, column_names, is_unique);
     } else {
-        index = new BTreeIndex(table, index_name, column_names, is_unique);
+        // a key that is just one INT gets the specialized tree
+        ColumnAttributes *column_attributes = table.get_column_attributes(column_names);
+        bool int_key = column_names.size() == 1 && (*column_attributes)[0].get_data_type() == ColumnAttribute::INT;
+        delete column_attributes;
+        if (int_key)
+            index = new BTreeIntIndex(table, index_name, column_names, is_unique, include_columns);
+        else
+            index = new BTreeIndex(table, index_name, column_names, is_unique, include_columns);
     }
     Indices::index_cache[cache_key] = index;
     return *index;
 }
 
+// Close every index we've constructed (so that those holding entries in memory write them out).
+void Indices::close_all() {
+    for (auto const &cached: Indices::index_cache)
+        cached.second->close();
+}
+
 IndexNames Indices::get_index_names(Identifier table_name) {
     IndexNames ret;
     ValueDict where;
@@ -426,3 +459,154 @@ IndexNames Indices::get_index_names(Identifier table_name) {
     return ret;
 }
 
+
+
+/*
+ * *******************************
+ * Statistics class implementation
+ * *******************************
+ */
+const Identifier Statistics::TABLE_NAME = "_statistics";
+std::map<Identifier, TableStatistics> Statistics::stats_cache;
+
+// get the column name for _statistics column
+ColumnNames &Statistics::COLUMN_NAMES() {
+    static ColumnNames cn;
+    if (cn.empty()) {
+        cn.push_back("table_name");
+        cn.push_back("column_name");
+        cn.push_back("bucket");
+        cn.push_back("row_count");
+        cn.push_back("distinct_count");
+        cn.push_back("page_count");
+        cn.push_back("value");
+    }
+    return cn;
+}
+
+// get the column attribute for _statistics column
+ColumnAttributes &Statistics::COLUMN_ATTRIBUTES() {
+    static ColumnAttributes cas;
+    if (cas.empty()) {
+        ColumnAttribute ca(ColumnAttribute::TEXT);
+        cas.push_back(ca);  // table_name
+        cas.push_back(ca);  // column_name
+        ca.set_data_type(ColumnAttribute::INT);
+        cas.push_back(ca);  // bucket
+        cas.push_back(ca);  // row_count
+        cas.push_back(ca);  // distinct_count
+        cas.push_back(ca);  // page_count
+        ca.set_data_type(ColumnAttribute::TEXT);
+        cas.push_back(ca);  // value
+    }
+    return cas;
+}
+
+// ctor - we have a fixed table structure
+Statistics::Statistics() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
+}
+
+// Delete the table's rows, then write one for the table, and for each column its summary and histogram buckets.
+void Statistics::save(Identifier table_name, const TableStatistics &stats) {
+    forget(table_name);
+    ValueDict row;
+    row["table_name"] = Value(table_name);
+    row["column_name"] = Value("*");
+    row["bucket"] = Value(0);
+    row["row_count"] = Value((int32_t) stats.get_row_count());
+    row["distinct_count"] = Value(0);
+    row["page_count"] = Value((int32_t) stats.get_page_count());
+    row["value"] = Value("");
+    insert(&row);
+    row["page_count"] = Value(0);
+    for (auto const &column: stats.get_columns()) {
+        const ColumnStatistics &column_stats = column.second;
+        row["column_name"] = Value(column.first);
+        row["bucket"] = Value(0);
+        row["row_count"] = Value((int32_t) column_stats.get_row_count());
+        row["distinct_count"] = Value((int32_t) column_stats.get_distinct_count());
+        const Value &low = column_stats.get_low();
+        row["value"] = Value(low.data_type == ColumnAttribute::TEXT ? low.s : std::to_string(low.n));
+        insert(&row);
+        int32_t bucket_number = 0;
+        for (auto const &bucket: column_stats.get_histogram()) {
+            row["bucket"] = Value(++bucket_number);
+            row["row_count"] = Value((int32_t) bucket.row_count);
+            row["distinct_count"] = Value((int32_t) bucket.distinct_count);
+            const Value &upper = bucket.upper;
+            row["value"] = Value(upper.data_type == ColumnAttribute::TEXT ? upper.s : std::to_string(upper.n));
+            insert(&row);
+        }
+    }
+    Statistics::stats_cache[table_name] = stats;
+}
+
+// Read the table's rows back into TableStatistics (once; after that they come from the cache).
+bool Statistics::load(DbRelation &table, TableStatistics &stats) {
+    Identifier table_name = table.get_table_name();
+    if (Statistics::stats_cache.find(table_name) != Statistics::stats_cache.end()) {
+        stats = Statistics::stats_cache[table_name];
+        return true;
+    }
+
+    // SELECT * FROM _statistics WHERE table_name = <table_name>
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    Handles *handles = select(&where);
+    std::map<Identifier, std::map<int32_t, ValueDict *>> columns;  // by column name, then bucket
+    for (auto const &handle: *handles) {
+        ValueDict *row = project(handle);
+        columns[(*row)["column_name"].s][(*row)["bucket"].n] = row;
+    }
+    delete handles;
+    bool found = columns.find("*") != columns.end();
+    if (found) {
+        ValueDict *table_row = columns["*"][0];
+        stats = TableStatistics((u_long) (*table_row)["row_count"].n, (u_long) (*table_row)["page_count"].n);
+        const ColumnNames &column_names = table.get_column_names();
+        ColumnAttributes *column_attributes = table.get_column_attributes(column_names);
+        for (uint i = 0; i < column_names.size(); i++) {
+            auto rows = columns.find(column_names[i]);
+            if (rows == columns.end())
+                continue;  // a column added since the table was analyzed
+            ColumnAttribute::DataType data_type = (*column_attributes)[i].get_data_type();
+            Value low;
+            Histogram histogram;
+            for (auto const &bucket: rows->second) {
+                std::string text = (*bucket.second)["value"].s;
+                Value value;
+                if (data_type == ColumnAttribute::TEXT) {
+                    value = Value(text);
+                } else {
+                    value = Value((int32_t) std::stol(text));
+                    value.data_type = data_type;
+                }
+                if (bucket.first == 0)
+                    low = value;
+                else
+                    histogram.push_back(HistogramBucket(value, (u_long) (*bucket.second)["row_count"].n,
+                                                        (u_long) (*bucket.second)["distinct_count"].n));
+            }
+            ValueDict *summary = rows->second[0];
+            stats.set_column(column_names[i], ColumnStatistics((u_long) (*summary)["row_count"].n,
+                                                               (u_long) (*summary)["distinct_count"].n,
+                                                               low, histogram));
+        }
+        delete column_attributes;
+        Statistics::stats_cache[table_name] = stats;
+    }
+    for (auto const &column: columns)
+        for (auto const &bucket: column.second)
+            delete bucket.second;
+    return found;
+}
+
+void Statistics::forget(Identifier table_name) {
+    Statistics::stats_cache.erase(table_name);
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    Handles *handles = select(&where);
+    for (auto const &handle: *handles)
+        del(handle);
+    delete handles;
+}
@@ -8,6 +8,7 @@
 #pragma once
 
 #include "heap_storage.h"
+#include "statistics.h"
 
 /**
  * Initialize access to the schema tables.
@@ -122,12 +123,13 @@ public:
      * @param index_name      name of index (unique by table)
      * @param column_names    returned by reference: list of column names
      *                        in search key in order
-     * @param is_hash         returned by reference: set to False if the
-     *                        requested index is a btree index
+     * @param index_type      returned by reference: BTREE, HASH or LSM
      * @param is_unique       search key for this index is a key for the relation
+     * @param include_columns if given, returned by reference: list of non-key
+     *                        columns stored in the index (INCLUDE clause)
      */
-    virtual void get_columns(Identifier table_name, Identifier index_name, ColumnNames &column_names, bool &is_hash,
-                             bool &is_unique);
+    virtual void get_columns(Identifier table_name, Identifier index_name, ColumnNames &column_names,
+                             Identifier &index_type, bool &is_unique, ColumnNames *include_columns = nullptr);
 
     /**
      * Get the instantiated DbIndex for the given index.
@@ -137,6 +139,11 @@ public:
      */
     virtual DbIndex &get_index(Identifier table_name, Identifier index_name);
 
+    /**
+     * Close all the indices that have been opened, as on shutting down; an LSM index writes out its memtable.
+     */
+    static void close_all();
+
     /**
      * Get the list of indices on a given table.
      * @param table_name  which table to lookup the indices on
@@ -158,3 +165,51 @@ private:
     static std::map<std::pair<Identifier, Identifier>, DbIndex *> index_cache;
 };
 
+
+/**
+ * @class Statistics - The singleton table that stores what ANALYZE found out about each table, for the optimizer.
+ * Each analyzed table has a row for the whole table (column_name "*": row and page counts), and for each column a
+ * row with bucket 0 (row and distinct counts, and the lowest value) followed by a row per histogram bucket (rows,
+ * distinct values and upper bound). Values are kept as text and read back using the column's data type.
+ */
+class Statistics : public HeapTable {
+public:
+    /**
+     * Name of the statistics table ("_statistics")
+     */
+    static const Identifier TABLE_NAME;
+
+    // ctor/dtor
+    Statistics();
+
+    virtual ~Statistics() {}
+
+    /**
+     * Store statistics for a table, replacing any it already had.
+     * @param table_name  table the statistics are for
+     * @param stats       the statistics
+     */
+    virtual void save(Identifier table_name, const TableStatistics &stats);
+
+    /**
+     * Get the statistics for a table.
+     * @param table  table to get them for
+     * @param stats  returned by reference: the statistics
+     * @returns      false if the table has never been analyzed
+     */
+    virtual bool load(DbRelation &table, TableStatistics &stats);
+
+    /**
+     * Remove any statistics for a table (when it is dropped).
+     * @param table_name  table to forget
+     */
+    virtual void forget(Identifier table_name);
+
+protected:
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+
+private:
+    static std::map<Identifier, TableStatistics> stats_cache;
+};
@@ -10,7 +10,11 @@
 #include "SQLParser.h"
 #include "ParseTreeToString.h"
 #include "SQLExec.h"
+#include "EvalPlan.h"
 #include "btree.h"
+#include "hash_index.h"
+#include "lsm_index.h"
+#include "statistics.h"
 
 using namespace std;
 using namespace hsql;
@@ -41,11 +45,31 @@ int main(int argc, char *argv[]) {
         getline(cin, query);
         if (query.length() == 0)
             continue;  // blank line -- just skip
-        if (query == "quit")
+        if (query == "quit") {
+            Indices::close_all();  // indices may have entries only in memory
             break;  // only way to get out
+        }
         if (query == "test") {
             cout << "test_heap_storage: " << (test_heap_storage() ? "ok" : "failed") << endl;
             cout << "test_btree: " << (test_btree() ? "ok" : "failed") << endl;
+            cout << "test_hash_index: " << (test_hash_index() ? "ok" : "failed") << endl;
+            cout << "test_lsm_index: " << (test_lsm_index() ? "ok" : "failed") << endl;
+            cout << "test_eval_plan: " << (test_eval_plan() ? "ok" : "failed") << endl;
+            cout << "test_statistics: " << (test_statistics() ? "ok" : "failed") << endl;
+            continue;
+        }
+
+        // our extensions to SQL come off before parsing (or get handled entirely)
+        QueryOptions options;
+        try {
+            QueryResult *result = SQLExec::preprocess(query, options);
+            if (result != nullptr) {
+                cout << *result << endl;
+                delete result;
+                continue;
+            }
+        } catch (SQLExecError &e) {
+            cout << "Error: " << e.what() << endl;
             continue;
         }
 
@@ -54,12 +78,15 @@ int main(int argc, char *argv[]) {
         if (!parse->isValid()) {
             cout << "invalid SQL: " << query << endl;
             cout << parse->errorMsg() << endl;
+        } else if (parse->size() > 1 && !options.empty()) {
+            // the clauses came off the line as a whole, so we can't tell which statement they were on
+            cout << "Error: EXPLAIN, USING LSM, INCLUDE and WITH BLOOM need their statement on a line of its own" << endl;
         } else {
             for (uint i = 0; i < parse->size(); ++i) {
                 const SQLStatement *statement = parse->getStatement(i);
                 try {
                     cout << ParseTreeToString::statement(statement) << endl;
-                    QueryResult *result = SQLExec::execute(statement);
+                    QueryResult *result = SQLExec::execute(statement, options);
                     cout << *result << endl;
                     delete result;
                 } catch (SQLExecError &e) {
@@ -81,7 +108,7 @@ void initialize_environment(char *envHome) {
     env->set_message_stream(&cout);
     env->set_error_stream(&cerr);
     try {
-        env->open(envHome, DB_CREATE | DB_INIT_MPOOL, 0);
+        env->open(envHome, DB_CREATE | DB_INIT_MPOOL | DB_THREAD, 0);  // indices may be used from several threads
     } catch (DbException &exc) {
         cerr << "(sql5300: " << exc.what() << ")" << endl;
         exit(1);
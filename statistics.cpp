@@ -0,0 +1,185 @@
+/**
+ * @file statistics.cpp - implementation of ColumnStatistics and TableStatistics
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#include <algorithm>
+#include <cmath>
+#include "statistics.h"
+#include "heap_storage.h"
+#include "schema_tables.h"
+
+/**
+ * Build the histogram. Buckets get about row_count / BUCKETS rows each; a bucket that would end partway through a
+ * run of equal values takes in the rest of the run, so a value that is in many rows gets a bucket to itself.
+ * @param values  the column's value in every row (sorted in place)
+ */
+void ColumnStatistics::build(std::vector<Value> &values) {
+    std::sort(values.begin(), values.end());
+    this->row_count = values.size();
+    this->distinct_count = 0;
+    this->histogram.clear();
+    if (values.empty())
+        return;
+    this->low = values.front();
+    u_long target = (values.size() + BUCKETS - 1) / BUCKETS;
+    for (u_long first = 0; first < values.size();) {
+        u_long last = std::min(first + target, (u_long) values.size()) - 1;
+        while (last + 1 < values.size() && values[last + 1] == values[last])
+            last++;
+        u_long distinct = 1;
+        for (u_long i = first + 1; i <= last; i++)
+            if (values[i] != values[i - 1])
+                distinct++;
+        this->histogram.push_back(HistogramBucket(values[last], last - first + 1, distinct));
+        this->distinct_count += distinct;
+        first = last + 1;
+    }
+}
+
+// Rows with a value are taken to be spread evenly over the distinct values in its bucket.
+double ColumnStatistics::equal_selectivity(const Value &value) const {
+    if (this->row_count == 0 || value.data_type != this->low.data_type || value < this->low)
+        return 0.0;
+    for (auto const &bucket: this->histogram)
+        if (!(bucket.upper < value))
+            return (double) bucket.row_count / bucket.distinct_count / this->row_count;
+    return 0.0;  // above the highest value
+}
+
+// Each bucket counts for the part of it inside the range (interpolated for INT and BOOLEAN, half for TEXT).
+double ColumnStatistics::range_selectivity(const Value *min_value, const Value *max_value) const {
+    if (this->row_count == 0 ||
+        (min_value != nullptr && min_value->data_type != this->low.data_type) ||
+        (max_value != nullptr && max_value->data_type != this->low.data_type))
+        return 0.0;
+    double rows = 0.0;
+    Value lower = this->low;
+    for (auto const &bucket: this->histogram) {
+        double from = min_value == nullptr ? 0.0 : fraction_below(*min_value, lower, bucket.upper);
+        double to;
+        if (max_value == nullptr || !(*max_value < bucket.upper)) {
+            to = 1.0;
+        } else if (max_value->data_type != ColumnAttribute::TEXT) {
+            Value above = *max_value;  // <= max is < max + 1
+            above.n++;
+            to = fraction_below(above, lower, bucket.upper);
+        } else {
+            to = *max_value < lower ? 0.0 : 0.5;
+        }
+        if (to > from)
+            rows += (to - from) * bucket.row_count;
+        lower = bucket.upper;
+    }
+    return std::min(1.0, rows / this->row_count);
+}
+
+// About what fraction of a bucket running from low to high has values below the given one.
+double ColumnStatistics::fraction_below(const Value &value, const Value &low, const Value &high) {
+    if (!(low < value))
+        return 0.0;
+    if (high < value)
+        return 1.0;
+    if (value.data_type == ColumnAttribute::TEXT)
+        return 0.5;
+    return (double) ((int64_t) value.n - low.n) / ((int64_t) high.n - low.n + 1);
+}
+
+/**
+ * Read the whole table, a block at a time, counting rows and collecting each column's values for its histogram.
+ * @param table  the table to analyze
+ */
+void TableStatistics::analyze(DbRelation &table) {
+    const ColumnNames &column_names = table.get_column_names();
+    std::vector<std::vector<Value>> values(column_names.size());
+    this->row_count = 0;
+    this->page_count = table.get_block_count();
+    for (BlockID block_id = 1; block_id <= this->page_count; block_id++) {
+        ValueDicts *rows = table.project_block(block_id);
+        for (auto const &row: *rows) {
+            for (uint i = 0; i < column_names.size(); i++)
+                values[i].push_back(row->at(column_names[i]));
+            this->row_count++;
+            delete row;
+        }
+        delete rows;
+    }
+    this->columns.clear();
+    for (uint i = 0; i < column_names.size(); i++)
+        this->columns[column_names[i]].build(values[i]);
+}
+
+// The columns are taken to be independent, so the selectivities multiply.
+double TableStatistics::selectivity(const ValueDict *conjunction) const {
+    double selectivity = 1.0;
+    for (auto const &term: *conjunction) {
+        auto column = this->columns.find(term.first);
+        if (column == this->columns.end())
+            selectivity *= DEFAULT_SELECTIVITY;
+        else
+            selectivity *= column->second.equal_selectivity(term.second);
+    }
+    return selectivity;
+}
+
+// Histograms follow the data (skew and all), and statistics make it through the catalog unchanged.
+bool test_statistics() {
+    ColumnNames column_names;
+    column_names.push_back("id");
+    column_names.push_back("grp");
+    column_names.push_back("name");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable table("__test_statistics", column_names, column_attributes);
+    table.create();
+    const int rows = 10 * 1000;
+    for (int i = 0; i < rows; i++) {
+        ValueDict row;
+        row["id"] = Value(i);
+        row["grp"] = Value(i % 10 == 0 ? 1 + (i / 10) % 100 : 0);  // 0 in 90% of rows, 1 to 100 in 10 rows each
+        row["name"] = Value("name " + std::to_string(i % 500));
+        table.insert(&row);
+    }
+
+    TableStatistics stats;
+    stats.analyze(table);
+    const ColumnStatistics &id = stats.get_columns().at("id");
+    const ColumnStatistics &grp = stats.get_columns().at("grp");
+    const ColumnStatistics &name = stats.get_columns().at("name");
+    bool ok = stats.get_row_count() == (u_long) rows && stats.get_page_count() == table.get_block_count() &&
+              id.get_distinct_count() == (u_long) rows && grp.get_distinct_count() == 101 &&
+              name.get_distinct_count() == 500 && id.get_histogram().size() == ColumnStatistics::BUCKETS;
+    if (!ok)
+        std::cout << "statistics counts failed" << std::endl;
+
+    Value low(1000), high(2999), none(-1);
+    ok = ok && std::abs(grp.equal_selectivity(Value(0)) - 0.9) < 1e-9 &&
+         std::abs(grp.equal_selectivity(Value(5)) - 0.001) < 1e-9 &&
+         grp.equal_selectivity(Value(1000)) == 0.0 &&
+         std::abs(name.equal_selectivity(Value("name 7")) - 0.002) < 0.001 &&
+         std::abs(id.range_selectivity(&low, &high) - 0.2) < 0.01 &&
+         std::abs(id.range_selectivity(&low, nullptr) - 0.9) < 0.01 &&
+         id.range_selectivity(nullptr, &none) == 0.0;
+    ValueDict where;
+    where["grp"] = Value(0);
+    where["id"] = Value(5);
+    ok = ok && std::abs(stats.selectivity(&where) - 0.9 / rows) < 1e-9;
+    if (!ok)
+        std::cout << "statistics estimates failed" << std::endl;
+
+    Statistics catalog;
+    catalog.save("__test_statistics", stats);
+    TableStatistics loaded;
+    ok = ok && catalog.load(table, loaded) && loaded.get_row_count() == stats.get_row_count() &&
+         loaded.get_page_count() == stats.get_page_count() &&
+         loaded.get_columns().at("name").get_distinct_count() == 500 &&
+         loaded.get_columns().at("grp").equal_selectivity(Value(5)) == grp.equal_selectivity(Value(5)) &&
+         loaded.get_columns().at("id").range_selectivity(&low, &high) == id.range_selectivity(&low, &high);
+    catalog.forget("__test_statistics");
+    ok = ok && !catalog.load(table, loaded);
+    if (!ok)
+        std::cout << "statistics catalog failed" << std::endl;
+    table.drop();
+    return ok;
+}
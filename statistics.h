@@ -0,0 +1,106 @@
+/**
+ * @file statistics.h - ColumnStatistics and TableStatistics classes
+ *
+ * @see "Seattle University, CPSC5300, Spring 2020"
+ */
+#pragma once
+
+#include "storage_engine.h"
+
+/**
+ * @class HistogramBucket - the rows whose value in a column is above the previous bucket's upper bound (or the
+ * column's lowest value, for the first bucket) and no higher than this bucket's.
+ */
+class HistogramBucket {
+public:
+    HistogramBucket() : upper(), row_count(0), distinct_count(0) {}
+
+    HistogramBucket(Value upper, u_long row_count, u_long distinct_count) : upper(upper), row_count(row_count),
+                                                                            distinct_count(distinct_count) {}
+
+    Value upper;
+    u_long row_count;
+    u_long distinct_count;
+};
+
+typedef std::vector<HistogramBucket> Histogram;
+
+/**
+ * @class ColumnStatistics - what ANALYZE found out about the values of one column: how many different ones there
+ * are and an equi-depth histogram of them. Each bucket holds about the same number of rows, so buckets are narrow
+ * where values are common and wide where they are rare, and a value never straddles two buckets.
+ */
+class ColumnStatistics {
+public:
+    static const uint BUCKETS = 20;
+
+    ColumnStatistics() : row_count(0), distinct_count(0), low(), histogram() {}
+
+    ColumnStatistics(u_long row_count, u_long distinct_count, Value low, Histogram histogram) :
+            row_count(row_count), distinct_count(distinct_count), low(low), histogram(histogram) {}
+
+    virtual ~ColumnStatistics() {}
+
+    void build(std::vector<Value> &values);  // from every row's value (sorts them)
+
+    double equal_selectivity(const Value &value) const;  // fraction of rows with the value
+
+    // fraction of rows with a value from min_value to max_value, inclusive (nullptr for no bound)
+    double range_selectivity(const Value *min_value, const Value *max_value) const;
+
+    u_long get_row_count() const { return this->row_count; }
+
+    u_long get_distinct_count() const { return this->distinct_count; }
+
+    const Value &get_low() const { return this->low; }
+
+    const Histogram &get_histogram() const { return this->histogram; }
+
+protected:
+    u_long row_count;
+    u_long distinct_count;
+    Value low;  // lowest value (the first bucket's lower bound)
+    Histogram histogram;
+
+    static double fraction_below(const Value &value, const Value &low, const Value &high);
+};
+
+/**
+ * @class TableStatistics - row and block counts for a table and ColumnStatistics for each of its columns, as of
+ * the last time it was analyzed. Nothing keeps them up to date in between; estimates drift as the table changes.
+ */
+class TableStatistics {
+public:
+    static constexpr double DEFAULT_SELECTIVITY = 0.1;  // for a column we know nothing about
+    static constexpr double DEFAULT_RANGE_SELECTIVITY = 1.0 / 3;  // for a range on such a column
+
+    TableStatistics() : row_count(0), page_count(0), columns() {}
+
+    TableStatistics(u_long row_count, u_long page_count) : row_count(row_count), page_count(page_count),
+                                                           columns() {}
+
+    virtual ~TableStatistics() {}
+
+    void analyze(DbRelation &table);  // one pass over the whole table
+
+    double selectivity(const ValueDict *conjunction) const;  // fraction of rows with all of the values
+
+    u_long get_row_count() const { return this->row_count; }
+
+    u_long get_page_count() const { return this->page_count; }
+
+    const std::map<Identifier, ColumnStatistics> &get_columns() const { return this->columns; }
+
+    void set_column(const Identifier &column_name, const ColumnStatistics &column) {
+        this->columns[column_name] = column;
+    }
+
+protected:
+    u_long row_count;
+    u_long page_count;
+    std::map<Identifier, ColumnStatistics> columns;
+};
+
+typedef std::map<Identifier, TableStatistics> TableStatisticsMap;  // by table name
+
+bool test_statistics();
@@ -4,6 +4,7 @@
  * @see "Seattle University, CPSC5300, Spring 2020"
  */
 #include <algorithm>
+#include <thread>
 #include "storage_engine.h"
 
 bool Value::operator==(const Value &other) const {
@@ -98,3 +99,119 @@ ValueDicts *DbRelation::project(Handles *handles, const ValueDict *where) {
         ret->push_back(project(handle, &t));
     return ret;
 }
+
+ColumnBatch::ColumnBatch(const ColumnNames &column_names, const ColumnAttributes &column_attributes) :
+        column_names(column_names), data_types(), int_columns(column_names.size()),
+        text_columns(column_names.size()), selection(), row_count(0) {
+    for (ColumnAttribute column_attribute: column_attributes)
+        this->data_types.push_back(column_attribute.get_data_type());
+}
+
+int ColumnBatch::column_index(const Identifier &column_name) const {
+    for (uint column = 0; column < this->column_names.size(); column++)
+        if (this->column_names[column] == column_name)
+            return (int) column;
+    return -1;
+}
+
+// Empty the batch (keeping the columns, and the vectors' memory for the next batch).
+void ColumnBatch::clear() {
+    for (auto &values: this->int_columns)
+        values.clear();
+    for (auto &values: this->text_columns)
+        values.clear();
+    this->selection.clear();
+    this->row_count = 0;
+}
+
+/**
+ * Projection: make this batch input's rows, but with just this batch's columns. Whole column vectors are swapped
+ * over (input gets this batch's old ones, to reuse), so no row is touched.
+ * @param input  a batch with (at least) all of this batch's columns
+ */
+void ColumnBatch::project_from(ColumnBatch &input) {
+    for (uint column = 0; column < this->column_names.size(); column++) {
+        int from = input.column_index(this->column_names[column]);
+        if (from < 0)
+            throw DbRelationError("table does not have column named '" + this->column_names[column] + "'");
+        this->int_columns[column].swap(input.int_columns[from]);
+        this->text_columns[column].swap(input.text_columns[from]);
+    }
+    this->selection.swap(input.selection);
+    this->row_count = input.row_count;
+}
+
+ValueDict *ColumnBatch::row(uint32_t position) const {
+    ValueDict *row = new ValueDict();
+    for (uint column = 0; column < this->column_names.size(); column++) {
+        Value value;
+        if (this->data_types[column] == ColumnAttribute::TEXT)
+            value = Value(this->text_columns[column][position]);
+        else
+            value.n = this->int_columns[column][position];
+        value.data_type = this->data_types[column];
+        (*row)[this->column_names[column]] = value;
+    }
+    return row;
+}
+
+// Copy the values of each row of the block into the batch.
+void DbRelation::project_block(BlockID block_id, ColumnBatch &batch) {
+    ValueDicts *rows = project_block(block_id);
+    const ColumnNames &column_names = batch.get_column_names();
+    for (auto const &row: *rows) {
+        for (uint column = 0; column < column_names.size(); column++) {
+            const Value &value = row->at(column_names[column]);
+            if (batch.get_data_type(column) == ColumnAttribute::TEXT)
+                batch.texts(column).push_back(value.s);
+            else
+                batch.ints(column).push_back(value.n);
+        }
+        batch.add_row();
+        delete row;
+    }
+    delete rows;
+}
+
+// Read the relation once, a block at a time, then build every index from the rows in parallel. If any fail, the
+// first error is thrown (after all have finished).
+void DbIndex::create_all(DbRelation &relation, const std::vector<DbIndex *> &indices) {
+    ColumnNames column_names;  // the key and included columns of any of the indices
+    for (auto const &index: indices)
+        for (auto const *columns: {&index->get_key_columns(), &index->get_include_columns()})
+            for (auto const &column_name: *columns)
+                if (std::find(column_names.begin(), column_names.end(), column_name) == column_names.end())
+                    column_names.push_back(column_name);
+    Handles *handles = new Handles();
+    ValueDicts rows;
+    BlockID block_count = relation.get_block_count();
+    for (BlockID block_id = 1; block_id <= block_count; block_id++) {
+        ValueDicts *block_rows = relation.project_block(block_id, handles);
+        for (auto const &row: *block_rows) {
+            ValueDict *projected = new ValueDict();
+            for (auto const &column_name: column_names)
+                (*projected)[column_name] = row->at(column_name);
+            rows.push_back(projected);
+            delete row;
+        }
+        delete block_rows;
+    }
+    std::vector<std::exception_ptr> errors(indices.size());
+    std::vector<std::thread> workers;
+    for (u_long i = 0; i < indices.size(); i++)
+        workers.push_back(std::thread([&, i]() {
+            try {
+                indices[i]->create(handles, &rows);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }));
+    for (auto &worker: workers)
+        worker.join();
+    for (auto row: rows)
+        delete row;
+    delete handles;
+    for (auto const &error: errors)
+        if (error)
+            std::rethrow_exception(error);
+}
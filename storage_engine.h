@@ -9,6 +9,7 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <exception>
 #include <map>
 #include <utility>
@@ -262,6 +263,52 @@ typedef std::vector<Handle> Handles;  // FIXME: will need to turn this into an i
 typedef std::map<Identifier, Value> ValueDict;
 typedef std::vector<ValueDict *> ValueDicts;
 
+/**
+ * @class ColumnBatch - a batch of rows stored a column at a time, for vectorized execution.
+ *
+ * Each column is a vector of its values: int32_t for INT and BOOLEAN columns, std::string for TEXT. The selection
+ * vector holds the positions (in ascending order) of the rows still in the batch; filtering shrinks it rather than
+ * moving any values.
+ */
+class ColumnBatch {
+public:
+    static const u_long CAPACITY = 1024;  // rows a scan puts in a batch (it stops adding blocks once this is reached)
+
+    ColumnBatch(const ColumnNames &column_names, const ColumnAttributes &column_attributes);
+
+    virtual ~ColumnBatch() {}
+
+    const ColumnNames &get_column_names() const { return this->column_names; }
+
+    ColumnAttribute::DataType get_data_type(uint column) const { return this->data_types[column]; }
+
+    int column_index(const Identifier &column_name) const;  // -1 if the batch doesn't have that column
+
+    std::vector<int32_t> &ints(uint column) { return this->int_columns[column]; }  // INT and BOOLEAN columns
+
+    std::vector<std::string> &texts(uint column) { return this->text_columns[column]; }  // TEXT columns
+
+    std::vector<uint32_t> &get_selection() { return this->selection; }
+
+    u_long size() const { return this->row_count; }  // rows in the batch, whether selected or not
+
+    void add_row() { this->selection.push_back((uint32_t) this->row_count++); }  // after appending its values
+
+    void clear();
+
+    void project_from(ColumnBatch &input);  // take over our columns' vectors and the selection from input
+
+    ValueDict *row(uint32_t position) const;  // (freed by caller)
+
+protected:
+    ColumnNames column_names;
+    std::vector<ColumnAttribute::DataType> data_types;
+    std::vector<std::vector<int32_t>> int_columns;  // empty for TEXT columns
+    std::vector<std::vector<std::string>> text_columns;  // empty for INT and BOOLEAN columns
+    std::vector<uint32_t> selection;
+    u_long row_count;
+};
+
 
 /**
  * @class DbRelationError - generic exception class for DbRelation
@@ -406,6 +453,32 @@ public:
 
     virtual ValueDicts *project(Handles *handles, const ValueDict *column_names);
 
+    /**
+     * How many blocks the relation is stored in, for scanning it a block at a time (see project_block).
+     * @returns  the number of blocks (numbered from 1)
+     */
+    virtual BlockID get_block_count() {
+        throw DbRelationError("block-at-a-time scans not supported");
+    }
+
+    /**
+     * Return all the rows stored in one block, so a scan need only hold a block's worth of rows at a time.
+     * @param block_id  which block (1 to get_block_count())
+     * @param handles   if given, the rows' handles get appended onto it, in the same order
+     * @returns         the rows, in the block's order (freed by caller)
+     */
+    virtual ValueDicts *project_block(BlockID block_id, Handles *handles = nullptr) {
+        throw DbRelationError("block-at-a-time scans not supported");
+    }
+
+    /**
+     * Append all the rows stored in one block onto a batch (just the batch's columns, which the relation must
+     * have). By default each row is read as with project_block and its values copied in.
+     * @param block_id  which block (1 to get_block_count())
+     * @param batch     the batch to add the rows to
+     */
+    virtual void project_block(BlockID block_id, ColumnBatch &batch);
+
     /**
      * Accessor for column_names.
      * @returns column_names   list of column names for this relation, in order
@@ -445,6 +518,49 @@ protected:
     ColumnAttributes column_attributes;
 };
 
+/**
+ * @class IndexStats - the shape of an index, for SHOW INDEX STATS and for estimating what using it would cost.
+ */
+class IndexStats {
+public:
+    uint height;  // levels from the root down to (and including) the leaves
+    u_long leaf_pages;
+    u_long interior_pages;
+    double fill;  // average fraction of each leaf block in use
+    u_long key_count;
+    u_long splits;  // node splits since the index was created
+    bool has_filter;
+    double filter_false_positive_rate;  // observed since the filter was opened
+    double filter_expected_false_positive_rate;  // from the filter's size and key count
+
+    IndexStats() : height(0), leaf_pages(0), interior_pages(0), fill(0.0), key_count(0), splits(0),
+                   has_filter(false), filter_false_positive_rate(0.0), filter_expected_false_positive_rate(0.0) {}
+};
+
+/**
+ * @class IndexCursor - the handles of a range of an index's keys, in key order, handed over a batch at a time, so
+ * that a reader who stops partway hasn't paid for the rest of the range. This one holds the whole range as a single
+ * batch; indices that can do better (a B-tree, a leaf at a time) subclass it.
+ */
+class IndexCursor {
+public:
+    IndexCursor(Handles *handles = nullptr) : handles(handles) {}
+
+    virtual ~IndexCursor() { delete this->handles; }
+
+    // replace handles with the next batch, or return false once there are no more
+    virtual bool next(Handles &handles) {
+        if (this->handles == nullptr)
+            return false;
+        handles.swap(*this->handles);
+        delete this->handles;
+        this->handles = nullptr;
+        return true;
+    }
+
+protected:
+    Handles *handles;  // the range, until it is handed over
+};
 
 class DbIndex {
 public:
@@ -466,6 +582,24 @@ public:
      */
     virtual void create() = 0;
 
+    /**
+     * Create this index from rows of the relation that have already been read (see create_all), rather
+     * than scanning the relation itself. By default the rows are ignored and the relation scanned anyway.
+     * @param handles  every row in the relation
+     * @param rows     the values of those rows, in the same order
+     */
+    virtual void create(const Handles *handles, const ValueDicts *rows) {
+        create();
+    }
+
+    /**
+     * Create several indices on a relation with just one scan of it (a block at a time, keeping only the columns
+     * the indices need), each index then building itself from the rows on a thread of its own.
+     * @param relation  the relation all of the indices are on
+     * @param indices   the indices to create
+     */
+    static void create_all(DbRelation &relation, const std::vector<DbIndex *> &indices);
+
     /**
      * Drop this index.
      */
@@ -488,6 +622,123 @@ public:
      */
     virtual Handles *lookup(ValueDict *key_values) const = 0;
 
+    /**
+     * Lookup many search keys at once (for an IN list, or the inner side of a join). The default just does
+     * one lookup per key; indices that can share the work between keys override it.
+     * @param keys  dictionaries of values for the search keys
+     * @returns     handles of the records matching any of the keys, each once, sorted so that they can be
+     *              fetched from the relation in block order (freed by caller)
+     */
+    virtual Handles *lookup_many(const ValueDicts *keys) const {
+        Handles *handles = new Handles();
+        for (auto const &key: *keys) {
+            Handles *found = lookup(key);
+            handles->insert(handles->end(), found->begin(), found->end());
+            delete found;
+        }
+        std::sort(handles->begin(), handles->end());
+        handles->erase(std::unique(handles->begin(), handles->end()), handles->end());
+        return handles;
+    }
+
+    /**
+     * Lookup a specific search key and return column values straight from the index, without
+     * reading the relation (an index-only scan).
+     * @param key_values    dictionary of values for the search key
+     * @param column_names  columns to return (all of which must be covered by the index)
+     * @returns             list of rows with just column_names (freed by caller)
+     */
+    virtual ValueDicts *lookup_values(ValueDict *key_values, const ColumnNames *column_names) const {
+        throw DbRelationError("index-only lookup not supported");
+    }
+
+    /**
+     * Can the index answer for all these columns on its own (see lookup_values)?
+     * @param column_names  columns a query needs
+     * @returns             true if every one is stored in the index
+     */
+    virtual bool covers(const ColumnNames &column_names) const {
+        return false;
+    }
+
+    /**
+     * Could any record have these values for the search key? A false answer is certain (and comes
+     * without reading the relation); a true one is only a maybe. Indices without a filter always say maybe.
+     * @param key_values  dictionary of values for (at least) the search key columns
+     * @returns           false if no record matches key_values
+     */
+    virtual bool may_contain(const ValueDict *key_values) const {
+        return true;
+    }
+
+    /**
+     * Does the index have a filter that may_contain can rule keys out with?
+     */
+    virtual bool has_filter() const {
+        return false;
+    }
+
+    /**
+     * Build (or rebuild, sized for the keys now in the index) a persistent filter for may_contain.
+     */
+    virtual void create_filter() {
+        throw DbRelationError("index does not support filters");
+    }
+
+    /**
+     * Walk the index and describe its shape.
+     * @returns  the index's statistics
+     */
+    virtual IndexStats get_stats() const {
+        throw DbRelationError("index statistics not supported");
+    }
+
+    /**
+     * How many blocks a lookup reads to get to a key's entries, for estimating costs. Unlike get_stats, this
+     * mustn't walk the index. Indices that aren't trees find a key in about one read.
+     * @returns  levels from the top of the index down to the entries
+     */
+    virtual uint get_height() const {
+        return 1;
+    }
+
+    /**
+     * Get the search key columns (in order).
+     */
+    virtual const ColumnNames &get_key_columns() const {
+        return key_columns;
+    }
+
+    /**
+     * Get the non-key columns the index keeps with its entries (see covers), if any.
+     */
+    virtual const ColumnNames &get_include_columns() const {
+        static const ColumnNames none;
+        return none;
+    }
+
+    /**
+     * Accessor method for the index name
+     * @returns  name
+     */
+    virtual Identifier get_index_name() const {
+        return name;
+    }
+
+    /**
+     * Whether the index allows only one row per key.
+     */
+    virtual bool is_unique() const {
+        return unique;
+    }
+
+    /**
+     * Whether the index keeps its keys in order, so that range can give rows in key order.
+     */
+    virtual bool is_ordered() const {
+        return false;
+    }
+
     /**
      * Lookup a range of search keys.
      * @param min_key  dictionary of min (inclusive) search key
@@ -498,6 +749,16 @@ public:
         throw DbRelationError("range index query not supported");
     }
 
+    /**
+     * Lookup a range of search keys a batch at a time (see IndexCursor). By default the batch is all of range.
+     * @param min_key  dictionary of min (inclusive) search key, or nullptr for no lower bound
+     * @param max_key  dictionary of max (inclusive) search key, or nullptr for no upper bound
+     * @returns        a cursor over the handles for records in range (freed by caller)
+     */
+    virtual IndexCursor *cursor(ValueDict *min_key, ValueDict *max_key) const {
+        return new IndexCursor(range(min_key, max_key));
+    }
+
     /**
      * Insert the index entry for the given record.
      * @param record  handle (into relation) to the record to insert
@@ -505,6 +766,16 @@ public:
      */
     virtual void insert(Handle record) = 0;
 
+    /**
+     * Insert the index entry for the given record, taking its values from row rather than reading
+     * the record back from the relation.
+     * @param record  handle (into relation) to the record to insert
+     * @param row     the record's values (at least the ones the index stores)
+     */
+    virtual void insert(Handle record, const ValueDict *row) {
+        insert(record);
+    }
+
     /**
      * Delete the index entry for the given record.
      * @param record  handle (into relation) to the record to remove
@@ -512,6 +783,16 @@ public:
      */
     virtual void del(Handle record) = 0;
 
+    /**
+     * Delete the index entry for the given record, taking its key from row rather than reading
+     * the record from the relation.
+     * @param record  handle (into relation) to the record to remove
+     * @param row     the record's values (at least the key columns)
+     */
+    virtual void del(Handle record, const ValueDict *row) {
+        del(record);
+    }
+
 protected:
     DbRelation &relation;
     Identifier name;